@@ -0,0 +1,486 @@
+/* ascparse.cpp
+
+  Parallel .asc parser, see ascparse.h. Numbers are parsed by hand: the
+  digits are collected in a 64 bit integer and scaled by an exact power of
+  ten, which gives the same float as strtof for everything a terrain grid
+  holds. Anything unusual (very long mantissas, large exponents, nan, inf)
+  falls back to strtod.
+
+*/
+
+#include "ascparse.h"
+#include "kernels.h"
+#include "raster.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+static inline bool isSpace(char c) {
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\f' ||
+    c == '\v';
+}
+
+static const double POW10[23] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static const char* slowFloat(const char* p, const char* end, float& out) {
+  //strtod needs a terminated string, so the token is copied first
+  char token[64];
+  int n = 0;
+  while (p + n < end && !isSpace(p[n]) && n < 63) {token[n] = p[n]; n++;}
+  token[n] = 0;
+  char* stop;
+  out = (float)strtod(token, &stop);
+  if (stop == token) {out = 0;}
+  while (p + n < end && !isSpace(p[n])) {n++;}
+  return p + n;
+}
+
+const char* parseFloat(const char* p, const char* end, float& out) {
+  const char* start = p;
+  bool negative = false;
+  if (*p == '-' || *p == '+') {negative = (*p == '-'); p++;}
+  uint64_t mantissa = 0;
+  int digits = 0, exponent = 0;
+  bool any = false;
+  while (p < end && *p >= '0' && *p <= '9') {
+    if (digits < 19) {
+      mantissa = mantissa*10 + (*p - '0');
+      if (mantissa) {digits++;}
+    }
+    else {exponent++;}
+    p++;
+    any = true;
+  }
+  if (p < end && *p == '.') {
+    p++;
+    while (p < end && *p >= '0' && *p <= '9') {
+      if (digits < 19) {
+        mantissa = mantissa*10 + (*p - '0');
+        if (mantissa) {digits++;}
+        exponent--;
+      }
+      p++;
+      any = true;
+    }
+  }
+  if (!any) {return slowFloat(start, end, out);}
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    p++;
+    bool negexp = false;
+    if (p < end && (*p == '-' || *p == '+')) {negexp = (*p == '-'); p++;}
+    int e = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+      if (e < 10000) {e = e*10 + (*p - '0');}
+      p++;
+    }
+    exponent += negexp ? -e : e;
+  }
+  if (p < end && !isSpace(*p)) {return slowFloat(start, end, out);}
+  //Exact when the mantissa fits in a double and the power of ten is exact
+  if (mantissa >= (1ULL << 53) || exponent < -22 || exponent > 22) {
+    return slowFloat(start, end, out);
+  }
+  double v = (double)mantissa;
+  if (exponent < 0) {v /= POW10[-exponent];}
+  else {v *= POW10[exponent];}
+  out = (float)(negative ? -v : v);
+  return p;
+}
+
+//What each thread works out about its block. Padded so the threads do not
+//share cache lines.
+struct alignas(64) Block {
+  const char* begin;
+  const char* end;
+  long count;
+  long first;
+  float maxz;
+  long land;
+};
+
+static void countBlock(Block* b) {
+  long count = 0;
+  const char* p = b->begin;
+  while (p < b->end) {
+    while (p < b->end && isSpace(*p)) {p++;}
+    if (p == b->end) {break;}
+    count++;
+    while (p < b->end && !isSpace(*p)) {p++;}
+  }
+  b->count = count;
+}
+
+static void parseBlock(Block* b, AscGrid* g, long total) {
+  long k = b->first;
+  long last = b->first + b->count;
+  if (last > total) {last = total;}
+  const char* p = b->begin;
+  while (k < last) {
+    while (isSpace(*p)) {p++;}
+    float v;
+    p = parseFloat(p, b->end, v);
+    g->values[k] = v;
+    k++;
+  }
+  //The block was just written, so classifying it is a pass over the cache
+  float maxz = 0;
+  long n = last > b->first ? last - b->first : 0;
+  b->land = classifyMask(g->values + b->first, n, g->h.ndval,
+    g->ocean + b->first, maxz);
+  b->maxz = maxz;
+}
+
+bool parseAscFile(const char* filename, AscGrid& g, int nthreads) {
+  g.values = NULL;
+  g.ocean = NULL;
+  FILE* f = fopen(filename, "r");
+  if (f == NULL) {
+    printf("cannot open %s\n", filename);
+    return false;
+  }
+  if (!readAscHeader(f, g.h)) {
+    printf("%s does not start with an ncols/nrows header\n", filename);
+    fclose(f);
+    return false;
+  }
+  long offset = ftell(f);
+  fclose(f);
+
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    printf("cannot open %s\n", filename);
+    if (fd >= 0) {close(fd);}
+    return false;
+  }
+  size_t length = st.st_size;
+  void* base = length ? mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0)
+    : MAP_FAILED;
+  close(fd);
+  if (base == MAP_FAILED) {
+    printf("cannot map %s\n", filename);
+    return false;
+  }
+  madvise(base, length, MADV_SEQUENTIAL);
+  const char* data = (const char*)base + offset;
+  const char* end = (const char*)base + length;
+
+  //Cuts the values into one block per thread. Each cut is moved forward
+  //to the next whitespace so no number is split between two blocks.
+  if (nthreads < 1) {nthreads = 1;}
+  vector<Block> blocks(nthreads);
+  size_t share = (end - data) / nthreads;
+  const char* cut = data;
+  for (int t = 0; t < nthreads; t++) {
+    blocks[t].begin = cut;
+    cut = (t == nthreads-1) ? end : blocks[t].begin + share;
+    if (cut > end) {cut = end;}
+    while (cut < end && !isSpace(*cut)) {cut++;}
+    blocks[t].end = cut;
+  }
+
+  vector<thread> threads;
+  for (int t = 1; t < nthreads; t++) {
+    threads.push_back(thread(countBlock, &blocks[t]));
+  }
+  countBlock(&blocks[0]);
+  for (size_t t = 0; t < threads.size(); t++) {threads[t].join();}
+  threads.clear();
+
+  long total = (long)g.h.nrows * g.h.ncols;
+  long found = 0;
+  for (int t = 0; t < nthreads; t++) {
+    blocks[t].first = found;
+    found += blocks[t].count;
+  }
+  if (found < total) {
+    printf("%s ends after %ld of %ld values\n", filename, found, total);
+    munmap(base, length);
+    return false;
+  }
+
+  try {
+    g.values = (float*)allocateAligned(total * sizeof(float));
+    g.ocean = (unsigned char*)allocateAligned(total);
+  }
+  catch (std::bad_alloc&) {
+    printf("not enough memory for a %d by %d grid\n", g.h.nrows, g.h.ncols);
+    free(g.values);
+    g.values = NULL;
+    munmap(base, length);
+    return false;
+  }
+  for (int t = 1; t < nthreads; t++) {
+    threads.push_back(thread(parseBlock, &blocks[t], &g, total));
+  }
+  parseBlock(&blocks[0], &g, total);
+  for (size_t t = 0; t < threads.size(); t++) {threads[t].join();}
+  munmap(base, length);
+
+  g.maxz = 0;
+  g.land = 0;
+  for (int t = 0; t < nthreads; t++) {
+    if (blocks[t].maxz > g.maxz) {g.maxz = blocks[t].maxz;}
+    g.land += blocks[t].land;
+  }
+  return true;
+}
+
+//Skips n values from p, or returns NULL if there are fewer before end
+static const char* skipValues(const char* p, const char* end, long n) {
+  for (; n > 0; n--) {
+    while (p < end && isSpace(*p)) {p++;}
+    if (p == end) {return NULL;}
+    while (p < end && !isSpace(*p)) {p++;}
+  }
+  return p;
+}
+
+//Parses columns col..col+cols-1 of a row of ncols values starting at p
+//into out. Returns the end of the row, or NULL if it ends before end does.
+static const char* parseRow(const char* p, const char* end, int ncols,
+                            int col, int cols, float* out) {
+  p = skipValues(p, end, col);
+  for (int j = 0; p && j < cols; j++) {
+    while (p < end && isSpace(*p)) {p++;}
+    if (p == end) {return NULL;}
+    p = parseFloat(p, end, out[j]);
+  }
+  return p ? skipValues(p, end, ncols - col - cols) : NULL;
+}
+
+//The end of the line that p is on, or end
+static const char* lineEnd(const char* p, const char* end) {
+  const char* n = (const char*)memchr(p, '\n', end - p);
+  return n ? n : end;
+}
+
+//What each thread of parseAscWindow() works on: the lines of rows first..
+//last-1 of the window, which it parses and classifies
+struct alignas(64) WindowRows {
+  const vector<const char*>* lines;
+  const char* end;
+  AscGrid* g;
+  int col, cols, first, last;
+  float maxz;
+  long land;
+  bool ok;
+};
+
+static void parseWindowRows(WindowRows* w) {
+  //A line holds exactly one row, or the file is not read a line at a time
+  float maxz = 0;
+  w->land = 0;
+  w->ok = true;
+  for (int i = w->first; w->ok && i < w->last; i++) {
+    const char* p = (*w->lines)[i];
+    const char* e = lineEnd(p, w->end);
+    float* out = w->g->values + (size_t)i*w->cols;
+    p = parseRow(p, e, w->g->h.ncols, w->col, w->cols, out);
+    while (p && p < e && isSpace(*p)) {p++;}
+    w->ok = p == e;
+    w->land += classifyMask(out, w->cols, w->g->h.ndval,
+      w->g->ocean + (size_t)i*w->cols, maxz);
+  }
+  w->maxz = maxz;
+}
+
+bool parseAscWindow(const char* filename, int row, int col, int rows,
+                    int cols, AscGrid& g, int nthreads) {
+  g.values = NULL;
+  g.ocean = NULL;
+  FILE* f = fopen(filename, "r");
+  if (f == NULL) {
+    printf("cannot open %s\n", filename);
+    return false;
+  }
+  if (!readAscHeader(f, g.h)) {
+    printf("%s does not start with an ncols/nrows header\n", filename);
+    fclose(f);
+    return false;
+  }
+  long offset = ftell(f);
+  fclose(f);
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    printf("cannot open %s\n", filename);
+    if (fd >= 0) {close(fd);}
+    return false;
+  }
+  size_t length = st.st_size;
+  void* base = length ? mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0)
+    : MAP_FAILED;
+  close(fd);
+  if (base == MAP_FAILED) {
+    printf("cannot map %s\n", filename);
+    return false;
+  }
+  madvise(base, length, MADV_SEQUENTIAL);
+  const char* data = (const char*)base + offset;
+  const char* end = (const char*)base + length;
+  while (data < end && isSpace(*data)) {data++;}
+  size_t n = (size_t)rows * cols;
+  try {
+    g.values = (float*)allocateAligned(n * sizeof(float));
+    g.ocean = (unsigned char*)allocateAligned(n);
+  }
+  catch (std::bad_alloc&) {
+    printf("not enough memory for a %d by %d window\n", rows, cols);
+    free(g.values);
+    g.values = NULL;
+    munmap(base, length);
+    return false;
+  }
+
+  //If the first line is a whole row, the rows before the window are
+  //skipped by their line ends and the lines of the window found the same
+  //way, to be parsed on all threads
+  const char* p = data;
+  const char* first = skipValues(data, lineEnd(data, end), g.h.ncols);
+  while (first && first < end && *first != '\n' && isSpace(*first)) {
+    first++;
+  }
+  bool byLine = first && (first == end || *first == '\n');
+  vector<const char*> lines;
+  for (int i = 0; byLine && i < row + rows; i++) {
+    if (p >= end) {
+      byLine = false;
+      break;
+    }
+    if (i >= row) {lines.push_back(p);}
+    p = lineEnd(p, end) + 1;
+  }
+  bool ok = byLine;
+  g.maxz = 0;
+  g.land = 0;
+  if (byLine) {
+    if (nthreads < 1) {nthreads = 1;}
+    nthreads = min(nthreads, rows);
+    vector<WindowRows> w(nthreads);
+    vector<thread> threads;
+    for (int t = 0; t < nthreads; t++) {
+      w[t].lines = &lines;
+      w[t].end = end;
+      w[t].g = &g;
+      w[t].col = col;
+      w[t].cols = cols;
+      w[t].first = (long)rows * t / nthreads;
+      w[t].last = (long)rows * (t+1) / nthreads;
+      if (t > 0) {threads.push_back(thread(parseWindowRows, &w[t]));}
+    }
+    parseWindowRows(&w[0]);
+    for (size_t t = 0; t < threads.size(); t++) {threads[t].join();}
+    for (int t = 0; t < nthreads; t++) {
+      ok = ok && w[t].ok;
+      if (w[t].maxz > g.maxz) {g.maxz = w[t].maxz;}
+      g.land += w[t].land;
+    }
+  }
+  if (!ok) {
+    //Rows wrapped over several lines: the values are counted from the
+    //start instead, a row at a time
+    g.land = 0;
+    g.maxz = 0;
+    p = skipValues(data, end, (long)row * g.h.ncols);
+    for (int i = 0; p && i < rows; i++) {
+      float* out = g.values + (size_t)i*cols;
+      p = parseRow(p, end, g.h.ncols, col, cols, out);
+      if (p == NULL) {break;}
+      g.land += classifyMask(out, cols, g.h.ndval, g.ocean + (size_t)i*cols,
+        g.maxz);
+    }
+    ok = p != NULL;
+  }
+  munmap(base, length);
+  if (!ok) {
+    printf("%s ends before row %d\n", filename, row + rows);
+    free(g.values);
+    free(g.ocean);
+    g.values = NULL;
+    g.ocean = NULL;
+  }
+  return ok;
+}
+
+bool convertAscToCache(const char* ascfile, const char* cachefile) {
+  FILE* f = fopen(ascfile, "r");
+  GridHeader h;
+  if (f == NULL || !readAscHeader(f, h)) {
+    printf("cannot read the header of %s\n", ascfile);
+    if (f) {fclose(f);}
+    return false;
+  }
+  FILE* out = fopen(cachefile, "wb");
+  if (out == NULL) {
+    printf("cannot open %s\n", cachefile);
+    fclose(f);
+    return false;
+  }
+  unsigned char header[GRIDCACHE_HEADER];
+  encodeGridHeader(h, header, ascfile);
+  bool ok = fwrite(header, 1, GRIDCACHE_HEADER, out) == GRIDCACHE_HEADER;
+
+  //Blocks of 8MB. A number cut off at the end of a block is moved to the
+  //front of the buffer and finished with the next block.
+  const size_t BLOCKSIZE = 1 << 23;
+  vector<char> buffer(BLOCKSIZE + 64);
+  vector<float> row(h.ncols);
+  long total = (long)h.nrows * h.ncols, done = 0;
+  size_t kept = 0;
+  bool eof = false;
+  while (ok && done < total && !(eof && kept == 0)) {
+    size_t got = eof ? 0 : fread(buffer.data() + kept, 1, BLOCKSIZE, f);
+    if (got == 0) {eof = true;}
+    const char* p = buffer.data();
+    const char* end = p + kept + got;
+    //Only whole numbers are parsed, unless the file is finished
+    const char* stop = end;
+    if (!eof) {
+      while (stop > p && !isSpace(stop[-1])) {stop--;}
+    }
+    while (ok && done < total) {
+      while (p < stop && isSpace(*p)) {p++;}
+      if (p >= stop) {break;}
+      float v;
+      p = parseFloat(p, stop, v);
+      row[done % h.ncols] = v;
+      done++;
+      if (done % h.ncols == 0) {
+        floatsToLittleEndian(row.data(), h.ncols);
+        ok = fwrite(row.data(), sizeof(float), h.ncols, out) ==
+          (size_t)h.ncols;
+      }
+    }
+    kept = end - p;
+    if (eof) {kept = 0;}
+    if (kept > 64) {
+      //More than a number's worth left over; only whitespace can be that
+      //long, so it is dropped
+      kept = 0;
+      p = end;
+    }
+    memmove(buffer.data(), p, kept);
+  }
+  fclose(f);
+  if (fclose(out) != 0) {ok = false;}
+  if (ok && done < total) {
+    printf("%s ends after %ld of %ld values\n", ascfile, done, total);
+    ok = false;
+  }
+  if (!ok) {remove(cachefile);}
+  return ok;
+}
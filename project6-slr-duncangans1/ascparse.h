@@ -0,0 +1,51 @@
+/* ascparse.h
+
+  Parallel parser for the values of an .asc terrain grid. The file is
+  mapped into memory and cut into one block per thread at whitespace
+  boundaries. Each thread counts the values in its block, and after the
+  counts are added up, parses its block straight into its part of a flat
+  row-major buffer. The ocean/NODATA mask, the highest point and the number
+  of land points are reduced per thread while parsing.
+
+*/
+
+#ifndef ASCPARSE_H
+#define ASCPARSE_H
+
+#include "gridio.h"
+
+struct AscGrid {
+  GridHeader h;
+  //nrows*ncols values, row after row. Allocated with allocateAligned()
+  //and freed by the caller, usually by handing it to a Raster
+  float* values;
+  //1 where the value is NODATA or at or below 0, allocated like values
+  unsigned char* ocean;
+  //Highest value (never below 0) and number of points that are not ocean
+  float maxz;
+  long land;
+};
+
+//Parses filename with nthreads threads. Prints a message and returns false
+//if the file cannot be read or holds fewer than nrows*ncols values.
+bool parseAscFile(const char* filename, AscGrid& g, int nthreads);
+
+//Parses only the rows row..row+rows-1 and columns col..col+cols-1 of
+//filename into g, which gets the header of the whole grid. When the file
+//has a row per line, the rows before the window are skipped a line at a
+//time without looking at the values and the window is parsed on nthreads
+//threads; otherwise the values before it are counted. Nothing after the
+//window is read. Prints a message and returns false if the file cannot be
+//read or ends before the window does.
+bool parseAscWindow(const char* filename, int row, int col, int rows,
+                    int cols, AscGrid& g, int nthreads);
+
+//Converts an .asc file to a binary grid cache a block at a time, without
+//holding the grid in memory. Prints a message and returns false on error.
+bool convertAscToCache(const char* ascfile, const char* cachefile);
+
+//Parses one number starting at p, where p < end and *p is not whitespace.
+//Returns the first character after it.
+const char* parseFloat(const char* p, const char* end, float& out);
+
+#endif
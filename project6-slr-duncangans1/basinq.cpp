@@ -0,0 +1,92 @@
+/* basinq.cpp
+
+  Answers what-if questions from a basin tree written by slr -basins,
+  without the terrain: which basin a point is in, the sea level at which
+  the ocean reaches it and the pass it comes through, where the basin
+  spills, and how much of it is under water at the levels given. Areas
+  and volumes are in the units of the grid (cellsize squared, times the
+  height unit for volumes).
+
+  usage: basinq <tree> <row> <col> [level ...]
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <chrono>
+#include <vector>
+#include "basins.h"
+
+using namespace std;
+
+static double seconds() {
+  return chrono::duration<double>(
+    chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void printPoint(const BasinTree& t, int cell) {
+  printf("(%d, %d)", cell / t.h.ncols, cell % t.h.ncols);
+}
+
+int main(int argc, char** argv) {
+  if (argc < 4) {
+    printf("usage: %s <tree> <row> <col> [level ...]\n", argv[0]);
+    exit(1);
+  }
+  double w = seconds();
+  BasinTree t;
+  if (!readBasins(argv[1], t)) {exit(1);}
+  printf("Reading %lu basins takes %f seconds\n",
+    (unsigned long)t.basins.size(), seconds() - w);
+  int row = atoi(argv[2]), col = atoi(argv[3]);
+  if (row < 0 || row >= t.h.nrows || col < 0 || col >= t.h.ncols) {
+    printf("(%d, %d) is outside the %d by %d grid\n", row, col, t.h.nrows,
+      t.h.ncols);
+    exit(1);
+  }
+  vector<float> levels;
+  for (int a = 4; a < argc; a++) {levels.push_back(atof(argv[a]));}
+
+  //Everything is worked out first and printed after, so the time is the
+  //time of the queries alone
+  w = seconds();
+  int b = t.label(row, col);
+  const Basin& x = t.basins[b];
+  vector<double> area(levels.size()), volume(levels.size());
+  for (size_t l = 0; l < levels.size(); l++) {
+    basinFlooding(t, b, levels[l], area[l], volume[l]);
+  }
+  double took = seconds() - w;
+
+  double cellArea = t.h.cellsize * t.h.cellsize;
+  printf("(%d, %d) is in basin %d of %ld points, ", row, col, b,
+    (long)x.cells);
+  if (x.cell < 0) {printf("the ocean\n");}
+  else {
+    printf("%s ", x.children[0] < 0 ? "lowest at" : "joined at the pass");
+    printPoint(t, x.cell);
+    printf(" at %g\n", x.level);
+  }
+  if (x.parent >= 0) {
+    printf("It spills at %g into basin %d\n", x.spill, x.parent);
+  }
+  if (isinf(x.onset)) {printf("The ocean never reaches it\n");}
+  else if (x.ocean && x.cell >= 0) {
+    printf("It holds the ocean, and the point floods at its own height, "
+      "between %g and %g\n", x.level, x.top);
+  }
+  else if (x.ocean) {printf("The point is ocean\n");}
+  else {
+    printf("The ocean reaches it at sea level %g through the pass ",
+      x.onset);
+    printPoint(t, x.entry);
+    printf("\n");
+  }
+  for (size_t l = 0; l < levels.size(); l++) {
+    printf("At sea level %g: %.10g flooded, %.10g of water\n", levels[l],
+      area[l] * cellArea, volume[l] * cellArea);
+  }
+  printf("The queries take %.3f microseconds\n", took * 1e6);
+  return 0;
+}
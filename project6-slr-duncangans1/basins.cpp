@@ -0,0 +1,406 @@
+/* basins.cpp
+
+  Building, storing and querying the basin tree, see basins.h. The points
+  are sorted by height on all threads and joined with a union-find whose
+  roots hold the basin of their set, so building takes about as long as
+  the sort. Basins are numbered as they are made, so a parent always comes
+  after its children and one backwards sweep fills in where the ocean
+  reaches each basin.
+
+  The file layout is
+
+    bytes  0-7   "SLRB" and the format version (uint32)
+    bytes  8-15  ncols, nrows (int32)
+    bytes 16-39  xllcorner, yllcorner, cellsize (float64)
+    bytes 40-43  NODATA value (float32)
+    bytes 44-47  connectivity (int32)
+    bytes 48-55  number of basins (int64)
+    bytes 56-63  reserved, zero
+    then a record of 64 bytes for every basin, then the basin of every
+    point (int32), row after row
+
+  A record holds the fields of a Basin in order, four bytes each from
+  parent to reserved, four bytes of zero, then cells and heights. All of
+  it is little-endian, as in the .slrg cache.
+
+*/
+
+#include "basins.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <thread>
+
+using namespace std;
+
+static const char MAGIC[4] = {'S', 'L', 'R', 'B'};
+static const uint32_t VERSION = 1;
+static const int HEADER = 64;
+//Bytes of a basin in the file
+static const int RECORD = 64;
+
+static_assert(sizeof(Basin) == 64, "Basin is stored as it is in memory");
+
+//Sorts keys, slices of it on each thread and then merged pairwise
+static void sortKeys(vector<uint64_t>& keys, int nthreads) {
+  int parts = max(1, min(nthreads, (int)(keys.size() >> 16)));
+  vector<size_t> bound(parts + 1);
+  for (int p = 0; p <= parts; p++) {bound[p] = keys.size() * p / parts;}
+  vector<thread> threads;
+  for (int p = 0; p < parts; p++) {
+    threads.push_back(thread([&, p] {
+      sort(keys.begin() + bound[p], keys.begin() + bound[p+1]);
+    }));
+  }
+  for (size_t t = 0; t < threads.size(); t++) {threads[t].join();}
+  for (int width = 1; width < parts; width *= 2) {
+    threads.clear();
+    for (int p = 0; p + width < parts; p += 2*width) {
+      threads.push_back(thread([&, p, width] {
+        inplace_merge(keys.begin() + bound[p], keys.begin() + bound[p+width],
+          keys.begin() + bound[min(p + 2*width, parts)]);
+      }));
+    }
+    for (size_t t = 0; t < threads.size(); t++) {threads[t].join();}
+  }
+}
+
+//Bits of a float that sort as unsigned integers in the order of the floats
+static inline uint32_t orderedBits(float v) {
+  uint32_t u;
+  memcpy(&u, &v, 4);
+  return (u & 0x80000000u) ? ~u : (u | 0x80000000u);
+}
+
+static inline float fromOrderedBits(uint32_t u) {
+  u = (u & 0x80000000u) ? (u & 0x7fffffffu) : ~u;
+  float v;
+  memcpy(&v, &u, 4);
+  return v;
+}
+
+//Root of the set of point k. up[k] is the parent of k, or -(b+1) for a
+//root whose set is basin b. Halves the path on the way.
+static inline int findRoot(vector<int>& up, int k) {
+  while (up[k] >= 0) {
+    if (up[up[k]] >= 0) {up[k] = up[up[k]];}
+    k = up[k];
+  }
+  return k;
+}
+
+static Basin newBasin(int cell, float level, bool ocean) {
+  Basin b = {-1, {-1, -1}, cell, level, INFINITY, level, INFINITY, -1,
+    ocean, 0, 0, 0};
+  return b;
+}
+
+template <int N>
+static void joinPoints(const Raster<float>& grid, const vector<uint64_t>& keys,
+                       const BitMask& source, vector<int>& up,
+                       BasinTree& tree) {
+  int rows = grid.rows(), cols = grid.cols();
+  int sea = rows*cols;
+  vector<Basin>& basins = tree.basins;
+  for (size_t k = 0; k < keys.size(); k++) {
+    int c = (int)(uint32_t)keys[k];
+    float e = fromOrderedBits(keys[k] >> 32);
+
+    //The sets this point touches: its neighbours already taken, and the
+    //ocean for the sources
+    int roots[N+1];
+    int count = 0;
+    if (source[c]) {roots[count++] = findRoot(up, sea);}
+    int next[N];
+    int n = neighbours<N>(c, rows, cols, next);
+    for (int a = 0; a < n; a++) {
+      if (tree.label[next[a]] < 0) {continue;}
+      int r = findRoot(up, next[a]);
+      bool seen = false;
+      for (int b = 0; b < count; b++) {seen = seen || roots[b] == r;}
+      if (!seen) {roots[count++] = r;}
+    }
+
+    if (count == 0) {
+      //The lowest point of a new basin
+      up[c] = -(int)basins.size() - 1;
+      basins.push_back(newBasin(c, e, false));
+    }
+    else {
+      //Every other set joins the first at this point, the pass. The root
+      //of the bigger set stays the root.
+      int root = roots[0];
+      for (int r = 1; r < count; r++) {
+        int a = -up[root] - 1, b = -up[roots[r]] - 1;
+        Basin m = newBasin(c, e, basins[a].ocean || basins[b].ocean);
+        m.children[0] = a;
+        m.children[1] = b;
+        m.cells = basins[a].cells + basins[b].cells;
+        m.heights = basins[a].heights + basins[b].heights;
+        m.top = max(basins[a].top, basins[b].top);
+        int id = basins.size();
+        basins[a].parent = basins[b].parent = id;
+        basins[a].spill = basins[b].spill = e;
+        basins.push_back(m);
+        if (basins[a].cells < basins[b].cells) {swap(root, roots[r]);}
+        up[roots[r]] = root;
+        up[root] = -id - 1;
+      }
+      up[c] = root;
+    }
+    int b = -up[findRoot(up, c)] - 1;
+    tree.label[c] = b;
+    basins[b].cells++;
+    basins[b].heights += e;
+    basins[b].top = max(basins[b].top, e);
+  }
+}
+
+//Lists the basins holding the ocean, following the parents up from it
+static void findOceanBasins(BasinTree& tree) {
+  tree.oceanBasins.clear();
+  for (int b = 0; b >= 0; b = tree.basins[b].parent) {
+    tree.oceanBasins.push_back(b);
+  }
+}
+
+void buildBasins(const Raster<float>& grid, const GridHeader& h,
+                 const vector<int>& seeds, int connectivity, int nthreads,
+                 BasinTree& tree) {
+  int rows = grid.rows(), cols = grid.cols();
+  size_t n = grid.size();
+  tree.h = h;
+  tree.connectivity = connectivity;
+  tree.basins.clear();
+  tree.label.assign(rows, cols, -1);
+
+  //The sources of ocean are the ocean on the border and the seeds. All
+  //ocean and NODATA points are at -1.
+  BitMask source;
+  source.assign(rows, cols);
+  for (size_t k = 0; k < seeds.size(); k++) {source.set(seeds[k]);}
+  vector<uint64_t> keys(n);
+  for (size_t k = 0; k < n; k++) {
+    float e = grid[k];
+    bool low = e == h.ndval || e <= 0 || source[k];
+    if (low) {e = -1;}
+    int i = k / cols, j = k % cols;
+    if (low && (i == 0 || i == rows-1 || j == 0 || j == cols-1)) {
+      source.set(k);
+    }
+    keys[k] = (uint64_t)orderedBits(e) << 32 | (uint32_t)k;
+  }
+  sortKeys(keys, nthreads);
+
+  //The ocean is basin 0 and the set of the extra point after the grid
+  vector<int> up(n + 1);
+  up[n] = -1;
+  tree.basins.push_back(newBasin(-1, -1, true));
+  if (connectivity == 8) {joinPoints<8>(grid, keys, source, up, tree);}
+  else {joinPoints<4>(grid, keys, source, up, tree);}
+
+  //Parents come after their children, so going backwards every basin
+  //finds its parent done: the ocean reaches a basin when it first joins
+  //one holding the ocean
+  vector<Basin>& basins = tree.basins;
+  for (long b = basins.size() - 1; b >= 0; b--) {
+    Basin& x = basins[b];
+    if (x.ocean) {
+      x.onset = x.level;
+      x.entry = x.cell;
+    }
+    else if (x.parent >= 0) {
+      x.onset = basins[x.parent].onset;
+      x.entry = basins[x.parent].entry;
+    }
+  }
+  findOceanBasins(tree);
+}
+
+static void encodeBasin(const Basin& b, unsigned char* r) {
+  memset(r, 0, RECORD);
+  copyLE(r, &b.parent, 4);
+  copyLE(r+4, &b.children[0], 4);
+  copyLE(r+8, &b.children[1], 4);
+  copyLE(r+12, &b.cell, 4);
+  copyLE(r+16, &b.level, 4);
+  copyLE(r+20, &b.spill, 4);
+  copyLE(r+24, &b.top, 4);
+  copyLE(r+28, &b.onset, 4);
+  copyLE(r+32, &b.entry, 4);
+  copyLE(r+36, &b.ocean, 4);
+  copyLE(r+40, &b.reserved, 4);
+  copyLE(r+48, &b.cells, 8);
+  copyLE(r+56, &b.heights, 8);
+}
+
+static void decodeBasin(const unsigned char* r, Basin& b) {
+  copyLE(&b.parent, r, 4);
+  copyLE(&b.children[0], r+4, 4);
+  copyLE(&b.children[1], r+8, 4);
+  copyLE(&b.cell, r+12, 4);
+  copyLE(&b.level, r+16, 4);
+  copyLE(&b.spill, r+20, 4);
+  copyLE(&b.top, r+24, 4);
+  copyLE(&b.onset, r+28, 4);
+  copyLE(&b.entry, r+32, 4);
+  copyLE(&b.ocean, r+36, 4);
+  copyLE(&b.reserved, r+40, 4);
+  copyLE(&b.cells, r+48, 8);
+  copyLE(&b.heights, r+56, 8);
+}
+
+bool writeBasins(const char* filename, const BasinTree& tree) {
+  FILE* f = fopen(filename, "wb");
+  if (f == NULL) {
+    printf("cannot write basin tree %s\n", filename);
+    return false;
+  }
+  unsigned char header[HEADER];
+  memset(header, 0, HEADER);
+  int32_t ncols = tree.h.ncols, nrows = tree.h.nrows;
+  int32_t connectivity = tree.connectivity;
+  int64_t count = tree.basins.size();
+  memcpy(header, MAGIC, 4);
+  copyLE(header+4, &VERSION, 4);
+  copyLE(header+8, &ncols, 4);
+  copyLE(header+12, &nrows, 4);
+  copyLE(header+16, &tree.h.xllcorner, 8);
+  copyLE(header+24, &tree.h.yllcorner, 8);
+  copyLE(header+32, &tree.h.cellsize, 8);
+  copyLE(header+40, &tree.h.ndval, 4);
+  copyLE(header+44, &connectivity, 4);
+  copyLE(header+48, &count, 8);
+  vector<unsigned char> records((size_t)count*RECORD);
+  for (int64_t k = 0; k < count; k++) {
+    encodeBasin(tree.basins[k], &records[k*RECORD]);
+  }
+  bool ok = fwrite(header, 1, HEADER, f) == (size_t)HEADER &&
+    fwrite(records.data(), 1, records.size(), f) == records.size();
+  //The labels go out as they are on little-endian hosts, and a block at a
+  //time through a swapped copy on others
+  size_t n = tree.label.size();
+  const int* label = tree.label.data();
+  vector<int> swapped(min(n, (size_t)1 << 16));
+  for (size_t k = 0; ok && k < n; k += swapped.size()) {
+    size_t block = min(n - k, swapped.size());
+    const int* out = label + k;
+    if (!hostIsLittleEndian()) {
+      for (size_t m = 0; m < block; m++) {copyLE(&swapped[m], &out[m], 4);}
+      out = swapped.data();
+    }
+    ok = fwrite(out, sizeof(int), block, f) == block;
+  }
+  if (fclose(f) != 0) {ok = false;}
+  if (!ok) {
+    printf("cannot write basin tree %s\n", filename);
+    remove(filename);
+  }
+  return ok;
+}
+
+bool readBasins(const char* filename, BasinTree& tree) {
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < HEADER) {
+    if (fd >= 0) {close(fd);}
+    printf("cannot read basin tree %s\n", filename);
+    return false;
+  }
+  void* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    printf("cannot read basin tree %s\n", filename);
+    return false;
+  }
+  const unsigned char* header = (const unsigned char*)base;
+  uint32_t version;
+  int32_t ncols, nrows, connectivity;
+  int64_t count;
+  copyLE(&version, header+4, 4);
+  copyLE(&ncols, header+8, 4);
+  copyLE(&nrows, header+12, 4);
+  copyLE(&tree.h.xllcorner, header+16, 8);
+  copyLE(&tree.h.yllcorner, header+24, 8);
+  copyLE(&tree.h.cellsize, header+32, 8);
+  copyLE(&tree.h.ndval, header+40, 4);
+  copyLE(&connectivity, header+44, 4);
+  copyLE(&count, header+48, 8);
+  uint64_t size = HEADER + count*RECORD +
+    (uint64_t)ncols*nrows*sizeof(int);
+  if (memcmp(header, MAGIC, 4) != 0 || version != VERSION || ncols <= 0 ||
+      nrows <= 0 || count < 1 || (uint64_t)st.st_size < size) {
+    munmap(base, st.st_size);
+    printf("%s is not a basin tree\n", filename);
+    return false;
+  }
+  tree.h.ncols = ncols;
+  tree.h.nrows = nrows;
+  tree.connectivity = connectivity;
+  const unsigned char* records = header + HEADER;
+  tree.basins.resize(count);
+  for (int64_t k = 0; k < count; k++) {
+    decodeBasin(records + k*RECORD, tree.basins[k]);
+  }
+  //The labels stay in the mapping, which the raster lets go of, except on
+  //big-endian hosts, where they are swapped into a copy
+  int* label = (int*)(records + count*RECORD);
+  if (hostIsLittleEndian()) {
+    tree.label.adopt(nrows, ncols, label, releaseGridCache, base,
+      st.st_size);
+  }
+  else {
+    size_t n = (size_t)ncols*nrows;
+    int* copy = (int*)malloc(n*sizeof(int));
+    for (size_t k = 0; k < n; k++) {copyLE(&copy[k], &label[k], 4);}
+    munmap(base, st.st_size);
+    tree.label.adopt(nrows, ncols, copy, releaseGridCache, copy, 0);
+  }
+  findOceanBasins(tree);
+  return true;
+}
+
+void basinFlooding(const BasinTree& tree, int b, float level, double& area,
+                   double& volume) {
+  area = volume = 0;
+  if (tree.basins[b].ocean && level < tree.basins[b].top) {
+    //Below its highest point, what is flooded of a basin holding the
+    //ocean is what the ocean has spread over at that level: the last of
+    //the ocean's basins whose pass is under water
+    const vector<int>& o = tree.oceanBasins;
+    int first = 0, last = o.size();
+    while (first < last) {
+      int mid = (first + last) / 2;
+      if (tree.basins[o[mid]].level <= level) {first = mid + 1;}
+      else {last = mid;}
+    }
+    if (first == 0) {return;}
+    b = o[first - 1];
+  }
+  const Basin& x = tree.basins[b];
+  if (level < x.onset) {return;}
+  if (!x.ocean || level >= x.top) {
+    area = x.cells;
+    volume = x.cells*(double)level - x.heights;
+    return;
+  }
+  //Everything in the children is under water once the ocean is in; the
+  //points added above the pass are spread evenly up to the highest one
+  double cells = 0, heights = 0;
+  for (int k = 0; k < 2; k++) {
+    if (x.children[k] < 0) {continue;}
+    cells += tree.basins[x.children[k]].cells;
+    heights += tree.basins[x.children[k]].heights;
+  }
+  double slope = x.cells - cells;
+  double part = x.top > x.level ? (level - x.level) / (x.top - x.level) : 1;
+  area = cells + slope*part;
+  volume = cells*level - heights + slope*part*(level - x.level)/2;
+}
@@ -0,0 +1,84 @@
+/* basins.h
+
+  The basin tree: how the hollows of the terrain fill up and spill into
+  each other and into the ocean. Points are taken lowest first. A point
+  with no lower neighbour starts a basin of its own, and a point that
+  touches two basins is the pass where they join into a bigger one, their
+  parent. The ocean (the ocean points on the border and the seeds) is a
+  basin of its own at -1. The water of a rising sea reaches a basin when
+  the basin first joins one holding the ocean, so the tree answers the
+  usual what-if questions without the terrain: at what level a basin
+  floods, through which pass, and how much area and water it holds at any
+  level.
+
+  The tree is written to disk together with the basin of every point, and
+  read back by mapping the file, so a query is a lookup and a few reads.
+
+*/
+
+#ifndef BASINS_H
+#define BASINS_H
+
+#include <stdint.h>
+#include <vector>
+#include "gridio.h"
+#include "raster.h"
+
+//One basin of the tree. Points are numbered i*cols+j.
+struct Basin {
+  //The basin this one spills into, -1 at the top of the tree
+  int parent;
+  //The two basins joined at the pass, -1 for a basin that starts at its
+  //lowest point
+  int children[2];
+  //The lowest point, or the pass, and its height (-1 for the ocean)
+  int cell;
+  float level;
+  //The level at which it spills into its parent (INFINITY at the top), and
+  //its highest point by then
+  float spill, top;
+  //The sea level at which the ocean first reaches it and the pass the
+  //water comes through; INFINITY and -1 if it never does. For a basin
+  //holding the ocean these are its own level and pass.
+  float onset;
+  int entry;
+  //1 if the ocean is part of it
+  int ocean;
+  int reserved;
+  //The points in it when it spills, and the sum of their heights, so the
+  //water it holds up to level L is cells*L - heights
+  int64_t cells;
+  double heights;
+};
+
+struct BasinTree {
+  GridHeader h;
+  int connectivity;
+  std::vector<Basin> basins;
+  //The basin of every point: the smallest one it is part of
+  Raster<int> label;
+  //The basins holding the ocean, from the ocean itself up. Each holds the
+  //one before, so they are in order of level as well.
+  std::vector<int> oceanBasins;
+};
+
+//Builds the tree of grid, with ocean and NODATA points and the seeds as
+//the ocean like in priorityFlood(), sorting the points on nthreads threads.
+void buildBasins(const Raster<float>& grid, const GridHeader& h,
+                 const std::vector<int>& seeds, int connectivity,
+                 int nthreads, BasinTree& tree);
+
+//Writes the tree to filename, or reads it back by mapping the file.
+//Both print a message and return false on failure.
+bool writeBasins(const char* filename, const BasinTree& tree);
+bool readBasins(const char* filename, BasinTree& tree);
+
+//The points of basin b flooded at sea level level, and the water over
+//them in height units times points. Exact for basins without the ocean,
+//which flood all at once. A basin holding the ocean is flooded as far as
+//the ocean has spread at that level, and the points it gained above its
+//pass are taken to rise evenly up to its highest point.
+void basinFlooding(const BasinTree& tree, int b, float level, double& area,
+                   double& volume);
+
+#endif
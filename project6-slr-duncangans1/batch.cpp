@@ -0,0 +1,384 @@
+/* batch.cpp
+
+  The batch driver, see batch.h. Every thread has a deque of tasks with its
+  own lock: it pushes and pops at the back, and other threads steal from
+  the front. The batch itself has one lock, for the tiles in memory, the
+  next tile to read and the tiles finished. A thread with nothing to do
+  sleeps until another pushes a task or a tile leaves memory; the count of
+  those events tells it whether it missed one while looking.
+
+*/
+
+#include "batch.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+//Bytes a tile takes per point while it is in memory: the terrain, the
+//flooding heights, the flags, and the sorted heights with the bands they
+//are merged from
+static const long BYTESPERPOINT = 16;
+//And more for a tile with metrics=: the points in the order they flood,
+//and the parent of every point in the union-find that counts the islands
+static const long METRICSPERPOINT = 8;
+
+struct Tile {
+  string input, output, minheight, seeds, metrics;
+  //The levels its result grids are written at, none for just the rise
+  vector<float> levels;
+  //The grids it writes: a result grid per level (or for the rise), then
+  //the minimum flooding heights, then the metrics, and how many are still
+  //being written
+  int exports, left;
+  long bytes;
+  FloodRun* run;
+  bool failed;
+  int rows, cols;
+  long land;
+  double readTime, floodTime, exportTime;
+};
+
+enum Stage {LOAD, FLOOD, EXPORT};
+
+struct Task {
+  int tile;
+  Stage stage;
+  //The grid an EXPORT task writes
+  int part;
+};
+
+struct Queue {
+  mutex lock;
+  deque<Task> tasks;
+};
+
+struct Batch {
+  vector<Tile> tiles;
+  FloodSettings settings;
+  int nthreads;
+  unique_ptr<Queue[]> queues;
+  mutex lock;
+  condition_variable wake;
+  //The next tile to read, the bytes of the tiles in memory and the most
+  //allowed, and the tiles finished
+  size_t next, done;
+  long inMemory, memory;
+  //Counts the tasks pushed and tiles finished, see takeTask()
+  long events;
+};
+
+//Reads the size of a grid from its header
+static bool peekHeader(const char* filename, GridHeader& h) {
+  if (isGridCache(filename)) {
+    GridFile g;
+    if (!openGridFile(filename, g, false)) {return false;}
+    h = g.h;
+    closeGridFile(g);
+    return true;
+  }
+  FILE* f = fopen(filename, "r");
+  if (f == NULL) {return false;}
+  bool ok = readAscHeader(f, h);
+  fclose(f);
+  return ok;
+}
+
+static bool readManifest(const char* manifest, const vector<float>& levels,
+                         vector<Tile>& tiles) {
+  FILE* f = fopen(manifest, "r");
+  if (f == NULL) {
+    printf("cannot open %s\n", manifest);
+    return false;
+  }
+  char line[4096];
+  int number = 0;
+  while (fgets(line, sizeof(line), f)) {
+    number++;
+    char* hash = strchr(line, '#');
+    if (hash) {*hash = 0;}
+    char* word[8];
+    char* rest;
+    int count = 0;
+    for (char* w = strtok_r(line, " \t\r\n", &rest); w && count < 8;
+         w = strtok_r(NULL, " \t\r\n", &rest)) {
+      word[count++] = w;
+    }
+    if (count == 0) {continue;}
+    Tile t = Tile();
+    t.input = word[0];
+    t.output = count > 1 ? word[1] : "-";
+    bool ownLevels = false;
+    for (int k = 2; k < count; k++) {
+      if (strncmp(word[k], "levels=", 7) == 0) {
+        parseLevels(word[k] + 7, t.levels);
+        ownLevels = true;
+      }
+      else if (strncmp(word[k], "minheight=", 10) == 0) {
+        t.minheight = word[k] + 10;
+      }
+      else if (strncmp(word[k], "seeds=", 6) == 0) {t.seeds = word[k] + 6;}
+      else if (strncmp(word[k], "metrics=", 8) == 0) {
+        t.metrics = word[k] + 8;
+      }
+      else {
+        printf("%s line %d: unknown word %s\n", manifest, number, word[k]);
+        fclose(f);
+        return false;
+      }
+    }
+    if (!ownLevels) {t.levels = levels;}
+    t.exports = (t.minheight.empty() ? 0 : 1) + (t.metrics.empty() ? 0 : 1);
+    if (t.output != "-") {t.exports += max((size_t)1, t.levels.size());}
+    GridHeader h;
+    long perPoint = BYTESPERPOINT + (t.metrics.empty() ? 0 : METRICSPERPOINT);
+    t.bytes = peekHeader(t.input.c_str(), h) ?
+      (long)h.nrows * h.ncols * perPoint : 0;
+    tiles.push_back(t);
+  }
+  fclose(f);
+  return true;
+}
+
+static void push(Batch& b, int me, const Task& t) {
+  {
+    lock_guard<mutex> g(b.queues[me].lock);
+    b.queues[me].tasks.push_back(t);
+  }
+  {
+    lock_guard<mutex> g(b.lock);
+    b.events++;
+  }
+  b.wake.notify_all();
+}
+
+//Finds the next task for thread me: its own newest, another thread's
+//oldest, or the reading of a new tile if there is room. Returns false
+//when every tile is finished.
+static bool takeTask(Batch& b, int me, Task& t) {
+  while (true) {
+    long seen;
+    {
+      lock_guard<mutex> g(b.lock);
+      if (b.done == b.tiles.size()) {return false;}
+      seen = b.events;
+    }
+    {
+      Queue& q = b.queues[me];
+      lock_guard<mutex> g(q.lock);
+      if (!q.tasks.empty()) {
+        t = q.tasks.back();
+        q.tasks.pop_back();
+        return true;
+      }
+    }
+    for (int k = 1; k < b.nthreads; k++) {
+      Queue& q = b.queues[(me + k) % b.nthreads];
+      lock_guard<mutex> g(q.lock);
+      if (!q.tasks.empty()) {
+        t = q.tasks.front();
+        q.tasks.pop_front();
+        TRACE_COUNT("tasks stolen", 1);
+        return true;
+      }
+    }
+    unique_lock<mutex> g(b.lock);
+    if (b.next < b.tiles.size() && (b.inMemory == 0 ||
+        b.inMemory + b.tiles[b.next].bytes <= b.memory)) {
+      t.tile = b.next++;
+      t.stage = LOAD;
+      t.part = 0;
+      b.inMemory += b.tiles[t.tile].bytes;
+      return true;
+    }
+    //Anything pushed or freed since the look above wakes it straight away
+    b.wake.wait(g, [&] {
+      return b.events != seen || b.done == b.tiles.size();
+    });
+  }
+}
+
+//Drops the grids of tile k and lets the next tiles in
+static void finishTile(Batch& b, int k) {
+  Tile& t = b.tiles[k];
+  if (t.run) {
+    t.rows = t.run->rows;
+    t.cols = t.run->cols;
+    t.land = t.run->initLand;
+    delete t.run;
+    t.run = NULL;
+  }
+  if (t.failed) {printf("%s failed\n", t.input.c_str());}
+  else {
+    printf("%s: %d by %d, read in %f, flooded in %f, written in %f "
+      "seconds\n", t.input.c_str(), t.rows, t.cols, t.readTime, t.floodTime,
+      t.exportTime);
+  }
+  fflush(stdout);
+  {
+    lock_guard<mutex> g(b.lock);
+    b.inMemory -= t.bytes;
+    b.done++;
+    b.events++;
+  }
+  b.wake.notify_all();
+}
+
+static void runTask(Batch& b, int me, const Task& task) {
+  Tile& t = b.tiles[task.tile];
+  if (task.stage == LOAD) {
+    TRACE_SCOPE("read tile");
+    //The flooding has to reach the highest level that is exported
+    FloodSettings s = b.settings;
+    s.metrics = !t.metrics.empty();
+    for (size_t l = 0; l < t.levels.size(); l++) {
+      if (t.levels[l] >= s.ceiling) {s.ceiling = t.levels[l] + s.increment;}
+    }
+    t.run = new FloodRun;
+    startRun(*t.run, s);
+    if (!readTerrain(*t.run, t.input.c_str(),
+        t.seeds.empty() ? NULL : t.seeds.c_str())) {
+      t.failed = true;
+      finishTile(b, task.tile);
+      return;
+    }
+    t.readTime = t.run->readTime;
+    Task next = {task.tile, FLOOD, 0};
+    push(b, me, next);
+  }
+  else if (task.stage == FLOOD) {
+    TRACE_SCOPE("flood tile");
+    floodTerrain(*t.run);
+    t.floodTime = t.run->floodTime;
+    t.left = t.exports;
+    if (t.exports == 0) {finishTile(b, task.tile);}
+    //Pushed last first, so this thread writes them in order
+    for (int p = t.exports - 1; p >= 0; p--) {
+      Task next = {task.tile, EXPORT, p};
+      push(b, me, next);
+    }
+  }
+  else {
+    TRACE_SCOPE("write tile");
+    double w = wallTime();
+    bool ok;
+    int results = t.exports - (t.minheight.empty() ? 0 : 1) -
+      (t.metrics.empty() ? 0 : 1);
+    if (task.part == results && !t.minheight.empty()) {
+      ok = writeMinHeight(*t.run, t.minheight.c_str());
+    }
+    else if (task.part >= results) {
+      ok = writeMetrics(*t.run, t.metrics.c_str());
+    }
+    else if (t.levels.empty()) {
+      ok = writeResult(*t.run, t.output.c_str(), t.run->s.ceiling);
+    }
+    else {
+      string name = levelFileName(t.output.c_str(), t.levels[task.part]);
+      ok = writeResult(*t.run, name.c_str(), t.levels[task.part]);
+    }
+    bool last;
+    {
+      lock_guard<mutex> g(b.lock);
+      t.exportTime += wallTime() - w;
+      t.failed = t.failed || !ok;
+      last = --t.left == 0;
+    }
+    if (last) {finishTile(b, task.tile);}
+  }
+}
+
+static void worker(Batch* b, int me) {
+  Task t;
+  while (takeTask(*b, me, t)) {runTask(*b, me, t);}
+}
+
+//s as a JSON string
+static void writeString(FILE* f, const string& s) {
+  fputc('"', f);
+  for (size_t k = 0; k < s.size(); k++) {
+    if (s[k] == '"' || s[k] == '\\') {fputc('\\', f);}
+    if ((unsigned char)s[k] >= 32) {fputc(s[k], f);}
+  }
+  fputc('"', f);
+}
+
+static void writeBatchStats(FILE* f, const char* manifest, const Batch& b,
+                            double seconds, long finished, double cells) {
+  fprintf(f, "{\n  \"manifest\": ");
+  writeString(f, manifest);
+  fprintf(f, ",\n  \"threads\": %d,\n  \"memory_limit_mb\": %ld,\n",
+    b.nthreads, b.memory >> 20);
+  fprintf(f, "  \"tiles\": [");
+  for (size_t k = 0; k < b.tiles.size(); k++) {
+    const Tile& t = b.tiles[k];
+    fprintf(f, "%s\n    {\"input\": ", k ? "," : "");
+    writeString(f, t.input);
+    fprintf(f, ", \"ok\": %s, \"rows\": %d, \"cols\": %d, "
+      "\"land_cells\": %ld, \"timings\": {\"read\": %.6f, \"flood\": %.6f, "
+      "\"export\": %.6f}}", t.failed ? "false" : "true", t.rows, t.cols,
+      t.land, t.readTime, t.floodTime, t.exportTime);
+  }
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  long peak = usage.ru_maxrss / 1024;
+#else
+  long peak = usage.ru_maxrss;
+#endif
+  fprintf(f, "\n  ],\n  \"seconds\": %.6f,\n  \"tiles_per_hour\": %.1f,\n"
+    "  \"cells_per_second\": %.0f,\n  \"peak_rss_kb\": %ld\n}\n", seconds,
+    seconds > 0 ? finished * 3600 / seconds : 0,
+    seconds > 0 ? cells / seconds : 0, peak);
+}
+
+bool runBatch(const char* manifest, const FloodSettings& settings,
+              const vector<float>& levels, long memory, int nthreads,
+              FILE* stats) {
+  double w = wallTime();
+  Batch b;
+  if (!readManifest(manifest, levels, b.tiles)) {return false;}
+  b.settings = settings;
+  b.settings.verbose = false;
+  //Tiles are flooded side by side, so each only gets the threads left
+  //over when there are fewer tiles than threads
+  b.settings.nthreads = max(1, nthreads / max(1, (int)b.tiles.size()));
+  b.nthreads = max(1, nthreads);
+  b.queues.reset(new Queue[b.nthreads]);
+  b.next = b.done = 0;
+  b.inMemory = 0;
+  b.memory = memory;
+  b.events = 0;
+  printf("Flooding %lu tiles from %s on %d threads in %ld MB\n",
+    (unsigned long)b.tiles.size(), manifest, b.nthreads, memory >> 20);
+  fflush(stdout);
+  vector<thread> threads;
+  for (int t = 0; t < b.nthreads; t++) {
+    threads.push_back(thread(worker, &b, t));
+  }
+  for (int t = 0; t < b.nthreads; t++) {threads[t].join();}
+  double seconds = wallTime() - w;
+
+  long finished = 0;
+  double cells = 0;
+  for (size_t k = 0; k < b.tiles.size(); k++) {
+    if (b.tiles[k].failed) {continue;}
+    finished++;
+    cells += (double)b.tiles[k].rows * b.tiles[k].cols;
+  }
+  printf("Flooded %ld of %lu tiles in %f seconds, %.1f tiles per hour\n",
+    finished, (unsigned long)b.tiles.size(), seconds,
+    seconds > 0 ? finished * 3600 / seconds : 0);
+  if (stats) {writeBatchStats(stats, manifest, b, seconds, finished, cells);}
+  return finished == (long)b.tiles.size();
+}
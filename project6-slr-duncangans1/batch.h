@@ -0,0 +1,41 @@
+/* batch.h
+
+  Flooding many terrain tiles in one process. A manifest lists the tiles,
+  one per line:
+
+    <terrain grid> <result grid> [levels=a,b,c:d:step] [minheight=grid]
+      [seeds=grid] [metrics=file]
+
+  with - as the result grid to write none, and # starting a comment. Tiles
+  without levels= are written at the levels given with -levels, or at the
+  rise. Every other setting comes from the command line.
+
+  Each tile goes through three stages, reading, flooding and writing its
+  grids, and every stage is a task for a pool of threads. A thread runs
+  the tasks it made itself first, newest first, so a tile it has read is
+  flooded while it is still in the cache, and when it has none it steals
+  the oldest task of another thread. Writing is a task per grid, so the
+  grids of one tile are written on all threads. A new tile is only read
+  when the tiles in memory leave room for it under the memory limit, so a
+  manifest of any length runs in bounded memory.
+
+*/
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+#include <vector>
+#include "engine.h"
+
+//Floods the tiles of manifest on nthreads threads, keeping the grids in
+//memory under about memory bytes (one tile at a time if a tile is bigger).
+//levels are the levels written for tiles without their own, and the
+//settings are used for every tile. Prints a line per tile and the tiles
+//per hour, and writes them as JSON to stats if it is not NULL. Returns
+//false if the manifest cannot be read or any tile fails.
+bool runBatch(const char* manifest, const FloodSettings& settings,
+              const std::vector<float>& levels, long memory, int nthreads,
+              FILE* stats);
+
+#endif
@@ -0,0 +1,45 @@
+#!/bin/sh
+# bench.sh
+#
+# Times slr on synthetic terrains of every kind gendem makes and writes the
+# statistics of all runs as one JSON document to bench/bench.json (and
+# stdout). The size, roughness, rise and increment come from the
+# environment; with a display, every run also draws one frame. The
+# terrains are made in the same directory and removed after.
+#
+# The terrains are binary grids, so their load time is that of mapping a
+# grid cache. One more run reads the fractal terrain as an .asc file with
+# -nocache, which times parsing the text.
+#
+# usage: BENCHSIZE=2000 BENCHROUGH=0.5 ./bench.sh
+
+SIZE=${BENCHSIZE:-2000}
+ROUGH=${BENCHROUGH:-0.5}
+RISE=${BENCHRISE:-10}
+INC=${BENCHINC:-0.5}
+DIR=${BENCHDIR:-bench}
+OUT=${BENCHOUT:-$DIR/bench.json}
+
+if [ -n "$DISPLAY" ]; then MODE=-bench; else MODE=-headless; fi
+mkdir -p "$DIR" || exit 1
+
+{
+  printf '{\n"size": %s,\n"roughness": %s,\n"runs": [\n' "$SIZE" "$ROUGH"
+  SEP=""
+  for KIND in fractal flats coast; do
+    ./gendem $KIND "$SIZE" "$SIZE" "$ROUGH" 1 "$DIR/$KIND.slrg" >&2 || exit 1
+    printf '%s' "$SEP"
+    ./slr $MODE -in "$DIR/$KIND.slrg" -out "$DIR/out.slrg" -rise "$RISE" \
+      -inc "$INC" -stats - || exit 1
+    SEP=","
+  done
+  ./gendem fractal "$SIZE" "$SIZE" "$ROUGH" 1 "$DIR/fractal.asc" >&2 || exit 1
+  printf ','
+  ./slr $MODE -nocache -in "$DIR/fractal.asc" -out "$DIR/out.slrg" \
+    -rise "$RISE" -inc "$INC" -stats - || exit 1
+  printf ']\n}\n'
+} > "$OUT" || exit 1
+#Only the files made here: the directory may hold others
+for KIND in fractal flats coast out; do rm -f "$DIR/$KIND.slrg"; done
+rm -f "$DIR/fractal.asc"
+cat "$OUT"
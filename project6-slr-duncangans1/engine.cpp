@@ -0,0 +1,890 @@
+/* engine.cpp
+
+  The flooding of one terrain grid, see engine.h. This was the heart of
+  slr.cpp, working on globals; the code is the same, with the state in the
+  run.
+
+  What essentially happens is that the user denotes a maximum height, and
+  the flooding begins at the floor and rises the sea level by the
+  increment given, keeping track of the coastline: the points at or above
+  the current flood height. By default the same result comes from one
+  sweep with a priority queue instead, which gives every point the exact
+  level it floods at.
+
+*/
+
+#include "engine.h"
+#include "ascparse.h"
+#include "gridwrite.h"
+#include "ocean.h"
+#include "trace.h"
+#include "kernels.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <queue>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+double wallTime() {
+  //Seconds on a monotonic clock. Unlike clock() this includes time spent
+  //waiting on the disk and counts parallel work once.
+  return chrono::duration<double>(
+    chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void startRun(FloodRun& r, const FloodSettings& s) {
+  r.s = s;
+  r.header = GridHeader();
+  r.rows = r.cols = 0;
+  r.firstRow = r.firstCol = r.gridRows = r.gridCols = 0;
+  r.ndval = r.maxz = r.initLand = 0;
+  r.grid = Raster<float>();
+  r.checkGrid = Raster<float>();
+  r.seeds.clear();
+  r.frontier.clear();
+  r.nextFrontier.clear();
+  r.steps.clear();
+  r.levels.clear();
+  r.feet = s.floor;
+  r.floodHeights.clear();
+  r.sums.clear();
+  r.floodOrder.clear();
+  r.metrics.clear();
+  r.readTime = r.floodTime = r.exportTime = r.oceanTime = 0;
+}
+
+static void classifyGrid(FloodRun& r) {
+  //Has checkgrid indicate possible ocean or land for every point, and
+  //finds the highest point and the amount of land
+  r.checkGrid.allocate(r.rows, r.cols);
+  r.initLand += classifyCheck(r.grid.data(), r.grid.size(), r.ndval,
+    r.checkGrid.data(), r.maxz);
+}
+
+static const float* gridRow(int i, void* arg) {
+  return ((FloodRun*)arg)->grid.row(i);
+}
+
+static bool readHeader(const char* filename, GridHeader& h) {
+  //The header of an .asc file or a binary grid, without reading the values
+  if (isGridCache(filename)) {
+    MappedGrid m;
+    if (!mapGridCache(filename, m)) {return false;}
+    h = m.h;
+    unmapGridCache(m);
+    return true;
+  }
+  FILE* f = fopen(filename, "r");
+  bool ok = f && readAscHeader(f, h);
+  if (f) {fclose(f);}
+  return ok;
+}
+
+static bool useWindow(FloodRun& r, const GridHeader& h) {
+  //Works out the part of the grid with header h that is read, the whole
+  //grid without a window, and takes its header. A box takes every point it
+  //touches. Prints a message and returns false if the part is empty.
+  const GridWindow& w = r.s.window;
+  double row0 = 0, col0 = 0, row1 = h.nrows, col1 = h.ncols;
+  if (w.points) {
+    row0 = w.row;
+    col0 = w.col;
+    row1 = row0 + w.rows;
+    col1 = col0 + w.cols;
+  }
+  else if (w.bbox) {
+    //Rows count down from the top of the grid, like in the .asc file
+    col0 = floor((w.xmin - h.xllcorner) / h.cellsize);
+    col1 = ceil((w.xmax - h.xllcorner) / h.cellsize);
+    row0 = h.nrows - ceil((w.ymax - h.yllcorner) / h.cellsize);
+    row1 = h.nrows - floor((w.ymin - h.yllcorner) / h.cellsize);
+  }
+  row0 = max(row0, 0.0);
+  col0 = max(col0, 0.0);
+  row1 = min(row1, (double)h.nrows);
+  col1 = min(col1, (double)h.ncols);
+  if (!(row1 > row0 && col1 > col0)) {
+    printf("the window is outside the %d by %d grid\n", h.nrows, h.ncols);
+    return false;
+  }
+  r.header = h;
+  r.header.nrows = r.rows = (int)(row1 - row0);
+  r.header.ncols = r.cols = (int)(col1 - col0);
+  r.header.xllcorner = h.xllcorner + col0*h.cellsize;
+  r.header.yllcorner = h.yllcorner + (h.nrows - row1)*h.cellsize;
+  r.ndval = h.ndval;
+  r.firstRow = (int)row0;
+  r.firstCol = (int)col0;
+  r.gridRows = h.nrows;
+  r.gridCols = h.ncols;
+  return true;
+}
+
+static bool cropped(const FloodRun& r) {
+  return r.rows != r.gridRows || r.cols != r.gridCols;
+}
+
+static void cropWindow(const FloodRun& r, const float* data,
+                       Raster<float>& out) {
+  //Copies the window out of a whole grid in memory, so only the pages of
+  //its rows are touched
+  out.allocate(r.rows, r.cols);
+  for (int i = 0; i < r.rows; i++) {
+    memcpy(out.row(i), data + (size_t)(r.firstRow + i)*r.gridCols +
+      r.firstCol, r.cols*sizeof(float));
+  }
+}
+
+static void showHeader(const FloodRun& r) {
+  if (r.s.verbose) {
+    printf("ndval = %f\n", r.ndval);
+    printf("ROWS: %d, COLS: %d\n", r.rows, r.cols);
+    if (cropped(r)) {
+      printf("Reading rows %d to %d and columns %d to %d of %d by %d\n",
+        r.firstRow, r.firstRow + r.rows - 1, r.firstCol,
+        r.firstCol + r.cols - 1, r.gridRows, r.gridCols);
+    }
+  }
+}
+
+static bool readGridfromCache(FloodRun& r, const char* cachefile) {
+  //Fills the grid from a binary grid cache. Returns false if the cache
+  //cannot be used.
+  MappedGrid m;
+  if (!mapGridCache(cachefile, m)) {return false;}
+  if (m.h.nrows != r.gridRows || m.h.ncols != r.gridCols) {
+    unmapGridCache(m);
+    return false;
+  }
+  if (r.s.verbose) {printf("Reading grid cache %s\n", cachefile);}
+  showHeader(r);
+  //The grid is the mapping itself, nothing is copied, unless only a window
+  //of it is wanted
+  if (cropped(r)) {
+    cropWindow(r, m.data, r.grid);
+    unmapGridCache(m);
+  }
+  else {
+    r.grid.adopt(r.rows, r.cols, (float*)m.data, releaseGridCache, m.base,
+      m.length);
+  }
+  classifyGrid(r);
+  return true;
+}
+
+static bool readGridfromFile(FloodRun& r, const char* filename) {
+  //Creates grid from a given file. It also initializes some variables.
+  //filename can be an .asc file or a binary grid cache. For an .asc file
+  //an up to date cache next to it is used instead of parsing the text,
+  //and if there is none, one is written after parsing.
+  if (isGridCache(filename)) {
+    if (!readGridfromCache(r, filename)) {
+      printf("cannot read grid cache %s\n", filename);
+      return false;
+    }
+    return true;
+  }
+  string cachefile = gridCachePath(filename);
+  if (r.s.useCache && gridCacheIsFresh(filename, cachefile.c_str())) {
+    if (readGridfromCache(r, cachefile.c_str())) {return true;}
+    printf("cannot read grid cache %s, parsing %s\n", cachefile.c_str(),
+      filename);
+  }
+
+  //Parses the values on all threads into a flat buffer, along with the
+  //ocean mask, the highest point and the amount of land. A window is
+  //parsed on its own, without the rest of the file.
+  AscGrid asc;
+  if (cropped(r)) {
+    if (!parseAscWindow(filename, r.firstRow, r.firstCol, r.rows, r.cols,
+        asc, r.s.nthreads)) {
+      return false;
+    }
+  }
+  else if (!parseAscFile(filename, asc, r.s.nthreads)) {return false;}
+  showHeader(r);
+  r.grid.adopt(r.rows, r.cols, asc.values, releaseAligned);
+  r.checkGrid.allocate(r.rows, r.cols);
+  size_t n = r.grid.size();
+  for (size_t k = 0; k < n; k++) {
+    r.checkGrid[k] = asc.ocean[k] ? -1 : 0;
+  }
+  if (asc.maxz > r.maxz) {r.maxz = asc.maxz;}
+  r.initLand += asc.land;
+  free(asc.ocean);
+
+  //Converts the grid once so later runs can skip the parsing. A window is
+  //not enough for a cache.
+  if (r.s.useCache && !cropped(r)) {
+    if (writeGridCache(cachefile.c_str(), filename, r.header, gridRow,
+        &r)) {
+      if (r.s.verbose) {printf("Wrote grid cache %s\n", cachefile.c_str());}
+    }
+    else {printf("cannot write grid cache %s\n", cachefile.c_str());}
+  }
+  return true;
+}
+
+static bool readSeeds(FloodRun& r, const char* filename) {
+  //Makes the points set in the seed grid ocean, so the flooding starts
+  //from them as well as from the border. The seed grid is an .asc file or
+  //a binary grid the same size as the terrain; a shapefile has to be
+  //rasterised onto the terrain grid first.
+  //With a window, only the same window of the seed grid is read.
+  Raster<float> mask;
+  GridHeader h;
+  if (!readHeader(filename, h)) {
+    printf("cannot read seed grid %s\n", filename);
+    return false;
+  }
+  if (h.nrows != r.gridRows || h.ncols != r.gridCols) {
+    printf("seed grid %s is %d by %d, the terrain is %d by %d\n", filename,
+      h.nrows, h.ncols, r.gridRows, r.gridCols);
+    return false;
+  }
+  if (isGridCache(filename)) {
+    MappedGrid m;
+    if (!mapGridCache(filename, m)) {
+      printf("cannot read seed grid %s\n", filename);
+      return false;
+    }
+    if (cropped(r)) {
+      cropWindow(r, m.data, mask);
+      unmapGridCache(m);
+    }
+    else {
+      mask.adopt(r.rows, r.cols, (float*)m.data, releaseGridCache, m.base,
+        m.length);
+    }
+  }
+  else {
+    AscGrid asc;
+    if (cropped(r) ? !parseAscWindow(filename, r.firstRow, r.firstCol,
+          r.rows, r.cols, asc, r.s.nthreads)
+        : !parseAscFile(filename, asc, r.s.nthreads)) {
+      return false;
+    }
+    mask.adopt(r.rows, r.cols, asc.values, releaseAligned);
+    free(asc.ocean);
+  }
+  r.seeds.clear();
+  size_t n = mask.size();
+  for (size_t k = 0; k < n; k++) {
+    if (mask[k] == h.ndval || mask[k] == 0) {continue;}
+    if (r.checkGrid[k] != -1) {
+      r.checkGrid[k] = -1;
+      r.initLand--;
+    }
+    r.seeds.push_back(k);
+  }
+  if (r.s.verbose) {
+    printf("Seeding the ocean from %lu points of %s\n",
+      (unsigned long)r.seeds.size(), filename);
+  }
+  return true;
+}
+
+bool readTerrain(FloodRun& r, const char* input, const char* seedfile) {
+  //Reads the terrain grid and the seeds, timing both
+  if (r.s.verbose) {printf("Has begun reading file\n");}
+  double w = wallTime();
+  {
+    TRACE_SCOPE("read grid");
+    GridHeader h;
+    if (!readHeader(input, h)) {
+      printf("cannot read the header of %s\n", input);
+      return false;
+    }
+    if (!useWindow(r, h) || !readGridfromFile(r, input)) {return false;}
+    if (seedfile && !readSeeds(r, seedfile)) {return false;}
+  }
+  r.readTime = wallTime() - w;
+  if (r.s.verbose) {
+    printf("Finished reading file\n");
+    printf("Reading file takes %f seconds\n", r.readTime);
+  }
+  return true;
+}
+
+static inline void addFlooded(FloodRun& r, size_t level, int c) {
+  //Counts point c for -metrics as it floods at the level with that index,
+  //which past the last level is left out of the sums. Only land goes in
+  //the sums, like in the flooded land.
+  r.floodOrder.push_back(c);
+  float z = r.grid[c];
+  if (level < r.sums.size() && z > 0 && z != r.ndval) {
+    LevelSums& s = r.sums[level];
+    s.cells++;
+    s.z += z;
+    if (z < s.minz) {s.minz = z;}
+  }
+}
+
+template <int N>
+static void floodUp(FloodRun& r) {
+  //Takes the points on the coastline in frontier. Level by level it checks
+  //if they are below the current flood height, and continues a breadth
+  //first search from them to find the rest of the points below the flood,
+  //as well as the coastline for the next level at the higher height. N is
+  //the number of neighbours a point floods, see -connect.
+  vector<int>& frontier = r.frontier;
+  while (r.feet < r.s.ceiling) {
+    TRACE_SCOPE("flood level");
+    TRACE_SAMPLE("frontier", frontier.size());
+    double w = wallTime();
+    LevelStep step = {r.feet, 0, 0, 0};
+    size_t start = frontier.size();
+    r.nextFrontier.clear();
+    //frontier grows while it is read, so it is walked by index
+    for (size_t k = 0; k < frontier.size(); k++) {
+      int c = frontier[k];
+      if (r.grid[c] <= r.feet) {
+        //If it's not ocean, but is floodable, set it to the current
+        //height, and add the points around it to the frontier.
+        r.checkGrid[c] = r.feet;
+        step.flooded++;
+        if (r.s.metrics) {addFlooded(r, r.steps.size(), c);}
+        int next[N];
+        int count = neighbours<N>(c, r.rows, r.cols, next);
+        for (int n = 0; n < count; n++) {
+          if (!r.completionGrid.testAndSet(next[n])) {
+            frontier.push_back(next[n]);
+          }
+        }
+      }
+      //If it's on the coastline, add it to the next coast
+      else {r.nextFrontier.push_back(c);}
+    }
+    step.coast = r.nextFrontier.size();
+    step.seconds = wallTime() - w;
+    TRACE_COUNT("cells visited", frontier.size());
+    TRACE_COUNT("queue pushes", frontier.size() - start);
+    r.steps.push_back(step);
+    frontier.swap(r.nextFrontier);
+    r.feet += r.s.increment;
+  }
+}
+
+static void openEdges(FloodRun& r, vector<int>& coast) {
+  //The sides of a window that lie inside the grid may be reached by the
+  //sea from outside it, so their land is on the coastline from the start,
+  //flooding at its own height. On the border of the grid only the ocean
+  //is, as ever.
+  bool top = r.firstRow > 0, bottom = r.firstRow + r.rows < r.gridRows;
+  bool left = r.firstCol > 0, right = r.firstCol + r.cols < r.gridCols;
+  size_t before = coast.size();
+  auto edge = [&](int i, int j) {
+    int c = i*r.cols + j;
+    if (r.checkGrid[c] != -1 && !r.completionGrid.testAndSet(c)) {
+      coast.push_back(c);
+    }
+  };
+  for (int j = 0; j < r.cols; j++) {
+    if (top) {edge(0, j);}
+    if (bottom) {edge(r.rows-1, j);}
+  }
+  for (int i = 0; i < r.rows; i++) {
+    if (left) {edge(i, 0);}
+    if (right) {edge(i, r.cols-1);}
+  }
+  //The coastline stays in increasing order, like findOcean() leaves it
+  if (coast.size() > before) {sort(coast.begin(), coast.end());}
+}
+
+static void slr(FloodRun& r) {
+  //Finds the ocean connected to the border or the seeds and its
+  //coastline, using all threads on big frontiers.
+  vector<int> coast;
+  double w = wallTime();
+  {
+    TRACE_SCOPE("find ocean");
+    findOcean(r.checkGrid, r.seeds, r.s.connectivity, r.completionGrid,
+      coast, r.s.nthreads);
+    openEdges(r, coast);
+  }
+  r.oceanTime = wallTime() - w;
+  r.frontier.swap(coast);
+  r.feet += r.s.increment;
+  if (r.s.verbose) {printf("Finding ocean takes %f seconds\n", r.oceanTime);}
+  //Now that all the coast points are in the frontier, run the incremental
+  //flood algorithms on the coasline
+  r.steps.reserve(r.levels.size());
+  if (r.s.connectivity == 8) {floodUp<8>(r);}
+  else {floodUp<4>(r);}
+}
+
+void buildLevels(FloodRun& r) {
+  //Builds the list of sea levels the incremental engine visits. It uses
+  //the same float accumulation as slr() and floodUp(), so both engines
+  //end up with exactly the same levels and the same final feet.
+  r.levels.clear();
+  float f = r.s.floor;
+  f += r.s.increment;
+  while (f < r.s.ceiling) {
+    r.levels.push_back(f);
+    f += r.s.increment;
+  }
+  r.feet = f;
+}
+
+template <int N>
+static void priorityFlood(FloodRun& r) {
+  //Computes in one sweep the lowest sea level at which every point is
+  //connected to the ocean. Starting from the ocean on the border and the
+  //seeds, points are taken out of a priority queue lowest first; a
+  //neighbour floods at the larger of its own height and the level of the
+  //point it is reached from. Neighbours that are no higher than the
+  //current level go in a plain queue instead, so depressions cost O(1)
+  //per point.
+  TRACE_SCOPE("priority flood");
+  double w = wallTime();
+  typedef pair<float, int> Cell;
+  priority_queue<Cell, vector<Cell>, greater<Cell> > open;
+  queue<int> pit;
+  Raster<float>& checkGrid = r.checkGrid;
+
+  //The ocean floods at -1 straight away, and its coastline is where the
+  //priority queue starts, like in slr(). The heights are written straight
+  //into checkGrid: a point is classified as ocean or land until it is
+  //reached, and points that are never reached keep their class.
+  vector<int> coast;
+  {
+    TRACE_SCOPE("find ocean");
+    findOcean(checkGrid, r.seeds, r.s.connectivity, r.completionGrid, coast,
+      r.s.nthreads);
+    openEdges(r, coast);
+  }
+  r.oceanTime = wallTime() - w;
+  long visited = 0, pushes = coast.size();
+  for (size_t k = 0; k < coast.size(); k++) {
+    checkGrid[coast[k]] = r.grid[coast[k]];
+    open.push(Cell(r.grid[coast[k]], coast[k]));
+  }
+
+  //Points come out lowest first, so the level they flood at for -metrics
+  //only ever moves up
+  size_t level = 0;
+  while (!open.empty() || !pit.empty()) {
+    int c;
+    if (!pit.empty()) {c = pit.front(); pit.pop();}
+    else {c = open.top().second; open.pop();}
+    visited++;
+    float h = checkGrid[c];
+    if (r.s.metrics) {
+      while (level < r.levels.size() && r.levels[level] < h) {level++;}
+      addFlooded(r, level, c);
+    }
+    int next[N];
+    int count = neighbours<N>(c, r.rows, r.cols, next);
+    for (int k = 0; k < count; k++) {
+      int n = next[k];
+      if (r.completionGrid.testAndSet(n)) {continue;}
+      //Ocean and below sea level points count as -1, like in findOcean()
+      float e = (checkGrid[n] == -1) ? -1 : r.grid[n];
+      pushes++;
+      if (e <= h) {
+        checkGrid[n] = h;
+        pit.push(n);
+      }
+      else {
+        checkGrid[n] = e;
+        open.push(Cell(e, n));
+      }
+    }
+  }
+  TRACE_COUNT("cells visited", visited);
+  TRACE_COUNT("queue pushes", pushes);
+  if (r.s.verbose) {
+    printf("Priority flooding takes %f seconds\n", wallTime() - w);
+    fflush(stdout);
+  }
+}
+
+static void collectHeights(const FloodRun* r, int first, int last,
+                           vector<float>* heights) {
+  //Collects the flooding heights of the land points of rows first..last-1
+  //and sorts them
+  for (int i = first; i < last; i++) {
+    for (int j = 0; j < r->cols; j++) {
+      float z = r->grid(i, j);
+      float h = r->checkGrid(i, j);
+      if (z == r->ndval || z <= 0 || h <= 0) {continue;}
+      heights->push_back(h);
+    }
+  }
+  sort(heights->begin(), heights->end());
+}
+
+static void sortFloodHeights(FloodRun& r) {
+  //Sorts the flooding heights of all land points, a band of rows per
+  //thread, and merges the bands, so the flooded land at any sea level is a
+  //binary search
+  TRACE_SCOPE("sort heights");
+  int nthreads = r.s.nthreads;
+  vector<vector<float> > bands(nthreads);
+  vector<thread> threads;
+  int share = (r.rows + nthreads - 1) / nthreads;
+  for (int t = 0; t < nthreads; t++) {
+    threads.push_back(thread(collectHeights, &r, min(r.rows, t*share),
+      min(r.rows, (t+1)*share), &bands[t]));
+  }
+  for (int t = 0; t < nthreads; t++) {threads[t].join();}
+  r.floodHeights.clear();
+  for (int t = 0; t < nthreads; t++) {
+    size_t middle = r.floodHeights.size();
+    r.floodHeights.insert(r.floodHeights.end(), bands[t].begin(),
+      bands[t].end());
+    inplace_merge(r.floodHeights.begin(), r.floodHeights.begin() + middle,
+      r.floodHeights.end());
+  }
+}
+
+//What countIslands() keeps of a stretch of dry land: the step it last
+//changed at, the stretches of the level above it holds if that is the
+//current step, and whether it touches the border
+struct Stretch {
+  int stamp, held;
+  bool border;
+};
+
+template <int N>
+static void countIslands(FloodRun& r) {
+  //Counts the stretches of dry land cut off from the border at every
+  //level. Dry land joins through the neighbours water cannot pass between
+  //(N is 8 when water flows to 4 and the other way round). Going down from
+  //the last level, the points that flood at each level are given back to
+  //the land in the reverse of floodOrder, and a union-find keeps the
+  //stretches. A stretch cut off at one level that is joined to the border
+  //by the land given back on the way down to the level below was cut off
+  //at that level.
+  //
+  //Land that never floods is only taken in when a point given back (or
+  //left on the coastline of the incremental engine) touches it, a stretch
+  //at a time; a stretch cut off from the border always has a point the
+  //water reached, so land that is never visited touches the border and
+  //changes no count.
+  //
+  //parent holds, for a point in the union-find, the point above it, or
+  //for the root of a stretch -2 less the number of the stretch; -1 for
+  //points that are not dry (yet). The numbers of stretches that are
+  //joined into others are used again.
+  vector<int> parent(r.grid.size(), -1);
+  vector<Stretch> stretches;
+  vector<int> unused, touched;
+  queue<int> joining;
+  long islands = 0;
+  int step = r.levels.size();
+  auto find = [&](int c) {
+    while (parent[c] >= 0) {
+      int p = parent[c];
+      if (parent[p] >= 0) {parent[c] = parent[p];}
+      c = p;
+    }
+    return c;
+  };
+  auto stretch = [&](int root) -> Stretch& {
+    return stretches[-parent[root] - 2];
+  };
+  //The stretches of the level above in the stretch with root a
+  auto cut = [&](int a) {
+    Stretch& s = stretch(a);
+    return s.stamp == step ? s.held : !s.border;
+  };
+  //Land that is dry at every level: never flooded, or reached by the
+  //incremental engine and left on its coastline
+  auto neverFloods = [&](int c) {
+    float h = r.checkGrid[c];
+    return h == 0 || (h == -1 && !r.completionGrid[c]);
+  };
+  //Makes point c a stretch of its own, to be joined to the land around it
+  auto start = [&](int c) {
+    int i = c / r.cols, j = c % r.cols;
+    Stretch s = {step, 0, i == 0 || i == r.rows-1 || j == 0 || j == r.cols-1};
+    if (unused.empty()) {
+      unused.push_back(stretches.size());
+      stretches.push_back(s);
+    }
+    parent[c] = -unused.back() - 2;
+    stretches[unused.back()] = s;
+    unused.pop_back();
+    if (!s.border) {islands++;}
+    joining.push(c);
+  };
+  auto add = [&](int c) {
+    if (parent[c] != -1) {return;}
+    start(c);
+    while (!joining.empty()) {
+      int x = joining.front();
+      joining.pop();
+      int next[N];
+      int count = neighbours<N>(x, r.rows, r.cols, next);
+      for (int k = 0; k < count; k++) {
+        int n = next[k];
+        if (parent[n] == -1) {
+          if (!neverFloods(n)) {continue;}
+          start(n);
+        }
+        //The stretch of the neighbour keeps its root, so a point that
+        //joins a stretch adds no step to finding it
+        int a = find(n), b = find(x);
+        if (a == b) {continue;}
+        Stretch& sa = stretch(a);
+        Stretch& sb = stretch(b);
+        int held = cut(a) + cut(b);
+        if (!sa.border || !sb.border) {islands--;}
+        sa.border = sa.border || sb.border;
+        sa.held = held;
+        sa.stamp = step;
+        unused.push_back(-parent[b] - 2);
+        parent[b] = a;
+        touched.push_back(a);
+      }
+    }
+  };
+
+  //What is dry at the last level
+  for (size_t k = 0; k < r.frontier.size(); k++) {add(r.frontier[k]);}
+  size_t next = r.floodOrder.size();
+  auto giveBack = [&](float above) {
+    while (next > 0 && r.checkGrid[r.floodOrder[next-1]] > above) {
+      add(r.floodOrder[--next]);
+    }
+  };
+  if (!r.levels.empty()) {giveBack(r.levels.back());}
+  for (step = (int)r.levels.size() - 1; step >= 0; step--) {
+    r.metrics[step].islands = islands;
+    touched.clear();
+    giveBack(step > 0 ? r.levels[step-1] : -INFINITY);
+    long fresh = 0;
+    for (size_t k = 0; k < touched.size(); k++) {
+      int a = touched[k];
+      if (parent[a] >= -1) {continue;}
+      Stretch& s = stretch(a);
+      if (s.border && s.stamp == step) {
+        fresh += s.held;
+        s.held = 0;
+      }
+    }
+    r.metrics[step].newIslands = fresh;
+  }
+}
+
+static void buildMetrics(FloodRun& r) {
+  //Turns the sums of the levels into the water at each: with N points
+  //flooded whose heights add up to Z, the water at level L is N*L - Z
+  //deep in all, L - Z/N on average and L less the lowest height at most
+  TRACE_SCOPE("metrics");
+  double w = wallTime();
+  double cellArea = r.header.cellsize * r.header.cellsize;
+  r.metrics.resize(r.levels.size());
+  long cells = 0;
+  double z = 0;
+  float minz = INFINITY;
+  for (size_t k = 0; k < r.levels.size(); k++) {
+    cells += r.sums[k].cells;
+    z += r.sums[k].z;
+    minz = min(minz, r.sums[k].minz);
+    LevelMetrics& m = r.metrics[k];
+    double level = r.levels[k];
+    m.level = r.levels[k];
+    m.flooded = cells;
+    m.volume = (cells*level - z) * cellArea;
+    m.meanDepth = cells ? level - z/cells : 0;
+    m.maxDepth = cells ? level - minz : 0;
+  }
+  if (r.s.connectivity == 8) {countIslands<4>(r);}
+  else {countIslands<8>(r);}
+  vector<int>().swap(r.floodOrder);
+  if (r.s.verbose) {
+    printf("Adding up the water and counting islands takes %f seconds\n",
+      wallTime() - w);
+  }
+}
+
+void floodTerrain(FloodRun& r) {
+  //Floods the grid with the engine chosen on the command line and sorts
+  //the flooding heights
+  r.completionGrid.assign(r.rows, r.cols);
+  buildLevels(r);
+  if (r.s.metrics) {
+    LevelSums none = {0, 0, INFINITY};
+    r.sums.assign(r.levels.size(), none);
+    r.floodOrder.clear();
+    r.floodOrder.reserve((size_t)r.initLand);
+  }
+  double w = wallTime();
+  if (r.s.incremental) {
+    r.feet = r.s.floor;
+    r.steps.clear();
+    slr(r);
+    double t = wallTime() - w;
+    if (r.s.verbose) {
+      printf("Running %lu iterations of sea level rise takes %f seconds\n",
+        (unsigned long)r.steps.size(), t);
+      printf("Or approximately %f seconds per iteration\n",
+        r.steps.empty() ? 0 : t/r.steps.size());
+    }
+    //The time of every level is in -stats; only the slowest is shown here
+    size_t slowest = 0;
+    for (size_t l = 1; l < r.steps.size(); l++) {
+      if (r.steps[l].seconds > r.steps[slowest].seconds) {slowest = l;}
+    }
+    if (!r.steps.empty() && r.s.verbose) {
+      printf("The slowest level is %f feet, taking %f seconds\n",
+        r.steps[slowest].level, r.steps[slowest].seconds);
+    }
+  }
+  else {
+    //One pass gives the flooding height of every point, whatever the
+    //increment. feet is left where slr() would have left it.
+    if (r.s.connectivity == 8) {priorityFlood<8>(r);}
+    else {priorityFlood<4>(r);}
+    if (r.s.verbose) {
+      printf("Flooding %lu levels of sea level rise takes %f seconds\n",
+        (unsigned long)r.levels.size(), wallTime() - w);
+    }
+  }
+  sortFloodHeights(r);
+  if (r.s.metrics) {buildMetrics(r);}
+  r.floodTime = wallTime() - w;
+  fflush(stdout);
+}
+
+long floodedCells(const FloodRun& r, float level) {
+  //The land points flooded at level: those whose flooding height is at or
+  //below it, and not above the last level of the run, like the result
+  //grids
+  level = min(level, resultCutoff(r));
+  return upper_bound(r.floodHeights.begin(), r.floodHeights.end(), level) -
+    r.floodHeights.begin();
+}
+
+float resultCutoff(const FloodRun& r) {
+  //Result grids are flooded up to the last level of the run at most, like
+  //floodUp() leaves them: land that only floods above it stays dry, and
+  //hollows below sea level or without data stay as they were classified.
+  //So the grid at the rise, which is above the last level, is the same
+  //with both engines.
+  return r.levels.empty() ? -INFINITY : r.levels.back();
+}
+
+//What resultRow() needs
+struct ResultRows {
+  const FloodRun* r;
+  float level;
+};
+
+static void resultRow(int row, float* out, void* arg) {
+  //One row of the result grid for a sea level: the height above the
+  //water, or 0 where it is flooded
+  const ResultRows& a = *(ResultRows*)arg;
+  const FloodRun& r = *a.r;
+  thresholdFlood(&r.grid(row, 0), &r.checkGrid(row, 0), r.cols, a.level,
+    r.ndval, resultCutoff(r), out);
+}
+
+bool writeResult(const FloodRun& r, const char* filename, float level) {
+  //Moves the grid into a renderable file
+  TRACE_SCOPE("write result");
+  ResultRows a = {&r, level};
+  return writeGrid(filename, r.header, resultRow, &a, r.s.precision,
+    r.s.nthreads);
+}
+
+static void minHeightRow(int row, float* out, void* arg) {
+  //One row of the minimum flooding height grid
+  const FloodRun& r = *(const FloodRun*)arg;
+  for (int col = 0; col < r.cols; col++) {
+    float h = r.checkGrid(row, col);
+    if (h == 0 || (h == -1 && !r.completionGrid(row, col))) {h = r.ndval;}
+    out[col] = h;
+  }
+}
+
+bool writeMinHeight(const FloodRun& r, const char* filename) {
+  //Writes the lowest sea level at which each point floods, so other tools
+  //can threshold it at any level themselves. Ocean is -1 and points that
+  //never flood are NODATA. The priority-flood engine writes exact heights,
+  //the incremental one the level they flooded at, up to the ceiling.
+  TRACE_SCOPE("write minheight");
+  return writeGrid(filename, r.header, minHeightRow, (void*)&r,
+    r.s.precision, r.s.nthreads);
+}
+
+bool writeMetrics(const FloodRun& r, const char* filename) {
+  //One row or object per level, lowest first
+  FILE* f = fopen(filename, "w");
+  if (f == NULL) {
+    printf("cannot write %s\n", filename);
+    return false;
+  }
+  size_t length = strlen(filename);
+  bool csv = length >= 4 && strcasecmp(filename + length - 4, ".csv") == 0;
+  double cellArea = r.header.cellsize * r.header.cellsize;
+  if (csv) {
+    fprintf(f, "level,flooded_cells,flooded_area,volume,mean_depth,"
+      "max_depth,islands,new_islands\n");
+  }
+  else {fprintf(f, "{\"cellsize\": %.10g, \"levels\": [", r.header.cellsize);}
+  for (size_t k = 0; k < r.metrics.size(); k++) {
+    const LevelMetrics& m = r.metrics[k];
+    if (csv) {
+      fprintf(f, "%.9g,%ld,%.10g,%.10g,%.9g,%.9g,%ld,%ld\n", m.level,
+        m.flooded, m.flooded * cellArea, m.volume, m.meanDepth, m.maxDepth,
+        m.islands, m.newIslands);
+    }
+    else {
+      fprintf(f, "%s\n  {\"level\": %.9g, \"flooded_cells\": %ld, "
+        "\"flooded_area\": %.10g, \"volume\": %.10g, \"mean_depth\": %.9g, "
+        "\"max_depth\": %.9g, \"islands\": %ld, \"new_islands\": %ld}",
+        k ? "," : "", m.level, m.flooded, m.flooded * cellArea, m.volume,
+        m.meanDepth, m.maxDepth, m.islands, m.newIslands);
+    }
+  }
+  if (!csv) {fprintf(f, "%s]}\n", r.metrics.empty() ? "" : "\n");}
+  bool ok = !ferror(f);
+  if (fclose(f) != 0) {ok = false;}
+  if (!ok) {
+    printf("cannot write %s\n", filename);
+    remove(filename);
+  }
+  return ok;
+}
+
+string levelFileName(const char* base, float level) {
+  //out.asc at level 2.5 becomes out_2.5.asc
+  string name(base);
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), "_%g", level);
+  size_t dot = name.find_last_of('.');
+  size_t slash = name.find_last_of('/');
+  if (dot == string::npos || (slash != string::npos && dot < slash)) {
+    dot = name.size();
+  }
+  return name.insert(dot, suffix);
+}
+
+void parseLevels(const char* list, vector<float>& levels) {
+  //Reads a comma separated list of levels. An entry a:b:step stands for
+  //a, a+step, ... up to b.
+  string copy(list);
+  char* rest;
+  for (char* entry = strtok_r(&copy[0], ",", &rest); entry != NULL;
+       entry = strtok_r(NULL, ",", &rest)) {
+    float a, b, step;
+    if (sscanf(entry, "%f:%f:%f", &a, &b, &step) == 3 && step > 0) {
+      for (int k = 0; a + k*step <= b + step/1000; k++) {
+        levels.push_back(a + k*step);
+      }
+    }
+    else {levels.push_back(atof(entry));}
+  }
+}
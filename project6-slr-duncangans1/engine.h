@@ -0,0 +1,169 @@
+/* engine.h
+
+  Reading, flooding and writing one terrain grid. Everything a run needs,
+  from the grid to the coastline the incremental engine keeps between
+  levels, is in a FloodRun, and the functions here only touch the run
+  they are given, so any number of grids can be flooded at once on
+  different threads. slr keeps one run for the window; the batch driver
+  in batch.h keeps one per tile in flight.
+
+*/
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <string>
+#include <vector>
+#include "gridio.h"
+#include "raster.h"
+
+//The part of a grid to flood, from -window in points or -bbox in map
+//coordinates. The whole grid when neither is set.
+struct GridWindow {
+  bool points, bbox;
+  //The top left point and the size, for -window
+  int row, col, rows, cols;
+  //The corners, for -bbox
+  double xmin, ymin, xmax, ymax;
+};
+
+//What the command line chooses for a run
+struct FloodSettings {
+  //The flooding goes from floor up to (but not including) ceiling in steps
+  //of increment
+  float floor, ceiling, increment;
+  //-incremental: flood level by level instead of with a priority queue
+  bool incremental;
+  //-nocache turns this off: read .asc files through their binary cache
+  bool useCache;
+  //-connect: water flows to the 4 or the 8 points around a point
+  int connectivity;
+  //Threads for parsing, finding the ocean, sorting and writing
+  int nthreads;
+  //Decimals in written .asc grids, -1 for the shortest exact text
+  int precision;
+  //Print what is being read and how long every stage takes
+  bool verbose;
+  GridWindow window;
+  //-metrics: add up the water at every level while flooding, see
+  //LevelMetrics
+  bool metrics;
+};
+
+//What the incremental engine did at one level
+struct LevelStep {
+  float level;
+  double seconds;
+  //Points flooded at this level, and the coastline left for the next
+  long flooded, coast;
+};
+
+//What the flooding adds up for -metrics about the land points that flood
+//at one level: how many, the sum of their heights and the lowest
+struct LevelSums {
+  long cells;
+  double z;
+  float minz;
+};
+
+//The water at one of the levels of a run
+struct LevelMetrics {
+  float level;
+  //The land points flooded, the water over them (in the height unit times
+  //cellsize squared) and its mean and greatest depth
+  long flooded;
+  double volume, meanDepth, maxDepth;
+  //Stretches of dry land cut off from the border of the grid by the
+  //water, and how many of them were still joined to it at the level below
+  long islands, newIslands;
+};
+
+struct FloodRun {
+  FloodSettings s;
+  //The header of the part of the grid read, and where that part starts in
+  //the whole grid and its size. Without a window they are the same.
+  GridHeader header;
+  int rows, cols;
+  int firstRow, firstCol, gridRows, gridCols;
+  float ndval;
+  //The highest point, and the land points before the flooding
+  float maxz, initLand;
+  //The terrain. When it comes from a grid cache it is the mapped file
+  //itself.
+  Raster<float> grid;
+  //Classifies the points: initially ocean (-1) or land (0), and after the
+  //flooding the land points hold the sea level at which they flood (in
+  //the increment with -incremental, exactly with priority flooding)
+  Raster<float> checkGrid;
+  //Marks the points the flooding has reached
+  BitMask completionGrid;
+  //Points set as ocean by a seed grid, see -seeds
+  std::vector<int> seeds;
+  //The points floodUp() is working through at the current level, and the
+  //coastline it leaves for the next one. They swap every level and keep
+  //their memory, so the flooding does not allocate once they are big
+  //enough.
+  std::vector<int> frontier, nextFrontier;
+  std::vector<LevelStep> steps;
+  //The sea levels floodUp() steps through, from the first increment up to
+  //(but not including) the ceiling, and the level it ends at
+  std::vector<float> levels;
+  float feet;
+  //The flooding heights of all land points that flood, sorted, so the
+  //land flooded at any sea level is found by binary search
+  std::vector<float> floodHeights;
+  //With -metrics: the sums of every level, the points in the order they
+  //flood while the flooding runs, and the table made of them after
+  std::vector<LevelSums> sums;
+  std::vector<int> floodOrder;
+  std::vector<LevelMetrics> metrics;
+  //Wall clock seconds spent reading, flooding and exporting, and the part
+  //of the flooding spent finding the ocean
+  double readTime, floodTime, exportTime, oceanTime;
+};
+
+//Seconds on a monotonic clock
+double wallTime();
+
+//Makes r an empty run with settings s
+void startRun(FloodRun& r, const FloodSettings& s);
+
+//Reads the terrain grid and, if seedfile is not NULL, the seed grid, or
+//only the window of both given in the settings. Prints a message and
+//returns false if either cannot be read or the window is empty.
+bool readTerrain(FloodRun& r, const char* input, const char* seedfile);
+
+//Builds the sea levels the incremental engine visits
+void buildLevels(FloodRun& r);
+
+//Floods the grid with the engine chosen in the settings and sorts the
+//flooding heights
+void floodTerrain(FloodRun& r);
+
+//Land points flooded at sea level level, as in the result grid written
+//for it: no more than at resultCutoff()
+long floodedCells(const FloodRun& r, float level);
+
+//The highest level result grids are flooded to, the last of the run;
+//points that flood above it stay as classified
+float resultCutoff(const FloodRun& r);
+
+//Write the terrain at sea level level, with the water at 0, or the lowest
+//sea level at which each point floods. The format follows the file name,
+//see gridwrite.h. Both print a message and return false on failure.
+bool writeResult(const FloodRun& r, const char* filename, float level);
+bool writeMinHeight(const FloodRun& r, const char* filename);
+
+//Writes the metrics of every level as CSV for a .csv file name, and as
+//JSON otherwise. Prints a message and returns false on failure.
+bool writeMetrics(const FloodRun& r, const char* filename);
+
+//The result grid for one of several levels: out.asc at level 2.5 becomes
+//out_2.5.asc
+std::string levelFileName(const char* base, float level);
+
+//Adds the levels of a comma separated list to levels; an entry a:b:step
+//stands for a, a+step, ... up to b
+void parseLevels(const char* list, std::vector<float>& levels);
+
+#endif
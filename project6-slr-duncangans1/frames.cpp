@@ -0,0 +1,347 @@
+/* frames.cpp
+
+  Software frames and animations, see frames.h. writeFrames() is a
+  pipeline of two threads. The second thread keeps the colours of the last
+  level it has done and, for each level, goes over the points once, in
+  slices on all threads, and queues the pixels whose colour changes; the
+  main thread takes the changes in order, patches its frame with them and
+  writes it. The queue is short, so the second thread stays only a few
+  levels ahead.
+
+  PNG files are written without filtering, compressed for speed with
+  zlib, which the program links for the grid cache already.
+
+*/
+
+#include "frames.h"
+#include "mesh.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <zlib.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+//Levels the second thread may be ahead of the frames written
+static const size_t AHEAD = 4;
+
+void pointColour(float height, float type, float feet, float maxz,
+                 int seavis, float rgb[3]) {
+  //Land takes the ramp colour of its height above the sea, the ocean a
+  //deep blue, and flooded land a blue that is lighter where it is shallow
+  float margin = height - feet;
+  if (type == 0 || type >= feet) {
+    int k = 0;
+    while (k < RAMPSIZE && margin >= RAMP[k].limit*maxz) {k++;}
+    if (k < RAMPSIZE) {
+      rgb[0] = RAMP[k].r;
+      rgb[1] = RAMP[k].g;
+      rgb[2] = RAMP[k].b;
+    }
+    else {memcpy(rgb, RAMPTOP, 3*sizeof(float));}
+  }
+  else if (type == -1) {
+    rgb[0] = .1;
+    rgb[1] = .1;
+    rgb[2] = .9;
+  }
+  else {
+    rgb[0] = .1;
+    rgb[1] = (height+seavis - feet)/seavis - .1;
+    rgb[2] = .8;
+  }
+}
+
+//A colour channel as a byte, clamped like OpenGL does
+static unsigned char toByte(float c) {
+  return (unsigned char)(max(0.0f, min(1.0f, c)) * 255 + .5f);
+}
+
+//The pixels of a frame of the grid: their height and flooding level, so
+//the colours are worked out from two arrays instead of the grid
+struct Samples {
+  int width, height;
+  vector<float> z, type;
+};
+
+static void takeSamples(const Raster<float>& grid,
+                        const Raster<float>& checkGrid, int step,
+                        Samples& s) {
+  step = max(step, 1);
+  s.width = (grid.cols() + step - 1) / step;
+  s.height = (grid.rows() + step - 1) / step;
+  s.z.resize((size_t)s.width * s.height);
+  s.type.resize(s.z.size());
+  size_t k = 0;
+  for (int i = 0; i < s.height; i++) {
+    for (int j = 0; j < s.width; j++, k++) {
+      s.z[k] = grid(i*step, j*step);
+      s.type[k] = checkGrid(i*step, j*step);
+    }
+  }
+}
+
+//The colours of pixels first to last at sea level feet, into rgb from
+//pixel first. This is pointColour() with the ramp turned into bytes and
+//heights above the sea once per level.
+static void colourSamples(const Samples& s, size_t first, size_t last,
+                          float feet, float maxz, int seavis,
+                          unsigned char* rgb) {
+  float limit[RAMPSIZE];
+  unsigned char ramp[RAMPSIZE+1][3];
+  for (int k = 0; k < RAMPSIZE; k++) {
+    limit[k] = RAMP[k].limit*maxz;
+    ramp[k][0] = toByte(RAMP[k].r);
+    ramp[k][1] = toByte(RAMP[k].g);
+    ramp[k][2] = toByte(RAMP[k].b);
+  }
+  //A margin past every limit gets the top colour
+  for (int b = 0; b < 3; b++) {ramp[RAMPSIZE][b] = toByte(RAMPTOP[b]);}
+  unsigned char blue = toByte(.1), ocean = toByte(.9), flooded = toByte(.8);
+  for (size_t k = first; k < last; k++) {
+    float height = s.z[k], type = s.type[k];
+    unsigned char* p = rgb + 3*(k - first);
+    if (type == 0 || type >= feet) {
+      float margin = height - feet;
+      int r = 0;
+      while (r < RAMPSIZE && margin >= limit[r]) {r++;}
+      p[0] = ramp[r][0];
+      p[1] = ramp[r][1];
+      p[2] = ramp[r][2];
+    }
+    else if (type == -1) {
+      p[0] = blue;
+      p[1] = blue;
+      p[2] = ocean;
+    }
+    else {
+      p[0] = blue;
+      p[1] = toByte((height+seavis - feet)/seavis - .1);
+      p[2] = flooded;
+    }
+  }
+}
+
+void renderFrame(const Raster<float>& grid, const Raster<float>& checkGrid,
+                 int step, float feet, float maxz, int seavis, Frame& f) {
+  Samples s;
+  takeSamples(grid, checkGrid, step, s);
+  f.width = s.width;
+  f.height = s.height;
+  f.rgb.resize(3 * s.z.size());
+  colourSamples(s, 0, s.z.size(), feet, maxz, seavis, f.rgb.data());
+}
+
+//Writes v big-endian, as PNG wants
+static void putWord(unsigned char* p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static bool writeChunk(FILE* out, const char* type, const unsigned char* data,
+                       size_t size) {
+  unsigned char head[8];
+  putWord(head, size);
+  memcpy(head + 4, type, 4);
+  uLong crc = crc32(crc32(0, NULL, 0), head + 4, 4);
+  if (size) {crc = crc32(crc, data, size);}
+  unsigned char tail[4];
+  putWord(tail, crc);
+  return fwrite(head, 1, 8, out) == 8 &&
+    (size == 0 || fwrite(data, 1, size, out) == size) &&
+    fwrite(tail, 1, 4, out) == 4;
+}
+
+static bool writePNG(FILE* out, const Frame& f) {
+  //Every row starts with filter type 0, none
+  size_t line = 3 * (size_t)f.width;
+  vector<unsigned char> raw((line + 1) * f.height);
+  for (int i = 0; i < f.height; i++) {
+    raw[i * (line + 1)] = 0;
+    memcpy(&raw[i * (line + 1) + 1], &f.rgb[i * line], line);
+  }
+  uLongf packed = compressBound(raw.size());
+  vector<unsigned char> data(packed);
+  if (compress2(data.data(), &packed, raw.data(), raw.size(),
+                Z_BEST_SPEED) != Z_OK) {
+    return false;
+  }
+  static const unsigned char SIGNATURE[8] = {137, 'P', 'N', 'G', '\r', '\n',
+                                             26, '\n'};
+  //Width, height, 8 bits per channel, RGB, and the default methods
+  unsigned char header[13] = {0};
+  putWord(header, f.width);
+  putWord(header + 4, f.height);
+  header[8] = 8;
+  header[9] = 2;
+  return fwrite(SIGNATURE, 1, 8, out) == 8 &&
+    writeChunk(out, "IHDR", header, 13) &&
+    writeChunk(out, "IDAT", data.data(), packed) &&
+    writeChunk(out, "IEND", NULL, 0);
+}
+
+static bool endsWith(const string& s, const char* end) {
+  size_t n = strlen(end);
+  return s.size() >= n && s.compare(s.size() - n, n, end) == 0;
+}
+
+bool writeFrame(const char* filename, const Frame& f) {
+  TRACE_SCOPE("write frame");
+  FILE* out = fopen(filename, "wb");
+  if (out == NULL) {
+    printf("cannot open %s\n", filename);
+    return false;
+  }
+  bool ok;
+  if (endsWith(filename, ".png")) {ok = writePNG(out, f);}
+  else {
+    fprintf(out, "P6\n%d %d\n255\n", f.width, f.height);
+    ok = fwrite(f.rgb.data(), 1, f.rgb.size(), out) == f.rgb.size();
+  }
+  if (fclose(out) != 0) {ok = false;}
+  if (!ok) {printf("cannot write %s\n", filename);}
+  return ok;
+}
+
+string frameName(const char* prefix, long k) {
+  string name(prefix);
+  size_t dot = name.find_last_of('.');
+  size_t slash = name.find_last_of('/');
+  if (dot == string::npos || (slash != string::npos && dot < slash)) {
+    dot = name.size();
+    name += ".ppm";
+  }
+  char number[32];
+  snprintf(number, sizeof(number), "_%04ld", k);
+  return name.insert(dot, number);
+}
+
+//The pixels that change colour from one level to the next, and their new
+//colours
+struct FrameChange {
+  vector<uint32_t> pixels;
+  vector<unsigned char> rgb;
+};
+
+struct ChangeQueue {
+  mutex lock;
+  condition_variable changed;
+  deque<FrameChange> waiting;
+  bool stop;
+};
+
+//Pixels coloured at once, small enough to stay in the cache
+static const size_t BLOCK = 4096;
+
+//Finds the changes of pixels first to last at sea level feet against
+//shown, the colours they had, and brings shown up to date. With all set
+//every pixel is taken as changed.
+static void sliceChanges(const Samples& s, size_t first, size_t last,
+                         float feet, float maxz, int seavis, bool all,
+                         unsigned char* shown, FrameChange& c) {
+  unsigned char now[3*BLOCK];
+  for (size_t b = first; b < last; b += BLOCK) {
+    size_t e = min(last, b + BLOCK);
+    colourSamples(s, b, e, feet, maxz, seavis, now);
+    for (size_t k = b; k < e; k++) {
+      const unsigned char* p = &now[3*(k - b)];
+      unsigned char* o = &shown[3*k];
+      if (!all && p[0] == o[0] && p[1] == o[1] && p[2] == o[2]) {continue;}
+      c.pixels.push_back(k);
+      c.rgb.insert(c.rgb.end(), p, p + 3);
+      o[0] = p[0];
+      o[1] = p[1];
+      o[2] = p[2];
+    }
+  }
+}
+
+//The second thread: queues the changes for every level in turn, going
+//over slices of the pixels on nthreads threads. The first level changes
+//every pixel.
+static void findChanges(const Samples* s, const vector<float>* levels,
+                        float maxz, int seavis, int nthreads,
+                        ChangeQueue* q) {
+  size_t n = s->z.size();
+  int parts = max(1, min(nthreads, (int)(n / BLOCK)));
+  vector<unsigned char> shown(3*n);
+  vector<FrameChange> part(parts);
+  for (size_t l = 0; l < levels->size(); l++) {
+    FrameChange c;
+    {
+      TRACE_SCOPE("frame changes");
+      vector<thread> threads;
+      for (int t = 0; t < parts; t++) {
+        part[t].pixels.clear();
+        part[t].rgb.clear();
+        threads.push_back(thread([&, t] {
+          sliceChanges(*s, n * t / parts, n * (t+1) / parts, (*levels)[l],
+            maxz, seavis, l == 0, shown.data(), part[t]);
+        }));
+      }
+      for (int t = 0; t < parts; t++) {
+        threads[t].join();
+        c.pixels.insert(c.pixels.end(), part[t].pixels.begin(),
+          part[t].pixels.end());
+        c.rgb.insert(c.rgb.end(), part[t].rgb.begin(), part[t].rgb.end());
+      }
+    }
+    unique_lock<mutex> g(q->lock);
+    q->changed.wait(g, [&] {return q->stop || q->waiting.size() < AHEAD;});
+    if (q->stop) {return;}
+    q->waiting.push_back(move(c));
+    q->changed.notify_all();
+  }
+}
+
+long writeFrames(const char* prefix, const Raster<float>& grid,
+                 const Raster<float>& checkGrid, int step,
+                 const vector<float>& levels, float maxz, int seavis,
+                 int nthreads) {
+  Samples s;
+  takeSamples(grid, checkGrid, step, s);
+  Frame f;
+  f.width = s.width;
+  f.height = s.height;
+  f.rgb.assign(3 * s.z.size(), 0);
+  ChangeQueue q;
+  q.stop = false;
+  thread ahead(findChanges, &s, &levels, maxz, seavis, nthreads, &q);
+  long written = 0;
+  for (size_t l = 0; l < levels.size(); l++) {
+    FrameChange c;
+    {
+      unique_lock<mutex> g(q.lock);
+      q.changed.wait(g, [&] {return !q.waiting.empty();});
+      c = move(q.waiting.front());
+      q.waiting.pop_front();
+      q.changed.notify_all();
+    }
+    for (size_t k = 0; k < c.pixels.size(); k++) {
+      memcpy(&f.rgb[3 * (size_t)c.pixels[k]], &c.rgb[3*k], 3);
+    }
+    TRACE_COUNT("changed pixels", (long)c.pixels.size());
+    if (!writeFrame(frameName(prefix, l).c_str(), f)) {
+      written = -1;
+      break;
+    }
+    written++;
+  }
+  {
+    lock_guard<mutex> g(q.lock);
+    q.stop = true;
+  }
+  q.changed.notify_all();
+  ahead.join();
+  return written;
+}
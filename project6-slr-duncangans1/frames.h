@@ -0,0 +1,56 @@
+/* frames.h
+
+  Pictures of the flooding without a window. A frame is drawn in software,
+  from straight above with north up, one pixel for every increment points
+  of the grid, in the colours of getColor(), and written as a PPM or PNG
+  file. An animation is a frame per sea level, numbered so a video encoder
+  can take them in order.
+
+  Between two sea levels only some pixels change colour: the points that
+  flood, land whose height above the sea crosses a step of the colour
+  ramp, and shallow water that gets deeper. While one frame is written, a
+  second thread works out these changes for the next levels, so writing a
+  frame only touches the pixels that changed.
+
+*/
+
+#ifndef FRAMES_H
+#define FRAMES_H
+
+#include <string>
+#include <vector>
+#include "raster.h"
+
+//A picture, rows from the top, three bytes (red, green, blue) per pixel
+struct Frame {
+  int width, height;
+  std::vector<unsigned char> rgb;
+};
+
+//The colour of a point at height height with flooding level type, as in
+//checkGrid, when the sea is at feet. This is getColor(), and the shader
+//in mesh.cpp does the same.
+void pointColour(float height, float type, float feet, float maxz,
+                 int seavis, float rgb[3]);
+
+//Draws the grid at sea level feet, taking every step-th point
+void renderFrame(const Raster<float>& grid, const Raster<float>& checkGrid,
+                 int step, float feet, float maxz, int seavis, Frame& f);
+
+//Writes f as a PNG file if filename ends in .png, and as a binary PPM
+//file otherwise. Prints a message and returns false on failure.
+bool writeFrame(const char* filename, const Frame& f);
+
+//The name of frame number k: flood.png becomes flood_0007.png, and a
+//name without an extension gets .ppm
+std::string frameName(const char* prefix, long k);
+
+//Writes a frame for each sea level in levels, named with frameName(),
+//working out the changes on nthreads threads. Returns the number of frames written, or -1 after printing a message if
+//one cannot be written.
+long writeFrames(const char* prefix, const Raster<float>& grid,
+                 const Raster<float>& checkGrid, int step,
+                 const std::vector<float>& levels, float maxz, int seavis,
+                 int nthreads);
+
+#endif
@@ -0,0 +1,143 @@
+/* gendem.cpp
+
+  Synthetic terrain grids for benchmarking slr. The terrain is fractal
+  noise, a sum of octaves of smoothed random values on coarser and finer
+  lattices, shaped into one of three kinds of coast:
+
+    fractal   an island: rough hills falling to the ocean on every side
+    flats     tidal flats: low, nearly level land rising slowly from the
+              ocean in the west, full of shallow basins
+    coast     a steep coast: the ocean in the west and land climbing
+              quickly from a ragged coastline
+
+  Roughness is how much each octave keeps of the one before it, between 0
+  and 1: low values give smooth terrain, high values broken terrain with
+  many small pits. Every point is worked out from its position alone, so
+  rows are produced as they are written and grids of any size can be
+  made. The output format follows the file name, as for slr.
+
+  usage: gendem <fractal|flats|coast> <rows> <cols> <roughness> <seed> <grid>
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <thread>
+#include "gridio.h"
+#include "gridwrite.h"
+
+using namespace std;
+
+enum Kind {FRACTAL, FLATS, COAST};
+
+struct Terrain {
+  Kind kind;
+  int rows, cols;
+  float roughness;
+  uint32_t seed;
+  int octaves;
+};
+
+static float lattice(int x, int y, uint32_t seed) {
+  //A random value in [0, 1) for every lattice point
+  uint32_t h = (uint32_t)x * 0x8da6b343u ^ (uint32_t)y * 0xd8163841u ^ seed;
+  h ^= h >> 13;
+  h *= 0x5bd1e995u;
+  h ^= h >> 15;
+  return (h & 0xffffff) / 16777216.0f;
+}
+
+static float smoothNoise(float x, float y, uint32_t seed) {
+  //Values between the lattice points, blended with a smooth step
+  int x0 = (int)floorf(x), y0 = (int)floorf(y);
+  float fx = x - x0, fy = y - y0;
+  fx = fx*fx*(3 - 2*fx);
+  fy = fy*fy*(3 - 2*fy);
+  float a = lattice(x0, y0, seed), b = lattice(x0+1, y0, seed);
+  float c = lattice(x0, y0+1, seed), d = lattice(x0+1, y0+1, seed);
+  return (a + (b-a)*fx) + ((c + (d-c)*fx) - (a + (b-a)*fx))*fy;
+}
+
+static float fractalNoise(const Terrain& t, float x, float y) {
+  //Octaves of noise, each twice as fine and roughness times as strong as
+  //the one before, scaled to [0, 1)
+  float sum = 0, amplitude = 1, total = 0;
+  for (int o = 0; o < t.octaves; o++) {
+    sum += amplitude * smoothNoise(x, y, t.seed + o*0x9e3779b9u);
+    total += amplitude;
+    amplitude *= t.roughness;
+    x *= 2;
+    y *= 2;
+  }
+  return sum / total;
+}
+
+static float height(const Terrain& t, int i, int j) {
+  //Height in feet of point (i, j). The coarsest octave has four lattice
+  //cells across the grid.
+  float scale = 4.0f / max(t.rows, t.cols);
+  float n = fractalNoise(t, j*scale, i*scale);
+  float x = (float)j / t.cols;
+  switch (t.kind) {
+  case FRACTAL: {
+    //Distance to the nearest border, 1 in the middle
+    float d = min(min(i, t.rows-1-i), min(j, t.cols-1-j))
+      / (min(t.rows, t.cols) / 2.0f);
+    return 160*(n - 0.45f) + 80*(d - 0.3f);
+  }
+  case FLATS:
+    return 3*(n - 0.5f) + 12*x - 1;
+  case COAST: {
+    //The coastline wanders with a noise of its own along the rows
+    float shore = 0.3f + 0.2f*(smoothNoise(0.5f, i*scale*2, t.seed ^ 0xabcdu)
+      - 0.5f);
+    return 400*(x - shore) + 40*(n - 0.5f);
+  }
+  }
+  return 0;
+}
+
+static void terrainRow(int i, float* out, void* arg) {
+  const Terrain& t = *(const Terrain*)arg;
+  for (int j = 0; j < t.cols; j++) {out[j] = height(t, i, j);}
+}
+
+int main(int argc, char** argv) {
+  if (argc != 7) {
+    printf("usage: %s <fractal|flats|coast> <rows> <cols> <roughness> "
+      "<seed> <grid>\n", argv[0]);
+    exit(1);
+  }
+  Terrain t;
+  if (strcmp(argv[1], "fractal") == 0) {t.kind = FRACTAL;}
+  else if (strcmp(argv[1], "flats") == 0) {t.kind = FLATS;}
+  else if (strcmp(argv[1], "coast") == 0) {t.kind = COAST;}
+  else {
+    printf("unknown terrain %s\n", argv[1]);
+    exit(1);
+  }
+  t.rows = atoi(argv[2]);
+  t.cols = atoi(argv[3]);
+  t.roughness = atof(argv[4]);
+  t.seed = strtoul(argv[5], NULL, 10);
+  if (t.rows < 2 || t.cols < 2 || t.roughness <= 0 || t.roughness >= 1) {
+    printf("need at least 2 rows and columns and a roughness in (0, 1)\n");
+    exit(1);
+  }
+  //Octaves down to about one point per lattice cell
+  t.octaves = max(1, (int)ceil(log2(max(t.rows, t.cols) / 4.0)));
+
+  GridHeader h;
+  h.nrows = t.rows;
+  h.ncols = t.cols;
+  h.xllcorner = h.yllcorner = 0;
+  h.cellsize = 1;
+  h.ndval = -9999;
+  int nthreads = max(1, (int)thread::hardware_concurrency());
+  if (!writeGrid(argv[6], h, terrainRow, &t, -1, nthreads)) {exit(1);}
+  return 0;
+}
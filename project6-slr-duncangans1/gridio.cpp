@@ -0,0 +1,311 @@
+/* gridio.cpp
+
+  The .asc header parser and the binary grid cache. The cache layout is
+
+    bytes  0-7   "SLRG" and the format version (uint32)
+    bytes  8-15  ncols, nrows (int32)
+    bytes 16-39  xllcorner, yllcorner, cellsize (float64)
+    bytes 40-43  NODATA value (float32)
+    bytes 44-47  offset of the raster (uint32), currently 64
+    bytes 48-55  size of the grid the cache was made from (int64)
+    bytes 56-63  its modification time in nanoseconds (int64)
+    then nrows*ncols float32 values, row after row
+
+  Everything is little-endian. The raster starts on a 64 byte boundary so
+  the mapped floats can be used directly. Bytes 48-63 are zero for binary
+  grids not made from another file.
+
+*/
+
+#include "gridio.h"
+
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const char MAGIC[4] = {'S', 'L', 'R', 'G'};
+static const uint32_t VERSION = 1;
+static const uint32_t DATAOFFSET = GRIDCACHE_HEADER;
+
+bool hostIsLittleEndian() {
+  uint16_t one = 1;
+  return *(uint8_t*)&one == 1;
+}
+
+void copyLE(void* dst, const void* src, int n) {
+  if (hostIsLittleEndian()) {memcpy(dst, src, n); return;}
+  for (int k = 0; k < n; k++) {
+    ((uint8_t*)dst)[k] = ((const uint8_t*)src)[n-1-k];
+  }
+}
+
+bool readAscHeader(FILE* f, GridHeader& h) {
+  //The header is a list of "key value" lines. ncols and nrows are needed,
+  //the rest default to values that keep moveToFile() output readable.
+  char key[100];
+  double value;
+  h.ncols = h.nrows = -1;
+  h.xllcorner = h.yllcorner = 0;
+  h.cellsize = 1;
+  h.ndval = -9999;
+  while (true) {
+    long start = ftell(f);
+    if (fscanf(f, "%99s", key) != 1) {return false;}
+    if (!isalpha((unsigned char)key[0])) {
+      //First value of the grid, so the header is finished
+      fseek(f, start, SEEK_SET);
+      break;
+    }
+    if (fscanf(f, "%lf", &value) != 1) {return false;}
+    if (strcasecmp(key, "ncols") == 0) {h.ncols = (int)value;}
+    else if (strcasecmp(key, "nrows") == 0) {h.nrows = (int)value;}
+    else if (strncasecmp(key, "xll", 3) == 0) {h.xllcorner = value;}
+    else if (strncasecmp(key, "yll", 3) == 0) {h.yllcorner = value;}
+    else if (strcasecmp(key, "cellsize") == 0) {h.cellsize = value;}
+    else if (strcasecmp(key, "nodata_value") == 0) {h.ndval = (float)value;}
+  }
+  return h.ncols > 0 && h.nrows > 0;
+}
+
+string gridCachePath(const char* ascfile) {
+  string path(ascfile);
+  size_t dot = path.find_last_of('.');
+  size_t slash = path.find_last_of('/');
+  if (dot != string::npos && (slash == string::npos || dot > slash)) {
+    path.erase(dot);
+  }
+  return path + ".slrg";
+}
+
+bool isGridCache(const char* filename) {
+  FILE* f = fopen(filename, "rb");
+  if (f == NULL) {return false;}
+  char magic[4];
+  bool ok = fread(magic, 1, 4, f) == 4 && memcmp(magic, MAGIC, 4) == 0;
+  fclose(f);
+  return ok;
+}
+
+//The size and modification time of source, all zero if there is none
+static void sourceStamp(const char* source, int64_t stamp[2]) {
+  struct stat st;
+  stamp[0] = stamp[1] = 0;
+  if (source == NULL || stat(source, &st) != 0) {return;}
+  stamp[0] = st.st_size;
+  //Darwin keeps the time in a field of another name
+#ifdef __APPLE__
+  const struct timespec& mtime = st.st_mtimespec;
+#else
+  const struct timespec& mtime = st.st_mtim;
+#endif
+  stamp[1] = (int64_t)mtime.tv_sec * 1000000000 + mtime.tv_nsec;
+}
+
+bool gridCacheIsFresh(const char* ascfile, const char* cachefile) {
+  //A cache is only used for the very file it was made from: another grid
+  //with the same name but another extension, or the same file changed
+  //since, has another size or time
+  FILE* f = fopen(cachefile, "rb");
+  if (f == NULL) {return false;}
+  uint8_t header[GRIDCACHE_HEADER];
+  bool ok = fread(header, 1, GRIDCACHE_HEADER, f) == GRIDCACHE_HEADER;
+  fclose(f);
+  struct stat a;
+  if (stat(ascfile, &a) != 0) {return ok;}
+  int64_t want[2], have[2];
+  sourceStamp(ascfile, want);
+  copyLE(&have[0], header+48, 8);
+  copyLE(&have[1], header+56, 8);
+  return ok && have[0] == want[0] && have[1] == want[1];
+}
+
+void encodeGridHeader(const GridHeader& h, unsigned char header[GRIDCACHE_HEADER],
+                      const char* source) {
+  memset(header, 0, GRIDCACHE_HEADER);
+  int32_t ncols = h.ncols, nrows = h.nrows;
+  memcpy(header, MAGIC, 4);
+  copyLE(header+4, &VERSION, 4);
+  copyLE(header+8, &ncols, 4);
+  copyLE(header+12, &nrows, 4);
+  copyLE(header+16, &h.xllcorner, 8);
+  copyLE(header+24, &h.yllcorner, 8);
+  copyLE(header+32, &h.cellsize, 8);
+  copyLE(header+40, &h.ndval, 4);
+  copyLE(header+44, &DATAOFFSET, 4);
+  int64_t stamp[2];
+  sourceStamp(source, stamp);
+  copyLE(header+48, &stamp[0], 8);
+  copyLE(header+56, &stamp[1], 8);
+}
+
+void floatsToLittleEndian(float* values, size_t n) {
+  if (hostIsLittleEndian()) {return;}
+  for (size_t k = 0; k < n; k++) {
+    float v = values[k];
+    copyLE(&values[k], &v, 4);
+  }
+}
+
+bool writeGridCache(const char* cachefile, const char* source,
+                    const GridHeader& h,
+                    const float* (*row)(int i, void* arg), void* arg) {
+  FILE* f = fopen(cachefile, "wb");
+  if (f == NULL) {return false;}
+
+  uint8_t header[DATAOFFSET];
+  encodeGridHeader(h, header, source);
+  bool ok = fwrite(header, 1, DATAOFFSET, f) == DATAOFFSET;
+
+  float* swapped = NULL;
+  if (!hostIsLittleEndian()) {swapped = new float[h.ncols];}
+  for (int i = 0; ok && i < h.nrows; i++) {
+    const float* values = row(i, arg);
+    if (swapped) {
+      for (int j = 0; j < h.ncols; j++) {copyLE(&swapped[j], &values[j], 4);}
+      values = swapped;
+    }
+    ok = fwrite(values, sizeof(float), h.ncols, f) == (size_t)h.ncols;
+  }
+  delete[] swapped;
+
+  if (fclose(f) != 0) {ok = false;}
+  if (!ok) {remove(cachefile);}
+  return ok;
+}
+
+//Reads a binary grid header and checks it against the size of the file
+static bool decodeGridHeader(const uint8_t* header, uint64_t size,
+                             GridHeader& h, uint32_t& offset) {
+  uint32_t version;
+  int32_t ncols, nrows;
+  copyLE(&version, header+4, 4);
+  copyLE(&ncols, header+8, 4);
+  copyLE(&nrows, header+12, 4);
+  copyLE(&h.xllcorner, header+16, 8);
+  copyLE(&h.yllcorner, header+24, 8);
+  copyLE(&h.cellsize, header+32, 8);
+  copyLE(&h.ndval, header+40, 4);
+  copyLE(&offset, header+44, 4);
+  h.ncols = ncols;
+  h.nrows = nrows;
+  return memcmp(header, MAGIC, 4) == 0 && version == VERSION && ncols > 0 &&
+    nrows > 0 && size >= offset + (uint64_t)ncols*nrows*sizeof(float);
+}
+
+bool mapGridCache(const char* cachefile, MappedGrid& m) {
+  int fd = open(cachefile, O_RDONLY);
+  if (fd < 0) {return false;}
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)DATAOFFSET) {
+    close(fd);
+    return false;
+  }
+  void* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {return false;}
+
+  const uint8_t* header = (const uint8_t*)base;
+  uint32_t offset;
+  if (!decodeGridHeader(header, st.st_size, m.h, offset)) {
+    munmap(base, st.st_size);
+    return false;
+  }
+  int ncols = m.h.ncols, nrows = m.h.nrows;
+  //The whole raster is about to be read front to back
+  madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+  m.base = base;
+  m.length = st.st_size;
+  m.data = (const float*)(header + offset);
+  if (!hostIsLittleEndian()) {
+    //Byte-swapped copy; the mapping is released straight away
+    size_t n = (size_t)ncols*nrows;
+    float* copy = (float*)malloc(n*sizeof(float));
+    for (size_t k = 0; k < n; k++) {copyLE(&copy[k], &m.data[k], 4);}
+    munmap(base, st.st_size);
+    m.base = copy;
+    m.length = 0;
+    m.data = copy;
+  }
+  return true;
+}
+
+void releaseGridCache(void* base, size_t length) {
+  if (base == NULL) {return;}
+  if (length == 0) {free(base);}
+  else {munmap(base, length);}
+}
+
+void unmapGridCache(MappedGrid& m) {
+  releaseGridCache(m.base, m.length);
+  m.base = NULL;
+  m.data = NULL;
+}
+
+bool openGridFile(const char* filename, GridFile& g, bool create) {
+  g.fd = create ? open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644)
+    : open(filename, O_RDONLY);
+  if (g.fd < 0) {return false;}
+  uint8_t header[DATAOFFSET];
+  if (create) {
+    //The raster is sized up front so rows can be written in any order
+    encodeGridHeader(g.h, header);
+    g.offset = DATAOFFSET;
+    off_t size = DATAOFFSET + (off_t)g.h.ncols*g.h.nrows*sizeof(float);
+    if (pwrite(g.fd, header, DATAOFFSET, 0) == (ssize_t)DATAOFFSET &&
+        ftruncate(g.fd, size) == 0) {
+      return true;
+    }
+  }
+  else {
+    struct stat st;
+    uint32_t offset;
+    if (fstat(g.fd, &st) == 0 &&
+        pread(g.fd, header, DATAOFFSET, 0) == (ssize_t)DATAOFFSET &&
+        decodeGridHeader(header, st.st_size, g.h, offset)) {
+      g.offset = offset;
+      return true;
+    }
+  }
+  close(g.fd);
+  g.fd = -1;
+  return false;
+}
+
+bool closeGridFile(GridFile& g) {
+  if (g.fd < 0) {return true;}
+  bool ok = close(g.fd) == 0;
+  g.fd = -1;
+  return ok;
+}
+
+//Where point (i, j) of g is in the file
+static off_t gridFilePosition(const GridFile& g, int i, int j) {
+  return g.offset + ((off_t)i*g.h.ncols + j)*sizeof(float);
+}
+
+bool readGridRow(const GridFile& g, int i, int first, int n, float* out) {
+  size_t bytes = n*sizeof(float);
+  if (pread(g.fd, out, bytes, gridFilePosition(g, i, first)) != (ssize_t)bytes) {
+    return false;
+  }
+  floatsToLittleEndian(out, n);
+  return true;
+}
+
+bool writeGridRow(const GridFile& g, int i, int first, int n, float* values) {
+  size_t bytes = n*sizeof(float);
+  floatsToLittleEndian(values, n);
+  bool ok = pwrite(g.fd, values, bytes, gridFilePosition(g, i, first)) ==
+    (ssize_t)bytes;
+  floatsToLittleEndian(values, n);
+  return ok;
+}
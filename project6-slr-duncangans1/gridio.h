@@ -0,0 +1,98 @@
+/* gridio.h
+
+  Reading and writing terrain grids. Besides the .asc header, this holds
+  the binary grid cache: a small header followed by the raster as one
+  contiguous block of little-endian float32 values, row after row. Once an
+  .asc file has been converted, later runs map the cache into memory
+  instead of parsing text.
+
+*/
+
+#ifndef GRIDIO_H
+#define GRIDIO_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string>
+
+//The values in the header of an .asc file
+struct GridHeader {
+  int ncols, nrows;
+  double xllcorner, yllcorner, cellsize;
+  float ndval;
+};
+
+//A binary grid cache mapped into memory. data points at nrows*ncols floats
+struct MappedGrid {
+  GridHeader h;
+  const float* data;
+  void* base;
+  size_t length;
+};
+
+//A binary grid opened for reading or writing parts of rows, for grids too
+//big to have in memory. The calls are safe from several threads at once.
+struct GridFile {
+  GridHeader h;
+  int fd;
+  long offset;
+};
+
+//Reads the key/value header at the start of an .asc file and leaves f at
+//the first value of the grid. Returns false if the header is malformed.
+bool readAscHeader(FILE* f, GridHeader& h);
+
+//Name of the cache file for an .asc file: the extension becomes .slrg
+std::string gridCachePath(const char* ascfile);
+
+//True if filename starts with the binary grid magic
+bool isGridCache(const char* filename);
+
+//True if cachefile exists and was made from ascfile as it is now: the
+//size and modification time kept in its header are those of ascfile. A
+//cache whose .asc file is gone is used as it is.
+bool gridCacheIsFresh(const char* ascfile, const char* cachefile);
+
+//Size of the binary grid header, and where the raster starts
+const int GRIDCACHE_HEADER = 64;
+
+//Fills in the binary grid header for h, made from the file source if it
+//is not NULL
+void encodeGridHeader(const GridHeader& h, unsigned char header[GRIDCACHE_HEADER],
+                      const char* source = NULL);
+
+//Copies n bytes, reversing their order on big-endian hosts: the files
+//written here are little-endian whatever the machine
+void copyLE(void* dst, const void* src, int n);
+bool hostIsLittleEndian();
+
+//Puts n floats in little-endian byte order (nothing to do on most hosts)
+void floatsToLittleEndian(float* values, size_t n);
+
+//Writes the binary grid cache of the file source. row(i, arg) must return
+//the ncols values of row i. Returns false (and removes the partial file)
+//on failure.
+bool writeGridCache(const char* cachefile, const char* source,
+                    const GridHeader& h,
+                    const float* (*row)(int i, void* arg), void* arg);
+
+//Maps a binary grid cache read-only. Returns false if it cannot be opened
+//or is not a valid cache.
+bool mapGridCache(const char* cachefile, MappedGrid& m);
+void unmapGridCache(MappedGrid& m);
+
+//Releases the memory of a MappedGrid given its base and length, so a
+//Raster can take the mapping over
+void releaseGridCache(void* base, size_t length);
+
+//Opens a binary grid. With create, a new grid of size g.h is made (its
+//values read as 0 until written). Returns false on failure.
+bool openGridFile(const char* filename, GridFile& g, bool create);
+bool closeGridFile(GridFile& g);
+
+//Reads or writes the n values of row i that start at column first.
+//writeGridRow() leaves values as they were. Both return false on failure.
+bool readGridRow(const GridFile& g, int i, int first, int n, float* out);
+bool writeGridRow(const GridFile& g, int i, int first, int n, float* values);
+
+#endif
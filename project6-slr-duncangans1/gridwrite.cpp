@@ -0,0 +1,201 @@
+/* gridwrite.cpp
+
+  Fast grid output, see gridwrite.h. Floats are formatted with
+  std::to_chars, which is locale independent and gives the shortest
+  round-trip text when no precision is asked for.
+
+*/
+
+#include "gridwrite.h"
+
+#include <math.h>
+#include <string.h>
+#include <zlib.h>
+#include <charconv>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+//Where the bytes go: a plain file or a gzip stream
+struct Sink {
+  FILE* f;
+  gzFile z;
+
+  bool open(const char* filename, bool compress) {
+    f = NULL;
+    z = NULL;
+    //Level 1 keeps compression from becoming the bottleneck
+    if (compress) {z = gzopen(filename, "wb1");}
+    else {f = fopen(filename, "wb");}
+    if (z) {gzbuffer(z, 1 << 20);}
+    return f != NULL || z != NULL;
+  }
+
+  bool write(const void* data, size_t n) {
+    if (n == 0) {return true;}
+    if (f) {return fwrite(data, 1, n, f) == n;}
+    //gzwrite takes an unsigned length, so big buffers go in pieces
+    const char* p = (const char*)data;
+    while (n > 0) {
+      unsigned piece = n > (1u << 30) ? (1u << 30) : (unsigned)n;
+      if (gzwrite(z, p, piece) != (int)piece) {return false;}
+      p += piece;
+      n -= piece;
+    }
+    return true;
+  }
+
+  bool close() {
+    if (f) {return fclose(f) == 0;}
+    return gzclose(z) == Z_OK;
+  }
+};
+
+static bool endsWith(const string& s, const char* suffix) {
+  size_t n = strlen(suffix);
+  return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+//The rows one thread formats for one band
+struct Chunk {
+  int first, last;
+  vector<char> bytes;
+  vector<float> values;
+};
+
+struct Job {
+  const GridHeader* h;
+  GridRowFunc row;
+  void* arg;
+  int precision;
+  bool binary;
+};
+
+//The most characters a value of the row takes, with its separator. The
+//shortest form of a float is at most 15 characters. The fixed form is a
+//sign, the digits before the point (one more when rounding carries), the
+//point and the decimals; inf and nan take four.
+static size_t valueWidth(const float* values, int n, int precision) {
+  if (precision < 0) {return 16;}
+  float most = 0;
+  for (int j = 0; j < n; j++) {
+    if (isfinite(values[j])) {most = max(most, fabsf(values[j]));}
+  }
+  size_t digits = 1;
+  for (double m = most; m >= 10; m /= 10) {digits++;}
+  return max((size_t)4, digits + 3 + precision) + 1;
+}
+
+static void formatChunk(const Job* job, Chunk* c) {
+  int ncols = job->h->ncols;
+  size_t rowsInChunk = c->last - c->first;
+  c->bytes.clear();
+  if (job->binary) {
+    c->bytes.resize(rowsInChunk * ncols * sizeof(float));
+    float* out = (float*)c->bytes.data();
+    for (int i = c->first; i < c->last; i++, out += ncols) {
+      job->row(i, out, job->arg);
+    }
+    floatsToLittleEndian((float*)c->bytes.data(), rowsInChunk * ncols);
+    return;
+  }
+
+  //Each row gets room for its longest value only, so the buffer grows to
+  //about the size of the text
+  c->values.resize(ncols);
+  size_t used = 0;
+  for (int i = c->first; i < c->last; i++) {
+    job->row(i, c->values.data(), job->arg);
+    size_t width = valueWidth(c->values.data(), ncols, job->precision);
+    c->bytes.resize(used + (size_t)ncols * width);
+    char* p = c->bytes.data() + used;
+    char* end = c->bytes.data() + c->bytes.size();
+    for (int j = 0; j < ncols; j++) {
+      float v = c->values[j];
+      to_chars_result r = job->precision < 0 ? to_chars(p, end, v)
+        : to_chars(p, end, v, chars_format::fixed, job->precision);
+      p = r.ptr;
+      *p++ = (j == ncols-1) ? '\n' : ' ';
+    }
+    used = p - c->bytes.data();
+  }
+  c->bytes.resize(used);
+}
+
+//Formats rows first..last-1 split over the chunks, one thread each
+static void formatBand(const Job* job, vector<Chunk>& chunks, int first,
+                       int last, vector<thread>& threads) {
+  int n = chunks.size();
+  int share = (last - first + n - 1) / n;
+  for (int t = 0; t < n; t++) {
+    chunks[t].first = min(last, first + t*share);
+    chunks[t].last = min(last, first + (t+1)*share);
+    threads.push_back(thread(formatChunk, job, &chunks[t]));
+  }
+}
+
+bool writeGrid(const char* filename, const GridHeader& h, GridRowFunc row,
+               void* arg, int precision, int nthreads) {
+  string name(filename);
+  bool compress = endsWith(name, ".gz");
+  if (compress) {name.erase(name.size() - 3);}
+  Job job;
+  job.h = &h;
+  job.row = row;
+  job.arg = arg;
+  job.precision = precision;
+  job.binary = endsWith(name, ".slrg");
+
+  Sink sink;
+  if (!sink.open(filename, compress)) {
+    printf("cannot open %s\n", filename);
+    return false;
+  }
+  bool ok;
+  if (job.binary) {
+    unsigned char header[GRIDCACHE_HEADER];
+    encodeGridHeader(h, header);
+    ok = sink.write(header, GRIDCACHE_HEADER);
+  }
+  else {
+    char header[512];
+    int n = snprintf(header, sizeof(header), "ncols %d\nnrows %d\n"
+      "xllcorner %.10g\nyllcorner %.10g\ncellsize %.10g\nNODATA_value %g\n",
+      h.ncols, h.nrows, h.xllcorner, h.yllcorner, h.cellsize, h.ndval);
+    ok = sink.write(header, n);
+  }
+
+  //Bands of about four million values. While one band is being written
+  //the threads are already formatting the next one.
+  if (nthreads < 1) {nthreads = 1;}
+  int bandRows = max(1, (1 << 22) / max(1, h.ncols));
+  vector<Chunk> chunks[2];
+  chunks[0].resize(nthreads);
+  chunks[1].resize(nthreads);
+  vector<thread> threads;
+  formatBand(&job, chunks[0], 0, min(h.nrows, bandRows), threads);
+  //The first write that fails stops the formatting
+  int band = 0;
+  for (int first = 0; ok && first < h.nrows; first += bandRows, band++) {
+    for (size_t t = 0; t < threads.size(); t++) {threads[t].join();}
+    threads.clear();
+    int next = first + bandRows;
+    if (next < h.nrows) {
+      formatBand(&job, chunks[(band+1)%2], next, min(h.nrows, next + bandRows),
+        threads);
+    }
+    vector<Chunk>& done = chunks[band%2];
+    for (int t = 0; ok && t < nthreads; t++) {
+      ok = sink.write(done[t].bytes.data(), done[t].bytes.size());
+    }
+  }
+  for (size_t t = 0; t < threads.size(); t++) {threads[t].join();}
+
+  if (!sink.close()) {ok = false;}
+  if (!ok) {
+    printf("cannot write %s\n", filename);
+    remove(filename);
+  }
+  return ok;
+}
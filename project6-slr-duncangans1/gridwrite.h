@@ -0,0 +1,30 @@
+/* gridwrite.h
+
+  Fast grid output. Rows are produced by a callback and formatted on all
+  threads into large buffers, a band of rows at a time, while the previous
+  band is being written, so the output goes out in row order at close to
+  disk speed. The format follows the file name:
+
+    name.asc      text .asc grid, one line per row
+    name.slrg     binary float32 grid, the same layout as the grid cache
+    name.*.gz     either of the above, compressed with gzip
+
+*/
+
+#ifndef GRIDWRITE_H
+#define GRIDWRITE_H
+
+#include "gridio.h"
+
+//Fills out[0..ncols-1] with the values of row i. Called from several
+//threads at once, for different rows.
+typedef void (*GridRowFunc)(int i, float* out, void* arg);
+
+//Writes a grid with the given header. precision is the number of decimals
+//for text output, or -1 for the shortest text that reads back as the same
+//float. Prints a message, removes the partial file and returns false if
+//the file cannot be written.
+bool writeGrid(const char* filename, const GridHeader& h, GridRowFunc row,
+               void* arg, int precision, int nthreads);
+
+#endif
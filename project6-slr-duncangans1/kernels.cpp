@@ -0,0 +1,333 @@
+/* kernels.cpp
+
+  Raster kernels, see kernels.h. Each pass has a scalar version, used on
+  every processor and for the values left over at the end of the vector
+  loops, and on x86-64 an SSE2 and an AVX2 version. Every x86-64 processor
+  has SSE2; the AVX2 versions are compiled for that instruction set alone,
+  so the rest of the program still runs on any x86-64 processor.
+
+  Comparisons give lanes of all ones or all zeros, which are used as masks
+  in place of branches. The land is counted by subtracting the ocean masks
+  (-1 as integers) in 32 bit lanes, which are added up into a long every
+  FLUSH values so they cannot overflow. The max of two equal lanes is the
+  second operand, so the running maximum goes second and maxz keeps its
+  exact value when nothing is higher, as in the scalar loop.
+
+*/
+
+#include "kernels.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#define KERNELS_X86
+#include <immintrin.h>
+#endif
+
+//Values between adding up the lane counts
+static const size_t FLUSH = 1 << 24;
+
+static long classifyMaskScalar(const float* z, size_t n, float ndval,
+                               uint8_t* ocean, float& maxz) {
+  long land = 0;
+  float m = maxz;
+  for (size_t k = 0; k < n; k++) {
+    float v = z[k];
+    if (v == ndval || v <= 0) {ocean[k] = 1;}
+    else {ocean[k] = 0; land++;}
+    if (v > m) {m = v;}
+  }
+  maxz = m;
+  return land;
+}
+
+static long classifyCheckScalar(const float* z, size_t n, float ndval,
+                                float* check, float& maxz) {
+  long land = 0;
+  float m = maxz;
+  for (size_t k = 0; k < n; k++) {
+    float v = z[k];
+    if (v == ndval || v <= 0) {check[k] = -1;}
+    else {check[k] = 0; land++;}
+    if (v > m) {m = v;}
+  }
+  maxz = m;
+  return land;
+}
+
+static void thresholdFloodScalar(const float* z, const float* check,
+                                 size_t n, float level, float ndval,
+                                 float cutoff, float* out) {
+  for (size_t k = 0; k < n; k++) {
+    float v = z[k];
+    float c = check[k];
+    if (c > cutoff) {c = (v == ndval || v <= 0) ? -1 : 0;}
+    out[k] = (c > level || c == 0) ? v - level : 0;
+  }
+}
+
+#ifdef KERNELS_X86
+
+//Highest of the four lanes of m
+static inline float highest(__m128 m) {
+  m = _mm_max_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+  m = _mm_max_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtss_f32(m);
+}
+
+//Sum of the four lanes of c
+static inline long total(__m128i c) {
+  int32_t lanes[4];
+  _mm_storeu_si128((__m128i*)lanes, c);
+  return (long)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+//Lanes that are ocean: ndval or at most 0
+static inline __m128 oceanSSE(__m128 v, __m128 nd) {
+  return _mm_or_ps(_mm_cmpeq_ps(v, nd), _mm_cmple_ps(v, _mm_setzero_ps()));
+}
+
+static long classifyMaskSSE(const float* z, size_t n, float ndval,
+                            uint8_t* ocean, float& maxz) {
+  __m128 nd = _mm_set1_ps(ndval);
+  __m128 mx = _mm_set1_ps(maxz);
+  __m128i one = _mm_set1_epi8(1);
+  long sea = 0;
+  size_t k = 0;
+  while (k + 16 <= n) {
+    size_t end = k + FLUSH < n ? k + FLUSH : n;
+    __m128i count = _mm_setzero_si128();
+    for (; k + 16 <= end; k += 16) {
+      __m128 v0 = _mm_loadu_ps(z+k), v1 = _mm_loadu_ps(z+k+4);
+      __m128 v2 = _mm_loadu_ps(z+k+8), v3 = _mm_loadu_ps(z+k+12);
+      __m128i m0 = _mm_castps_si128(oceanSSE(v0, nd));
+      __m128i m1 = _mm_castps_si128(oceanSSE(v1, nd));
+      __m128i m2 = _mm_castps_si128(oceanSSE(v2, nd));
+      __m128i m3 = _mm_castps_si128(oceanSSE(v3, nd));
+      count = _mm_sub_epi32(count, _mm_add_epi32(_mm_add_epi32(m0, m1),
+        _mm_add_epi32(m2, m3)));
+      __m128i bytes = _mm_packs_epi16(_mm_packs_epi32(m0, m1),
+        _mm_packs_epi32(m2, m3));
+      _mm_storeu_si128((__m128i*)(ocean+k), _mm_and_si128(bytes, one));
+      mx = _mm_max_ps(_mm_max_ps(_mm_max_ps(v0, v1), _mm_max_ps(v2, v3)), mx);
+    }
+    sea += total(count);
+  }
+  maxz = highest(mx);
+  long land = (long)k - sea;
+  return land + classifyMaskScalar(z+k, n-k, ndval, ocean+k, maxz);
+}
+
+static long classifyCheckSSE(const float* z, size_t n, float ndval,
+                             float* check, float& maxz) {
+  __m128 nd = _mm_set1_ps(ndval);
+  __m128 minus = _mm_set1_ps(-1);
+  __m128 mx = _mm_set1_ps(maxz);
+  long sea = 0;
+  size_t k = 0;
+  while (k + 4 <= n) {
+    size_t end = k + FLUSH < n ? k + FLUSH : n;
+    __m128i count = _mm_setzero_si128();
+    for (; k + 4 <= end; k += 4) {
+      __m128 v = _mm_loadu_ps(z+k);
+      __m128 m = oceanSSE(v, nd);
+      count = _mm_sub_epi32(count, _mm_castps_si128(m));
+      _mm_storeu_ps(check+k, _mm_and_ps(m, minus));
+      mx = _mm_max_ps(v, mx);
+    }
+    sea += total(count);
+  }
+  maxz = highest(mx);
+  long land = (long)k - sea;
+  return land + classifyCheckScalar(z+k, n-k, ndval, check+k, maxz);
+}
+
+static void thresholdFloodSSE(const float* z, const float* check, size_t n,
+                              float level, float ndval, float cutoff,
+                              float* out) {
+  __m128 nd = _mm_set1_ps(ndval);
+  __m128 lv = _mm_set1_ps(level);
+  __m128 cut = _mm_set1_ps(cutoff);
+  __m128 minus = _mm_set1_ps(-1);
+  __m128 zero = _mm_setzero_ps();
+  size_t k = 0;
+  for (; k + 4 <= n; k += 4) {
+    __m128 v = _mm_loadu_ps(z+k);
+    __m128 c = _mm_loadu_ps(check+k);
+    __m128 high = _mm_cmpgt_ps(c, cut);
+    __m128 sea = _mm_and_ps(oceanSSE(v, nd), high);
+    c = _mm_or_ps(_mm_andnot_ps(high, c), _mm_and_ps(sea, minus));
+    __m128 dry = _mm_or_ps(_mm_cmpgt_ps(c, lv), _mm_cmpeq_ps(c, zero));
+    _mm_storeu_ps(out+k, _mm_and_ps(dry, _mm_sub_ps(v, lv)));
+  }
+  thresholdFloodScalar(z+k, check+k, n-k, level, ndval, cutoff, out+k);
+}
+
+__attribute__((target("avx2")))
+static inline __m256 oceanAVX(__m256 v, __m256 nd) {
+  return _mm256_or_ps(_mm256_cmp_ps(v, nd, _CMP_EQ_OQ),
+    _mm256_cmp_ps(v, _mm256_setzero_ps(), _CMP_LE_OQ));
+}
+
+__attribute__((target("avx2")))
+static inline float highestAVX(__m256 m) {
+  return highest(_mm_max_ps(_mm256_castps256_ps128(m),
+    _mm256_extractf128_ps(m, 1)));
+}
+
+__attribute__((target("avx2")))
+static inline long totalAVX(__m256i c) {
+  return total(_mm_add_epi32(_mm256_castsi256_si128(c),
+    _mm256_extracti128_si256(c, 1)));
+}
+
+__attribute__((target("avx2")))
+static long classifyMaskAVX(const float* z, size_t n, float ndval,
+                            uint8_t* ocean, float& maxz) {
+  __m256 nd = _mm256_set1_ps(ndval);
+  __m256 mx = _mm256_set1_ps(maxz);
+  __m256i one = _mm256_set1_epi8(1);
+  //The packs work within each 128 bit half, which leaves the groups of
+  //four bytes in the order 0 2 4 6 1 3 5 7
+  __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  long sea = 0;
+  size_t k = 0;
+  while (k + 32 <= n) {
+    size_t end = k + FLUSH < n ? k + FLUSH : n;
+    __m256i count = _mm256_setzero_si256();
+    for (; k + 32 <= end; k += 32) {
+      __m256 v0 = _mm256_loadu_ps(z+k), v1 = _mm256_loadu_ps(z+k+8);
+      __m256 v2 = _mm256_loadu_ps(z+k+16), v3 = _mm256_loadu_ps(z+k+24);
+      __m256i m0 = _mm256_castps_si256(oceanAVX(v0, nd));
+      __m256i m1 = _mm256_castps_si256(oceanAVX(v1, nd));
+      __m256i m2 = _mm256_castps_si256(oceanAVX(v2, nd));
+      __m256i m3 = _mm256_castps_si256(oceanAVX(v3, nd));
+      count = _mm256_sub_epi32(count, _mm256_add_epi32(
+        _mm256_add_epi32(m0, m1), _mm256_add_epi32(m2, m3)));
+      __m256i bytes = _mm256_packs_epi16(_mm256_packs_epi32(m0, m1),
+        _mm256_packs_epi32(m2, m3));
+      bytes = _mm256_permutevar8x32_epi32(bytes, order);
+      _mm256_storeu_si256((__m256i*)(ocean+k), _mm256_and_si256(bytes, one));
+      mx = _mm256_max_ps(_mm256_max_ps(_mm256_max_ps(v0, v1),
+        _mm256_max_ps(v2, v3)), mx);
+    }
+    sea += totalAVX(count);
+  }
+  maxz = highestAVX(mx);
+  long land = (long)k - sea;
+  return land + classifyMaskScalar(z+k, n-k, ndval, ocean+k, maxz);
+}
+
+__attribute__((target("avx2")))
+static long classifyCheckAVX(const float* z, size_t n, float ndval,
+                             float* check, float& maxz) {
+  __m256 nd = _mm256_set1_ps(ndval);
+  __m256 minus = _mm256_set1_ps(-1);
+  __m256 mx = _mm256_set1_ps(maxz);
+  long sea = 0;
+  size_t k = 0;
+  while (k + 8 <= n) {
+    size_t end = k + FLUSH < n ? k + FLUSH : n;
+    __m256i count = _mm256_setzero_si256();
+    for (; k + 8 <= end; k += 8) {
+      __m256 v = _mm256_loadu_ps(z+k);
+      __m256 m = oceanAVX(v, nd);
+      count = _mm256_sub_epi32(count, _mm256_castps_si256(m));
+      _mm256_storeu_ps(check+k, _mm256_and_ps(m, minus));
+      mx = _mm256_max_ps(v, mx);
+    }
+    sea += totalAVX(count);
+  }
+  maxz = highestAVX(mx);
+  long land = (long)k - sea;
+  return land + classifyCheckScalar(z+k, n-k, ndval, check+k, maxz);
+}
+
+__attribute__((target("avx2")))
+static void thresholdFloodAVX(const float* z, const float* check, size_t n,
+                              float level, float ndval, float cutoff,
+                              float* out) {
+  __m256 nd = _mm256_set1_ps(ndval);
+  __m256 lv = _mm256_set1_ps(level);
+  __m256 cut = _mm256_set1_ps(cutoff);
+  __m256 minus = _mm256_set1_ps(-1);
+  __m256 zero = _mm256_setzero_ps();
+  size_t k = 0;
+  for (; k + 8 <= n; k += 8) {
+    __m256 v = _mm256_loadu_ps(z+k);
+    __m256 c = _mm256_loadu_ps(check+k);
+    __m256 high = _mm256_cmp_ps(c, cut, _CMP_GT_OQ);
+    __m256 sea = _mm256_and_ps(oceanAVX(v, nd), high);
+    c = _mm256_or_ps(_mm256_andnot_ps(high, c), _mm256_and_ps(sea, minus));
+    __m256 dry = _mm256_or_ps(_mm256_cmp_ps(c, lv, _CMP_GT_OQ),
+      _mm256_cmp_ps(c, zero, _CMP_EQ_OQ));
+    _mm256_storeu_ps(out+k, _mm256_and_ps(dry, _mm256_sub_ps(v, lv)));
+  }
+  thresholdFloodScalar(z+k, check+k, n-k, level, ndval, cutoff, out+k);
+}
+
+#endif
+
+struct Kernels {
+  const char* name;
+  long (*classifyMask)(const float*, size_t, float, uint8_t*, float&);
+  long (*classifyCheck)(const float*, size_t, float, float*, float&);
+  void (*thresholdFlood)(const float*, const float*, size_t, float, float,
+                         float, float*);
+  bool (*supported)();
+};
+
+static bool always() {return true;}
+
+#ifdef KERNELS_X86
+static bool hasAVX2() {return __builtin_cpu_supports("avx2");}
+#endif
+
+//Best first
+static const Kernels versions[] = {
+#ifdef KERNELS_X86
+  {"avx2", classifyMaskAVX, classifyCheckAVX, thresholdFloodAVX, hasAVX2},
+  {"sse2", classifyMaskSSE, classifyCheckSSE, thresholdFloodSSE, always},
+#endif
+  {"scalar", classifyMaskScalar, classifyCheckScalar, thresholdFloodScalar,
+   always}
+};
+static const int VERSIONS = sizeof(versions) / sizeof(versions[0]);
+
+static const Kernels* best() {
+  for (int v = 0; v < VERSIONS; v++) {
+    if (versions[v].supported()) {return &versions[v];}
+  }
+  return &versions[VERSIONS-1];
+}
+
+static const Kernels* current = best();
+
+long classifyMask(const float* z, size_t n, float ndval, uint8_t* ocean,
+                  float& maxz) {
+  return current->classifyMask(z, n, ndval, ocean, maxz);
+}
+
+long classifyCheck(const float* z, size_t n, float ndval, float* check,
+                   float& maxz) {
+  return current->classifyCheck(z, n, ndval, check, maxz);
+}
+
+void thresholdFlood(const float* z, const float* check, size_t n,
+                    float level, float ndval, float cutoff, float* out) {
+  current->thresholdFlood(z, check, n, level, ndval, cutoff, out);
+}
+
+const char* kernelName() {
+  return current->name;
+}
+
+bool useKernels(const char* name) {
+  for (int v = 0; v < VERSIONS; v++) {
+    if (strcmp(versions[v].name, name) == 0 && versions[v].supported()) {
+      current = &versions[v];
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,42 @@
+/* kernels.h
+
+  Passes over whole rasters, written with SSE2 and AVX2 as well as plain
+  C++. The best version the processor supports is picked when the program
+  starts; all versions give exactly the same results. They work on flat
+  arrays without branches, so they go as fast as memory allows.
+
+*/
+
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//Sets ocean[k] to 1 where z[k] is ndval or at most 0, and to 0 elsewhere.
+//Raises maxz to the highest value and returns the number of other points,
+//the land.
+long classifyMask(const float* z, size_t n, float ndval, uint8_t* ocean,
+                  float& maxz);
+
+//The same, but sets check[k] to -1 for possible ocean and 0 for land, the
+//way checkGrid starts out
+long classifyCheck(const float* z, size_t n, float ndval, float* check,
+                   float& maxz);
+
+//Points of a result grid at sea level level: the height above the water,
+//z - level, where the flooding height check is 0 (never) or above level,
+//and 0 where it is flooded. Nothing floods above cutoff, the last level
+//of the run: points with a flooding height above it that are ndval or at
+//most 0 count as ocean (-1), and the rest as never flooding.
+void thresholdFlood(const float* z, const float* check, size_t n,
+                    float level, float ndval, float cutoff, float* out);
+
+//Name of the version in use: "avx2", "sse2" or "scalar"
+const char* kernelName();
+
+//Uses the named version instead. Returns false, leaving the version as it
+//was, if the name is unknown or the processor does not support it.
+bool useKernels(const char* name);
+
+#endif
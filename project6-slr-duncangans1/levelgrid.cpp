@@ -0,0 +1,384 @@
+/* levelgrid.cpp
+
+  Packing, storing and reading flooding heights as level codes, see
+  levelgrid.h. A tile is packed as its codes row after row: the low bytes
+  of all of them, then the high bytes if codes take two. Each run of bytes
+  is a list of tokens. A token below 0x80 is followed by that many plus
+  one bytes copied as they are; a token t from 0x80 stands for a run of
+  one byte repeated (t & 0x7f) + 3 times, or for t = 0xff, 130 more than
+  the length that follows in 7 bit groups, low first. The run of a tile
+  all the same is four bytes.
+
+  The file layout is
+
+    bytes  0-7   "SLRL" and the format version (uint32)
+    bytes  8-15  ncols, nrows (int32)
+    bytes 16-39  xllcorner, yllcorner, cellsize (float64)
+    bytes 40-43  NODATA value (float32)
+    bytes 44-47  bytes per code (int32)
+    bytes 48-51  number of levels (int32)
+    bytes 52-55  points on a side of a tile (int32)
+    bytes 56-63  land points (int64)
+    bytes 64-71  bytes of packed tiles (uint64)
+    bytes 72-79  reserved, zero
+    then the sea level of every code (float32), the land flooded at each
+    level (int64), where each tile starts and where the last one ends
+    (uint64), and the packed tiles, row after row of tiles
+
+  Everything is little-endian, as in the .slrg cache, and the tiles are
+  the same on any machine.
+
+*/
+
+#include "levelgrid.h"
+#include "trace.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+
+using namespace std;
+
+static const char MAGIC[4] = {'S', 'L', 'R', 'L'};
+static const uint32_t VERSION = 1;
+static const int HEADER = 80;
+//The most levels a code of two bytes has room for
+static const size_t MAXLEVELS = 65533;
+
+//Appends the tokens for n bytes from in, each step bytes apart
+static void packBytes(const unsigned char* in, int n, int step,
+                      vector<unsigned char>& out) {
+  //literal is the token of the stretch being copied, -1 for none
+  int k = 0;
+  long literal = -1;
+  while (k < n) {
+    int run = 1;
+    while (k + run < n && in[(k+run)*step] == in[k*step]) {run++;}
+    if (run < 3) {
+      //Short runs go into a stretch of bytes copied as they are
+      for (int m = 0; m < run; m++) {
+        if (literal < 0 || out[literal] == 0x7f) {
+          literal = out.size();
+          out.push_back(0);
+        }
+        else {out[literal]++;}
+        out.push_back(in[(k+m)*step]);
+      }
+      k += run;
+      continue;
+    }
+    literal = -1;
+    if (run < 130) {out.push_back(0x80 | (run - 3));}
+    else {
+      out.push_back(0xff);
+      for (unsigned extra = run - 130; ; extra >>= 7) {
+        out.push_back((extra & 0x7f) | (extra >= 0x80 ? 0x80 : 0));
+        if (extra < 0x80) {break;}
+      }
+    }
+    out.push_back(in[k*step]);
+    k += run;
+  }
+}
+
+//Undoes packBytes() for n bytes, writing them step bytes apart. Returns
+//the end of the tokens read, or NULL if they run past end or past n.
+static const unsigned char* unpackBytes(const unsigned char* in,
+                                        const unsigned char* end, int n,
+                                        int step, unsigned char* out) {
+  int k = 0;
+  while (k < n) {
+    if (in >= end) {return NULL;}
+    unsigned t = *in++;
+    if (t < 0x80) {
+      int count = t + 1;
+      if (k + count > n || end - in < count) {return NULL;}
+      for (int m = 0; m < count; m++) {out[(k+m)*step] = in[m];}
+      in += count;
+      k += count;
+      continue;
+    }
+    long run = (t & 0x7f) + 3;
+    if (t == 0xff) {
+      long extra = 0;
+      for (int shift = 0; ; shift += 7) {
+        if (in >= end || shift > 28) {return NULL;}
+        unsigned b = *in++;
+        extra |= (long)(b & 0x7f) << shift;
+        if (b < 0x80) {break;}
+      }
+      run = 130 + extra;
+    }
+    if (in >= end || k + run > n) {return NULL;}
+    unsigned char value = *in++;
+    for (long m = 0; m < run; m++) {out[(k+m)*step] = value;}
+    k += run;
+  }
+  return in;
+}
+
+int levelCode(const LevelGrid& g, float h, bool reached) {
+  //The first level at or above the flooding height, past the last one
+  //for points that only flood above it
+  if (h == 0 || (h == -1 && !reached)) {return 0;}
+  if (h == -1) {return 1;}
+  vector<float>::const_iterator first = g.values.begin() + 2;
+  vector<float>::const_iterator last = g.values.end() - 1;
+  return 2 + (lower_bound(first, last, h) - first);
+}
+
+//Codes are packed low byte first on any machine
+static bool littleEndian() {
+  uint16_t one = 1;
+  return *(const unsigned char*)&one == 1;
+}
+
+//What packBand() needs
+struct PackBand {
+  const FloodRun* r;
+  const LevelGrid* g;
+  int first, last;
+  //The packed tiles of rows of tiles first..last-1, and where each ends
+  vector<unsigned char> bytes;
+  vector<uint64_t> ends;
+};
+
+static void packBand(PackBand* b) {
+  //Packs the tiles of a band of tile rows, a tile at a time
+  const FloodRun& r = *b->r;
+  const LevelGrid& g = *b->g;
+  vector<uint16_t> codes(TILE*TILE);
+  for (int tr = b->first; tr < b->last; tr++) {
+    for (int tc = 0; tc < g.tileCols; tc++) {
+      int rows = min(TILE, r.rows - tr*TILE);
+      int cols = min(TILE, r.cols - tc*TILE);
+      int n = 0;
+      for (int i = tr*TILE; i < tr*TILE + rows; i++) {
+        for (int j = tc*TILE; j < tc*TILE + cols; j++) {
+          codes[n++] = levelCode(g, r.checkGrid(i, j),
+            r.completionGrid(i, j));
+        }
+      }
+      const unsigned char* bytes = (const unsigned char*)codes.data();
+      bool little = littleEndian();
+      packBytes(bytes + (little ? 0 : 1), n, 2, b->bytes);
+      if (g.width == 2) {
+        packBytes(bytes + (little ? 1 : 0), n, 2, b->bytes);
+      }
+      b->ends.push_back(b->bytes.size());
+    }
+  }
+}
+
+void buildLevelGrid(const FloodRun& r, LevelGrid& g) {
+  TRACE_SCOPE("build level grid");
+  size_t levels = min(r.levels.size(), MAXLEVELS);
+  g.h = r.header;
+  g.values.assign(1, INFINITY);
+  g.values.push_back(-1);
+  g.values.insert(g.values.end(), r.levels.begin(),
+    r.levels.begin() + levels);
+  g.values.push_back(INFINITY);
+  g.flooded.resize(levels);
+  for (size_t k = 0; k < levels; k++) {
+    g.flooded[k] = floodedCells(r, r.levels[k]);
+  }
+  g.land = (int64_t)r.initLand;
+  g.width = g.values.size() <= 256 ? 1 : 2;
+  g.tileCols = (r.cols + TILE - 1) / TILE;
+  g.tileRows = (r.rows + TILE - 1) / TILE;
+
+  //A band of tile rows per thread, put together in order after
+  int nthreads = max(1, min(r.s.nthreads, g.tileRows));
+  vector<PackBand> bands(nthreads);
+  vector<thread> threads;
+  for (int t = 0; t < nthreads; t++) {
+    bands[t].r = &r;
+    bands[t].g = &g;
+    bands[t].first = g.tileRows * t / nthreads;
+    bands[t].last = g.tileRows * (t+1) / nthreads;
+    threads.push_back(thread(packBand, &bands[t]));
+  }
+  for (int t = 0; t < nthreads; t++) {threads[t].join();}
+  g.offsets.assign(1, 0);
+  g.data.clear();
+  for (int t = 0; t < nthreads; t++) {
+    uint64_t start = g.data.size();
+    for (size_t k = 0; k < bands[t].ends.size(); k++) {
+      g.offsets.push_back(start + bands[t].ends[k]);
+    }
+    g.data.insert(g.data.end(), bands[t].bytes.begin(),
+      bands[t].bytes.end());
+    vector<unsigned char>().swap(bands[t].bytes);
+  }
+}
+
+size_t levelGridBytes(const LevelGrid& g) {
+  return sizeof(LevelGrid) + g.values.size()*sizeof(float) +
+    g.flooded.size()*sizeof(int64_t) + g.offsets.size()*sizeof(uint64_t) +
+    g.data.size();
+}
+
+//Appends n values of size bytes each in little-endian byte order
+static void appendLE(vector<unsigned char>& out, const void* values,
+                     size_t n, int size) {
+  size_t at = out.size();
+  out.resize(at + n*size);
+  for (size_t k = 0; k < n; k++) {
+    copyLE(&out[at + k*size], (const unsigned char*)values + k*size, size);
+  }
+}
+
+//Reads n little-endian values of size bytes each
+static bool readLE(FILE* f, void* values, size_t n, int size) {
+  vector<unsigned char> bytes(n*size);
+  if (fread(bytes.data(), 1, bytes.size(), f) != bytes.size()) {
+    return false;
+  }
+  for (size_t k = 0; k < n; k++) {
+    copyLE((unsigned char*)values + k*size, &bytes[k*size], size);
+  }
+  return true;
+}
+
+bool writeLevelGrid(const char* filename, const LevelGrid& g) {
+  FILE* f = fopen(filename, "wb");
+  if (f == NULL) {
+    printf("cannot write level grid %s\n", filename);
+    return false;
+  }
+  unsigned char header[HEADER];
+  memset(header, 0, HEADER);
+  int32_t ncols = g.h.ncols, nrows = g.h.nrows, width = g.width;
+  int32_t levels = g.flooded.size(), tile = TILE;
+  uint64_t size = g.data.size();
+  memcpy(header, MAGIC, 4);
+  copyLE(header+4, &VERSION, 4);
+  copyLE(header+8, &ncols, 4);
+  copyLE(header+12, &nrows, 4);
+  copyLE(header+16, &g.h.xllcorner, 8);
+  copyLE(header+24, &g.h.yllcorner, 8);
+  copyLE(header+32, &g.h.cellsize, 8);
+  copyLE(header+40, &g.h.ndval, 4);
+  copyLE(header+44, &width, 4);
+  copyLE(header+48, &levels, 4);
+  copyLE(header+52, &tile, 4);
+  copyLE(header+56, &g.land, 8);
+  copyLE(header+64, &size, 8);
+  vector<unsigned char> tables;
+  appendLE(tables, g.values.data(), g.values.size(), sizeof(float));
+  appendLE(tables, g.flooded.data(), levels, sizeof(int64_t));
+  appendLE(tables, g.offsets.data(), g.offsets.size(), sizeof(uint64_t));
+  bool ok = fwrite(header, 1, HEADER, f) == (size_t)HEADER &&
+    fwrite(tables.data(), 1, tables.size(), f) == tables.size() &&
+    fwrite(g.data.data(), 1, size, f) == size;
+  if (fclose(f) != 0) {ok = false;}
+  if (!ok) {
+    printf("cannot write level grid %s\n", filename);
+    remove(filename);
+  }
+  return ok;
+}
+
+bool readLevelGrid(const char* filename, LevelGrid& g) {
+  FILE* f = fopen(filename, "rb");
+  unsigned char header[HEADER];
+  if (f == NULL || fread(header, 1, HEADER, f) != (size_t)HEADER) {
+    if (f) {fclose(f);}
+    printf("cannot read level grid %s\n", filename);
+    return false;
+  }
+  uint32_t version;
+  int32_t ncols, nrows, width, levels, tile;
+  uint64_t size;
+  copyLE(&version, header+4, 4);
+  copyLE(&ncols, header+8, 4);
+  copyLE(&nrows, header+12, 4);
+  copyLE(&g.h.xllcorner, header+16, 8);
+  copyLE(&g.h.yllcorner, header+24, 8);
+  copyLE(&g.h.cellsize, header+32, 8);
+  copyLE(&g.h.ndval, header+40, 4);
+  copyLE(&width, header+44, 4);
+  copyLE(&levels, header+48, 4);
+  copyLE(&tile, header+52, 4);
+  copyLE(&g.land, header+56, 8);
+  copyLE(&size, header+64, 8);
+  bool ok = memcmp(header, MAGIC, 4) == 0 && version == VERSION &&
+    ncols > 0 && nrows > 0 && (width == 1 || width == 2) && levels >= 0 &&
+    (size_t)levels <= MAXLEVELS && (levels + 3 <= 256 || width == 2) &&
+    tile == TILE;
+  if (ok) {
+    g.h.ncols = ncols;
+    g.h.nrows = nrows;
+    g.width = width;
+    g.tileCols = (ncols + TILE - 1) / TILE;
+    g.tileRows = (nrows + TILE - 1) / TILE;
+    g.values.resize(levels + 3);
+    g.flooded.resize(levels);
+    g.offsets.resize((size_t)g.tileCols * g.tileRows + 1);
+    ok = readLE(f, g.values.data(), g.values.size(), sizeof(float)) &&
+      readLE(f, g.flooded.data(), levels, sizeof(int64_t)) &&
+      readLE(f, g.offsets.data(), g.offsets.size(), sizeof(uint64_t)) &&
+      g.offsets[0] == 0 && g.offsets.back() == size;
+    for (size_t t = 1; ok && t < g.offsets.size(); t++) {
+      ok = g.offsets[t-1] <= g.offsets[t];
+    }
+  }
+  if (ok) {
+    g.data.resize(size);
+    ok = fread(g.data.data(), 1, size, f) == size;
+  }
+  fclose(f);
+  if (!ok) {
+    printf("%s is not a level grid\n", filename);
+    return false;
+  }
+  return true;
+}
+
+LevelCache::LevelCache(const LevelGrid* g, int slots) : grid(g),
+  tiles(slots, -1), used(slots, 0), codes((size_t)slots*TILE*TILE, 0),
+  scratch(TILE*TILE), clock(0), lastTile(-1), lastCodes(NULL) {}
+
+const uint16_t* LevelCache::unpacked(int t) {
+  //The tile if a slot holds it, or else unpacked into the slot used
+  //longest ago
+  int slot = 0;
+  for (size_t s = 0; s < tiles.size(); s++) {
+    if (tiles[s] == t) {
+      slot = s;
+      break;
+    }
+    if (used[s] < used[slot]) {slot = s;}
+  }
+  uint16_t* out = &codes[(size_t)slot*TILE*TILE];
+  if (tiles[slot] != t) {
+    const LevelGrid& g = *grid;
+    int rows = min(TILE, g.h.nrows - t / g.tileCols * TILE);
+    int cols = min(TILE, g.h.ncols - t % g.tileCols * TILE);
+    const unsigned char* in = g.data.data() + g.offsets[t];
+    const unsigned char* end = g.data.data() + g.offsets[t+1];
+    //The tile is unpacked row after row and spread out TILE codes a row.
+    //Codes of one byte have no high bytes to unpack.
+    fill(scratch.begin(), scratch.begin() + rows*cols, 0);
+    unsigned char* bytes = (unsigned char*)scratch.data();
+    bool little = littleEndian();
+    in = unpackBytes(in, end, rows*cols, 2, bytes + (little ? 0 : 1));
+    if (in && g.width == 2) {
+      in = unpackBytes(in, end, rows*cols, 2, bytes + (little ? 1 : 0));
+    }
+    //A damaged tile reads as never flooding
+    if (in == NULL) {fill(scratch.begin(), scratch.end(), 0);}
+    for (int i = 0; i < rows; i++) {
+      copy(scratch.begin() + i*cols, scratch.begin() + (i+1)*cols,
+        out + i*TILE);
+    }
+    tiles[slot] = t;
+  }
+  used[slot] = ++clock;
+  lastTile = t;
+  lastCodes = out;
+  return out;
+}
@@ -0,0 +1,102 @@
+/* levelgrid.h
+
+  The flooding heights of a grid kept small. After the flooding a point
+  is ocean, never floods, or floods at a sea level that with the
+  incremental engine is one of the levels of the run and with priority
+  flooding lies between two of them. A LevelGrid keeps for every point a
+  code: 0 for points that never flood, 1 for ocean, 2+k for points that
+  flood by levels[k], and one more for points that only flood above the
+  last level. The codes take a byte a point, or two for runs of more than
+  253 levels (the levels past 65533 then count as above the last one).
+
+  The codes are kept in tiles of TILE by TILE points, each packed on its
+  own with a run length code: a grid of sea, dry land and wide flats
+  takes a few bits a point instead of the four bytes of checkGrid, and a
+  point is read by unpacking its tile. A LevelCache keeps the last few
+  tiles it unpacked, so reading a window or a row of points unpacks every
+  tile once.
+
+  A LevelGrid is written to a .slrl file as it is kept in memory and read
+  back without flooding again.
+
+*/
+
+#ifndef LEVELGRID_H
+#define LEVELGRID_H
+
+#include <stdint.h>
+#include <vector>
+#include "engine.h"
+#include "gridio.h"
+
+//Points on a side of a tile
+const int TILE = 64;
+
+struct LevelGrid {
+  GridHeader h;
+  //The sea level of every code: INFINITY for points that never flood and
+  //points that flood above the last level, -1 for ocean and levels[k] for
+  //code 2+k
+  std::vector<float> values;
+  //The land points flooded at each level
+  std::vector<int64_t> flooded;
+  int64_t land;
+  //Bytes per code, 1 or 2, and tiles across and down
+  int width, tileCols, tileRows;
+  //Where each packed tile starts in data, and where the last one ends
+  std::vector<uint64_t> offsets;
+  std::vector<unsigned char> data;
+};
+
+//Packs the flooding heights of a flooded run
+void buildLevelGrid(const FloodRun& r, LevelGrid& g);
+
+//The code of a flooding height, as kept in checkGrid: h is 0 for points
+//that never flood and -1 for ocean, which only counts when reached is set
+int levelCode(const LevelGrid& g, float h, bool reached);
+
+//Bytes the grid takes in memory
+size_t levelGridBytes(const LevelGrid& g);
+
+//Write and read .slrl files. Both print a message and return false on
+//failure.
+bool writeLevelGrid(const char* filename, const LevelGrid& g);
+bool readLevelGrid(const char* filename, LevelGrid& g);
+
+//Reads a LevelGrid through the tiles it unpacked last, the least recently
+//used going first. A cache is for one thread; any number of caches can
+//read the same grid.
+class LevelCache {
+public:
+  explicit LevelCache(const LevelGrid* g = NULL, int slots = 16);
+  LevelCache(LevelCache&&) = default;
+  LevelCache(const LevelCache&) = delete;
+  LevelCache& operator=(const LevelCache&) = delete;
+
+  //The code of point (row, col)
+  int code(int row, int col) {
+    int t = (row / TILE) * grid->tileCols + col / TILE;
+    const uint16_t* codes = t == lastTile ? lastCodes : unpacked(t);
+    return codes[(row % TILE) * TILE + col % TILE];
+  }
+
+  //The sea level at which point (row, col) floods
+  float level(int row, int col) {return grid->values[code(row, col)];}
+
+private:
+  const uint16_t* unpacked(int t);
+
+  const LevelGrid* grid;
+  //The tile each slot holds (-1 for none), when it was last used, and the
+  //codes, TILE*TILE a slot, a row of the tile after the other
+  std::vector<int> tiles;
+  std::vector<long> used;
+  std::vector<uint16_t> codes;
+  //A tile as it is unpacked, before it is spread over its slot
+  std::vector<uint16_t> scratch;
+  long clock;
+  int lastTile;
+  const uint16_t* lastCodes;
+};
+
+#endif
@@ -0,0 +1,471 @@
+/* mesh.cpp
+
+  Retained-mode terrain rendering, see mesh.h. The shader follows
+  createTriangles(), getColor() and the *toscreen() functions in slr.cpp;
+  a change to one should go in the other.
+
+  A chunk on level k is named by the level and its first sample row and
+  column on that level. Its vertices are its SIDE by SIDE samples, which
+  overlap the next chunk by one so there are no gaps, then the four rows
+  of skirt vertices. Samples past the edge of the grid repeat the last
+  row or column, which only gives empty triangles, so every chunk has the
+  same layout and they all share one index buffer.
+
+*/
+
+#define GL_GLEXT_PROTOTYPES
+#include "mesh.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef __APPLE__
+#include <OpenGL/gl.h>
+#else
+#include <GL/gl.h>
+#include <GL/glext.h>
+#endif
+#include <math.h>
+#include <algorithm>
+
+using namespace std;
+
+//Most chunks kept on the graphics card, about 80MB
+static const int MAXBUFFERS = 1024;
+//Chunks are split while their samples would be wider than this many pixels
+static const float LODPIXELS = 2;
+//Vertices along the side of a chunk
+static const int SIDE = CHUNK + 1;
+//Height given to the bottom of the skirts, which ztoscreen() puts at 0
+static const float SKIRT = -1000;
+
+const RampStep RAMP[RAMPSIZE] = {
+  {-1/30.0f, .9, .0, .0},
+  {0,        .0, .2, .0},
+  {1/70.0f,  .1, .3, .2},
+  {1/45.0f,  .1, .4, .3},
+  {1/25.0f,  .1, .4, .3},
+  {.1,       .2, .5, .4},
+  {.2,       .4, .6, .3},
+  {.3,       .6, .8, .3},
+  {.4,       .8, .9, .2},
+  {.5,       1,  1,  .2},
+  {.6,       .9, .6, .2},
+  {.7,       .7, .4, .2},
+  {.8,       .6, .3, .1},
+  {.9,       .4, .1, .1},
+};
+const float RAMPTOP[3] = {.3, .2, .1};
+
+//terrain is (row, column, height, flooding level)
+static const char* VERTEXSHADER =
+  "uniform float feet, maxz, seavis;\n"
+  "uniform vec2 size;\n"
+  "uniform float limit[14];\n"
+  "uniform vec3 colour[14];\n"
+  "uniform vec3 top;\n"
+  "attribute vec4 terrain;\n"
+  "vec3 land(float margin) {\n"
+  "  for (int k = 0; k < 14; k++) {\n"
+  "    if (margin < limit[k]*maxz) {return colour[k];}\n"
+  "  }\n"
+  "  return top;\n"
+  "}\n"
+  "void main() {\n"
+  "  float height = terrain.z;\n"
+  "  float check = terrain.w;\n"
+  "  float z = (check == 0.0 || check > feet) ? height : feet;\n"
+  "  z = (z < -99.0) ? 0.0 : (z/maxz)/5.0;\n"
+  "  vec2 xy = -1.0 + 2.0*terrain.xy/size;\n"
+  "  gl_Position = gl_ModelViewProjectionMatrix * vec4(xy, z, 1.0);\n"
+  "  vec3 c;\n"
+  "  if (check == 0.0 || check >= feet) {c = land(height - feet);}\n"
+  "  else if (check == -1.0) {c = vec3(.1, .1, .9);}\n"
+  "  else {c = vec3(.1, (height+seavis - feet)/seavis - .1, .8);}\n"
+  "  gl_FrontColor = vec4(c, 1.0);\n"
+  "}\n";
+
+static const char* FRAGMENTSHADER =
+  "void main() {\n"
+  "  gl_FragColor = gl_Color;\n"
+  "}\n";
+
+static GLuint compileShader(GLenum type, const char* source) {
+  GLuint s = glCreateShader(type);
+  glShaderSource(s, 1, &source, NULL);
+  glCompileShader(s);
+  GLint ok;
+  glGetShaderiv(s, GL_COMPILE_STATUS, &ok);
+  if (!ok) {
+    char log[1024];
+    glGetShaderInfoLog(s, sizeof(log), NULL, log);
+    printf("cannot compile shader: %s\n", log);
+    glDeleteShader(s);
+    return 0;
+  }
+  return s;
+}
+
+static bool buildProgram(TerrainMesh& m) {
+  GLuint vs = compileShader(GL_VERTEX_SHADER, VERTEXSHADER);
+  GLuint fs = compileShader(GL_FRAGMENT_SHADER, FRAGMENTSHADER);
+  if (!vs || !fs) {
+    if (vs) {glDeleteShader(vs);}
+    if (fs) {glDeleteShader(fs);}
+    return false;
+  }
+  m.program = glCreateProgram();
+  glAttachShader(m.program, vs);
+  glAttachShader(m.program, fs);
+  //Attribute 0 takes the place of glVertex(), which some drivers need
+  glBindAttribLocation(m.program, 0, "terrain");
+  glLinkProgram(m.program);
+  glDeleteShader(vs);
+  glDeleteShader(fs);
+  GLint ok;
+  glGetProgramiv(m.program, GL_LINK_STATUS, &ok);
+  if (!ok) {
+    char log[1024];
+    glGetProgramInfoLog(m.program, sizeof(log), NULL, log);
+    printf("cannot link shader: %s\n", log);
+    glDeleteProgram(m.program);
+    m.program = 0;
+    return false;
+  }
+  m.feetAt = glGetUniformLocation(m.program, "feet");
+  m.maxzAt = glGetUniformLocation(m.program, "maxz");
+  m.seavisAt = glGetUniformLocation(m.program, "seavis");
+  m.sizeAt = glGetUniformLocation(m.program, "size");
+  m.limitAt = glGetUniformLocation(m.program, "limit");
+  m.colourAt = glGetUniformLocation(m.program, "colour");
+  m.topAt = glGetUniformLocation(m.program, "top");
+
+  //The ramp never changes, so it is set once
+  float limit[RAMPSIZE], colour[RAMPSIZE*3];
+  for (int k = 0; k < RAMPSIZE; k++) {
+    limit[k] = RAMP[k].limit;
+    colour[3*k] = RAMP[k].r;
+    colour[3*k+1] = RAMP[k].g;
+    colour[3*k+2] = RAMP[k].b;
+  }
+  glUseProgram(m.program);
+  glUniform1fv(m.limitAt, RAMPSIZE, limit);
+  glUniform3fv(m.colourAt, RAMPSIZE, colour);
+  glUniform3fv(m.topAt, 1, RAMPTOP);
+  glUseProgram(0);
+  return true;
+}
+
+static int levelRows(const TerrainMesh& m, int k) {
+  return k == 0 ? m.grid->rows() : m.pyramid[k-1].rows();
+}
+
+static int levelCols(const TerrainMesh& m, int k) {
+  return k == 0 ? m.grid->cols() : m.pyramid[k-1].cols();
+}
+
+//Sample (r, c) of level k. On the grid itself, heights of NODATA count as
+//0 like in ztoscreen().
+static PyramidCell cellAt(const TerrainMesh& m, int k, int r, int c) {
+  if (k > 0) {return m.pyramid[k-1](r, c);}
+  float z = (*m.grid)(r, c);
+  float check = (*m.checkGrid)(r, c);
+  if (z < -99) {z = 0;}
+  PyramidCell p = {z, z, z, check == 0 ? INFINITY : check};
+  return p;
+}
+
+static void buildPyramid(TerrainMesh& m) {
+  //Halves the top level until it fits in one chunk
+  m.pyramid.clear();
+  for (int k = 0; max(levelRows(m, k), levelCols(m, k)) > CHUNK; k++) {
+    int rows = levelRows(m, k), cols = levelCols(m, k);
+    Raster<PyramidCell> up;
+    up.allocate((rows+1)/2, (cols+1)/2);
+    for (int r = 0; r < up.rows(); r++) {
+      for (int c = 0; c < up.cols(); c++) {
+        PyramidCell p = {INFINITY, -INFINITY, 0, -INFINITY};
+        int n = 0;
+        for (int a = 2*r; a < min(2*r+2, rows); a++) {
+          for (int b = 2*c; b < min(2*c+2, cols); b++) {
+            PyramidCell q = cellAt(m, k, a, b);
+            p.lo = min(p.lo, q.lo);
+            p.hi = max(p.hi, q.hi);
+            p.mean += q.mean;
+            p.level = max(p.level, q.level);
+            n++;
+          }
+        }
+        p.mean /= n;
+        up(r, c) = p;
+      }
+    }
+    m.pyramid.push_back(move(up));
+  }
+}
+
+//Index buffer for every chunk: two triangles per sample like visGrid(),
+//ending with the sample, then two per skirt segment ending with a sample
+static void buildIndices(TerrainMesh& m) {
+  vector<unsigned short> indices;
+  for (int a = 0; a < CHUNK; a++) {
+    for (int b = 0; b < CHUNK; b++) {
+      unsigned short c = a*SIDE + b;
+      unsigned short d = (a+1)*SIDE + b+1;
+      unsigned short triangles[6] = {(unsigned short)(c+1),
+        (unsigned short)(c+SIDE), c, (unsigned short)(d-SIDE),
+        (unsigned short)(d-1), d};
+      indices.insert(indices.end(), triangles, triangles + 6);
+    }
+  }
+  int skirt = SIDE*SIDE;
+  for (int e = 0; e < 4; e++) {
+    for (int t = 0; t < CHUNK; t++) {
+      //The sample at t on edge e and the one after it
+      int p, q;
+      if (e == 0) {p = t; q = t+1;}
+      else if (e == 1) {p = CHUNK*SIDE + t; q = p+1;}
+      else if (e == 2) {p = t*SIDE; q = p+SIDE;}
+      else {p = t*SIDE + CHUNK; q = p+SIDE;}
+      unsigned short ps = skirt + e*SIDE + t, qs = ps+1;
+      unsigned short triangles[6] = {(unsigned short)q, ps, (unsigned short)p,
+        qs, ps, (unsigned short)q};
+      indices.insert(indices.end(), triangles, triangles + 6);
+    }
+  }
+  m.count = indices.size();
+  glGenBuffers(1, &m.indices);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m.indices);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned short),
+    indices.data(), GL_STATIC_DRAW);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+bool buildTerrainMesh(TerrainMesh& m, const Raster<float>& grid,
+                      const Raster<float>& checkGrid) {
+  m.program = m.indices = 0;
+  m.count = 0;
+  m.grid = &grid;
+  m.checkGrid = &checkGrid;
+  m.chunks.clear();
+  m.frame = 0;
+  m.buffers = 0;
+  m.drawn = 0;
+  const char* version = (const char*)glGetString(GL_VERSION);
+  if (version == NULL || atoi(version) < 2) {
+    printf("OpenGL 2.0 is needed for the terrain mesh, this is %s\n",
+      version ? version : "unknown");
+    return false;
+  }
+  if (!buildProgram(m)) {return false;}
+  //Row and column are divided by the grid size, like in the *toscreen()
+  //functions of slr.cpp
+  glUseProgram(m.program);
+  glUniform2f(m.sizeAt, grid.rows(), grid.cols());
+  glUseProgram(0);
+  buildIndices(m);
+  buildPyramid(m);
+
+  if (glGetError() != GL_NO_ERROR) {
+    printf("cannot make the terrain buffers\n");
+    return false;
+  }
+  printf("Terrain pyramid of %d levels over %d by %d points\n",
+    (int)m.pyramid.size() + 1, grid.rows(), grid.cols());
+  return true;
+}
+
+static uint64_t chunkKey(int k, int r0, int c0) {
+  return (uint64_t)k << 56 | (uint64_t)(r0/CHUNK) << 28 | (uint64_t)(c0/CHUNK);
+}
+
+//The chunk at level k from sample (r0, c0), with the range of its heights
+static MeshChunk& chunkAt(TerrainMesh& m, int k, int r0, int c0) {
+  uint64_t key = chunkKey(k, r0, c0);
+  unordered_map<uint64_t, MeshChunk>::iterator found = m.chunks.find(key);
+  if (found != m.chunks.end()) {return found->second;}
+  MeshChunk& ch = m.chunks[key];
+  ch.lo = INFINITY;
+  ch.hi = -INFINITY;
+  ch.buffer = 0;
+  ch.used = -1;
+  int rows = levelRows(m, k), cols = levelCols(m, k);
+  for (int r = r0; r <= min(r0 + CHUNK, rows-1); r++) {
+    for (int c = c0; c <= min(c0 + CHUNK, cols-1); c++) {
+      PyramidCell p = cellAt(m, k, r, c);
+      ch.lo = min(ch.lo, p.lo);
+      ch.hi = max(ch.hi, p.hi);
+    }
+  }
+  return ch;
+}
+
+static void uploadChunk(TerrainMesh& m, MeshChunk& ch, int k, int r0,
+                        int c0) {
+  int rows = levelRows(m, k), cols = levelCols(m, k);
+  vector<float> vertices((SIDE*SIDE + 4*SIDE) * 4);
+  for (int a = 0; a < SIDE; a++) {
+    for (int b = 0; b < SIDE; b++) {
+      int r = min(r0 + a, rows-1), c = min(c0 + b, cols-1);
+      float* v = &vertices[(a*SIDE + b) * 4];
+      v[0] = r << k;
+      v[1] = c << k;
+      if (k == 0) {
+        v[2] = (*m.grid)(r, c);
+        v[3] = (*m.checkGrid)(r, c);
+      }
+      else {
+        PyramidCell p = m.pyramid[k-1](r, c);
+        v[2] = p.mean;
+        v[3] = isinf(p.level) ? 0 : p.level;
+      }
+    }
+  }
+  //Skirts: the edge samples again, dropped to the ground and never flooded
+  float* s = &vertices[SIDE*SIDE * 4];
+  for (int e = 0; e < 4; e++) {
+    for (int t = 0; t < SIDE; t++, s += 4) {
+      int a = (e == 0) ? 0 : (e == 1) ? CHUNK : t;
+      int b = (e == 2) ? 0 : (e == 3) ? CHUNK : t;
+      const float* v = &vertices[(a*SIDE + b) * 4];
+      s[0] = v[0];
+      s[1] = v[1];
+      s[2] = SKIRT;
+      s[3] = 0;
+    }
+  }
+  glGenBuffers(1, &ch.buffer);
+  glBindBuffer(GL_ARRAY_BUFFER, ch.buffer);
+  glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float),
+    vertices.data(), GL_STATIC_DRAW);
+  m.buffers++;
+}
+
+//What the chunk selection needs to know about the view
+struct View {
+  float modelview[16], projection[16];
+  float pixels;
+  float feet, maxz;
+  int rows, cols;
+};
+
+//out = matrix * in, with OpenGL's column-major matrices
+static void transform(const float* matrix, const float in[4], float out[4]) {
+  for (int r = 0; r < 4; r++) {
+    out[r] = matrix[r]*in[0] + matrix[4+r]*in[1] + matrix[8+r]*in[2] +
+      matrix[12+r]*in[3];
+  }
+}
+
+struct Selected {
+  int k, r0, c0;
+  MeshChunk* chunk;
+};
+
+//Walks the quadtree below chunk (k, r0, c0) and adds the chunks to draw
+static void selectChunks(TerrainMesh& m, const View& v, int k, int r0,
+                         int c0, vector<Selected>& out) {
+  if (r0 >= levelRows(m, k) || c0 >= levelCols(m, k)) {return;}
+  MeshChunk& ch = chunkAt(m, k, r0, c0);
+
+  //Bounding box of the chunk as drawn, water and skirts included
+  float x0 = -1 + 2.0f*(r0 << k)/v.rows;
+  float x1 = -1 + 2.0f*min((r0 + CHUNK) << k, v.rows-1)/v.rows;
+  float y0 = -1 + 2.0f*(c0 << k)/v.cols;
+  float y1 = -1 + 2.0f*min((c0 + CHUNK) << k, v.cols-1)/v.cols;
+  float z0 = min(min(ch.lo, v.feet), 0.0f)/v.maxz/5;
+  float z1 = max(max(ch.hi, v.feet), 0.0f)/v.maxz/5;
+  int outside[6] = {0, 0, 0, 0, 0, 0};
+  float nearest = INFINITY;
+  for (int corner = 0; corner < 8; corner++) {
+    float p[4] = {corner & 1 ? x1 : x0, corner & 2 ? y1 : y0,
+      corner & 4 ? z1 : z0, 1};
+    float eye[4], clip[4];
+    transform(v.modelview, p, eye);
+    transform(v.projection, eye, clip);
+    for (int axis = 0; axis < 3; axis++) {
+      if (clip[axis] < -clip[3]) {outside[2*axis]++;}
+      if (clip[axis] > clip[3]) {outside[2*axis+1]++;}
+    }
+    nearest = min(nearest, clip[3]);
+  }
+  for (int plane = 0; plane < 6; plane++) {
+    if (outside[plane] == 8) {return;}
+  }
+
+  //Width of a sample on screen, at the nearest corner
+  if (k > 0) {
+    float width = 2.0f*(1 << k)/min(v.rows, v.cols);
+    float onScreen = width * v.projection[5] * v.pixels / max(nearest, 1e-3f);
+    if (onScreen > LODPIXELS) {
+      for (int a = 0; a < 2; a++) {
+        for (int b = 0; b < 2; b++) {
+          selectChunks(m, v, k-1, 2*r0 + a*CHUNK, 2*c0 + b*CHUNK, out);
+        }
+      }
+      return;
+    }
+  }
+  ch.used = m.frame;
+  Selected s = {k, r0, c0, &ch};
+  out.push_back(s);
+}
+
+//Drops the chunks that were drawn longest ago while there are too many
+static void evictChunks(TerrainMesh& m) {
+  if (m.buffers <= MAXBUFFERS) {return;}
+  vector<pair<long, MeshChunk*> > old;
+  for (unordered_map<uint64_t, MeshChunk>::iterator it = m.chunks.begin();
+       it != m.chunks.end(); ++it) {
+    if (it->second.buffer && it->second.used < m.frame) {
+      old.push_back(make_pair(it->second.used, &it->second));
+    }
+  }
+  sort(old.begin(), old.end());
+  for (size_t k = 0; k < old.size() && m.buffers > MAXBUFFERS; k++) {
+    glDeleteBuffers(1, &old[k].second->buffer);
+    old[k].second->buffer = 0;
+    m.buffers--;
+  }
+}
+
+void drawTerrainMesh(TerrainMesh& m, float feet, float maxz, int seavis) {
+  m.frame++;
+  View v;
+  glGetFloatv(GL_MODELVIEW_MATRIX, v.modelview);
+  glGetFloatv(GL_PROJECTION_MATRIX, v.projection);
+  GLint viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+  v.pixels = viewport[3] / 2.0f;
+  v.feet = feet;
+  v.maxz = maxz;
+  v.rows = m.grid->rows();
+  v.cols = m.grid->cols();
+  vector<Selected> selected;
+  selectChunks(m, v, m.pyramid.size(), 0, 0, selected);
+  for (size_t s = 0; s < selected.size(); s++) {
+    if (!selected[s].chunk->buffer) {
+      uploadChunk(m, *selected[s].chunk, selected[s].k, selected[s].r0,
+        selected[s].c0);
+    }
+  }
+  evictChunks(m);
+  m.drawn = selected.size();
+
+  glUseProgram(m.program);
+  glUniform1f(m.feetAt, feet);
+  glUniform1f(m.maxzAt, maxz);
+  glUniform1f(m.seavisAt, seavis);
+  glShadeModel(GL_FLAT);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m.indices);
+  glEnableVertexAttribArray(0);
+  for (size_t s = 0; s < selected.size(); s++) {
+    glBindBuffer(GL_ARRAY_BUFFER, selected[s].chunk->buffer);
+    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, NULL);
+    glDrawElements(GL_TRIANGLES, m.count, GL_UNSIGNED_SHORT, NULL);
+  }
+  glDisableVertexAttribArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  glShadeModel(GL_SMOOTH);
+  glUseProgram(0);
+}
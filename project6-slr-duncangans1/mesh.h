@@ -0,0 +1,94 @@
+/* mesh.h
+
+  Retained-mode terrain rendering. A small shader works out the height and
+  colour of every vertex from the sea level and the colour ramp, which are
+  uniforms, so changing the sea level or the view does not go over the grid
+  on the CPU.
+
+  The terrain is drawn at a level of detail that follows the view. After
+  the flooding a pyramid is built over the grid: every level halves the
+  rows and columns of the one below and keeps the lowest, highest and mean
+  height of the points it covers, and the highest flooding level. The
+  pyramid is cut into chunks of CHUNK by CHUNK samples that form a
+  quadtree: a chunk on level k covers four chunks on level k-1. Each frame
+  the tree is walked from the top, skipping chunks out of view and
+  splitting chunks whose samples would cover more than a few pixels, so
+  the terrain near the camera is drawn at full resolution and far away
+  terrain coarsely. Chunks are put on the graphics card the first time
+  they are needed, and the least recently drawn ones are dropped when
+  there are too many, so the work per frame depends on the view and not on
+  the size of the grid.
+
+  Every sample is a vertex holding its row, column, height and flooding
+  level. The two triangles drawn for a sample end with that sample, so with
+  flat shading they take its colour, as in createTriangles(). Points under
+  water are drawn at the sea level. Chunks have a skirt hanging down to
+  height 0 around them, which hides the cracks where chunks of different
+  levels meet.
+
+*/
+
+#ifndef MESH_H
+#define MESH_H
+
+#include "raster.h"
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+//The colour ramp for land, shared with getColor(): a point whose height
+//above the sea is below limit*maxz gets the colour, checked in order. Land
+//above the last limit gets RAMPTOP.
+struct RampStep {
+  float limit;
+  float r, g, b;
+};
+const int RAMPSIZE = 14;
+extern const RampStep RAMP[RAMPSIZE];
+extern const float RAMPTOP[3];
+
+//Samples along the side of a chunk
+const int CHUNK = 64;
+
+//A point of the pyramid above the grid
+struct PyramidCell {
+  float lo, hi, mean;
+  //Highest flooding level, INFINITY if any point never floods
+  float level;
+};
+
+//A chunk of the quadtree. buffer is 0 while it is not on the card.
+struct MeshChunk {
+  float lo, hi;
+  unsigned int buffer;
+  long used;
+};
+
+struct TerrainMesh {
+  unsigned int program, indices;
+  int feetAt, maxzAt, seavisAt, sizeAt, limitAt, colourAt, topAt;
+  //Number of indices drawn per chunk
+  long count;
+  const Raster<float>* grid;
+  const Raster<float>* checkGrid;
+  //pyramid[k-1] is level k; level 0 is the grid itself
+  std::vector<Raster<PyramidCell> > pyramid;
+  std::unordered_map<uint64_t, MeshChunk> chunks;
+  long frame;
+  int buffers;
+  //Chunks drawn in the last frame
+  int drawn;
+};
+
+//Builds the pyramid over grid, with the flooding levels in checkGrid, and
+//the shader. Both rasters must stay as they are while the mesh is used.
+//Needs a current OpenGL 2.0 context. Returns false, after printing why, if
+//the shader or the buffers cannot be made.
+bool buildTerrainMesh(TerrainMesh& m, const Raster<float>& grid,
+                      const Raster<float>& checkGrid);
+
+//Draws the terrain at sea level feet with the current transformations,
+//choosing the chunks for the current view
+void drawTerrainMesh(TerrainMesh& m, float feet, float maxz, int seavis);
+
+#endif
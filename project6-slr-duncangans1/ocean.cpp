@@ -0,0 +1,173 @@
+/* ocean.cpp
+
+  Parallel ocean search, see ocean.h. The search goes one frontier (one
+  distance from the border) at a time. Small frontiers are expanded by the
+  calling thread alone, since waking the other threads would cost more
+  than the work. Once a frontier is big enough, every thread takes blocks
+  of it from a shared counter, so threads that get cheap blocks simply
+  take more of them, and collects the next frontier and the coastline in
+  its own lists.
+
+*/
+
+#include "ocean.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+//Frontiers smaller than this are expanded by one thread
+static const size_t PARALLELMIN = 1 << 14;
+//Number of frontier points a thread claims at a time
+static const size_t BLOCK = 1024;
+
+struct Search {
+  const float* check;
+  int rows, cols;
+  BitMask* visited;
+  vector<int> frontier;
+  vector<vector<int> > next, coast;
+  atomic<size_t> cursor;
+
+  //Hands parallel levels to the worker threads
+  mutex lock;
+  condition_variable wake, finished;
+  int generation;
+  int running;
+  bool done;
+};
+
+template <bool ATOMIC, int N>
+static inline void expand(Search& s, int c, vector<int>& next,
+                          vector<int>& coast) {
+  int n[N];
+  int count = neighbours<N>(c, s.rows, s.cols, n);
+  for (int k = 0; k < count; k++) {
+    bool seen = ATOMIC ? s.visited->testAndSetAtomic(n[k])
+      : s.visited->testAndSet(n[k]);
+    if (seen) {continue;}
+    if (s.check[n[k]] == -1) {next.push_back(n[k]);}
+    else {coast.push_back(n[k]);}
+  }
+}
+
+template <int N>
+static void expandBlocks(Search& s, int t) {
+  size_t size = s.frontier.size();
+  while (true) {
+    size_t first = s.cursor.fetch_add(BLOCK);
+    if (first >= size) {break;}
+    size_t last = min(size, first + BLOCK);
+    for (size_t k = first; k < last; k++) {
+      expand<true, N>(s, s.frontier[k], s.next[t], s.coast[t]);
+    }
+  }
+}
+
+template <int N>
+static void worker(Search* s, int t) {
+  int seen = 0;
+  while (true) {
+    {
+      unique_lock<mutex> l(s->lock);
+      s->wake.wait(l, [&] {return s->done || s->generation != seen;});
+      if (s->done) {return;}
+      seen = s->generation;
+    }
+    expandBlocks<N>(*s, t);
+    unique_lock<mutex> l(s->lock);
+    if (--s->running == 0) {s->finished.notify_one();}
+  }
+}
+
+//Expands s.frontier until the ocean runs out
+template <int N>
+static void search(Search& s, int nthreads) {
+  vector<thread> threads;
+  for (int t = 1; t < nthreads; t++) {
+    threads.push_back(thread(worker<N>, &s, t));
+  }
+  while (!s.frontier.empty()) {
+    if (nthreads == 1 || s.frontier.size() < PARALLELMIN) {
+      for (size_t k = 0; k < s.frontier.size(); k++) {
+        expand<false, N>(s, s.frontier[k], s.next[0], s.coast[0]);
+      }
+    }
+    else {
+      s.cursor = 0;
+      {
+        lock_guard<mutex> l(s.lock);
+        s.running = nthreads - 1;
+        s.generation++;
+      }
+      s.wake.notify_all();
+      expandBlocks<N>(s, 0);
+      unique_lock<mutex> l(s.lock);
+      s.finished.wait(l, [&] {return s.running == 0;});
+    }
+    //The next frontier is every thread's list put together
+    s.frontier.clear();
+    for (int t = 0; t < nthreads; t++) {
+      s.frontier.insert(s.frontier.end(), s.next[t].begin(), s.next[t].end());
+      s.next[t].clear();
+    }
+  }
+  {
+    lock_guard<mutex> l(s.lock);
+    s.done = true;
+  }
+  s.wake.notify_all();
+  for (size_t t = 0; t < threads.size(); t++) {threads[t].join();}
+}
+
+//Starts the search at border point c if it is ocean. A point on two
+//edges is only taken once.
+static void seedOcean(Search& s, int c) {
+  if (s.check[c] == -1 && !s.visited->testAndSet(c)) {
+    s.frontier.push_back(c);
+  }
+}
+
+void findOcean(const Raster<float>& checkGrid, const vector<int>& seeds,
+               int connectivity, BitMask& visited, vector<int>& coast,
+               int nthreads) {
+  Search s;
+  s.check = checkGrid.data();
+  s.rows = checkGrid.rows();
+  s.cols = checkGrid.cols();
+  s.visited = &visited;
+  s.generation = 0;
+  s.running = 0;
+  s.done = false;
+  if (nthreads < 1) {nthreads = 1;}
+  s.next.resize(nthreads);
+  s.coast.resize(nthreads);
+
+  //Seeds are the ocean points on the border, like in slr(), and the
+  //sources given. The border is walked edge by edge: the top row, the
+  //two sides and the bottom row.
+  int bottom = (s.rows-1)*s.cols;
+  for (int j = 0; j < s.cols; j++) {seedOcean(s, j);}
+  for (int i = 1; i < s.rows-1; i++) {
+    seedOcean(s, i*s.cols);
+    seedOcean(s, i*s.cols + s.cols-1);
+  }
+  for (int j = 0; j < s.cols; j++) {seedOcean(s, bottom + j);}
+  for (size_t k = 0; k < seeds.size(); k++) {
+    if (!visited.testAndSet(seeds[k])) {s.frontier.push_back(seeds[k]);}
+  }
+
+  if (connectivity == 8) {search<8>(s, nthreads);}
+  else {search<4>(s, nthreads);}
+
+  //Sorted so the coastline does not depend on how the threads ran
+  coast.clear();
+  for (int t = 0; t < nthreads; t++) {
+    coast.insert(coast.end(), s.coast[t].begin(), s.coast[t].end());
+  }
+  sort(coast.begin(), coast.end());
+}
@@ -0,0 +1,26 @@
+/* ocean.h
+
+  Finding the ocean. Starting from the ocean points on the border, and any
+  other points given as sources of ocean, a breadth first search spreads
+  over every ocean point connected to them, through 4 or 8 neighbours.
+  The land points it touches are the coastline, where the flooding starts.
+  Large frontiers are expanded on all threads, each claiming blocks of the
+  frontier as it finishes the last, with the visited flags set atomically.
+
+*/
+
+#ifndef OCEAN_H
+#define OCEAN_H
+
+#include <vector>
+#include "raster.h"
+
+//checkGrid marks ocean with -1. seeds are more points to start from, and
+//must be marked -1 too. Every point reached (ocean and coast) is set in
+//visited, which must be cleared beforehand. coast gets the index of each
+//coastline point once, in increasing order. connectivity is 4 or 8.
+void findOcean(const Raster<float>& checkGrid, const std::vector<int>& seeds,
+               int connectivity, BitMask& visited, std::vector<int>& coast,
+               int nthreads);
+
+#endif
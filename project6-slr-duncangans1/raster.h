@@ -0,0 +1,200 @@
+/* raster.h
+
+  Flat grid containers. A Raster<T> keeps all rows in one contiguous,
+  64 byte aligned block, so a point can be reached by row and column or
+  by its index i*cols+j, which is also how the flooding queues store
+  points. A BitMask is a grid of flags packed 64 to a word. neighbours()
+  lists the points next to a point, four or eight of them.
+
+*/
+
+#ifndef RASTER_H
+#define RASTER_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <new>
+#include <utility>
+
+//Releases memory handed to Raster::allocate()
+inline void releaseAligned(void* base, size_t length) {
+  free(base);
+}
+
+//Allocates length bytes on a 64 byte boundary, or throws std::bad_alloc
+inline void* allocateAligned(size_t length) {
+  void* base = NULL;
+  if (posix_memalign(&base, 64, length ? length : 64) != 0) {
+    throw std::bad_alloc();
+  }
+  return base;
+}
+
+template <typename T>
+class Raster {
+public:
+  Raster() : nrows(0), ncols(0), cells(NULL), base(NULL), length(0),
+    release(NULL) {}
+  ~Raster() {clear();}
+
+  Raster(Raster&& o) : Raster() {swap(o);}
+  Raster& operator=(Raster&& o) {
+    clear();
+    swap(o);
+    return *this;
+  }
+  Raster(const Raster&) = delete;
+  Raster& operator=(const Raster&) = delete;
+
+  //Makes an uninitialised rows by cols raster
+  void allocate(int rows, int cols) {
+    clear();
+    size_t bytes = (size_t)rows*cols*sizeof(T);
+    adopt(rows, cols, (T*)allocateAligned(bytes), releaseAligned);
+  }
+
+  //Makes a rows by cols raster with every point set to value
+  void assign(int rows, int cols, T value) {
+    allocate(rows, cols);
+    fill(value);
+  }
+
+  //Takes over memory that holds rows*cols values. release(mem, length)
+  //is called when the raster lets go of it; it may be NULL for memory the
+  //raster does not own.
+  void adopt(int rows, int cols, T* data,
+             void (*release)(void* mem, size_t length),
+             void* mem = NULL, size_t length = 0) {
+    clear();
+    nrows = rows;
+    ncols = cols;
+    cells = data;
+    this->base = mem ? mem : (void*)data;
+    this->length = length;
+    this->release = release;
+  }
+
+  void fill(T value) {
+    size_t n = size();
+    for (size_t k = 0; k < n; k++) {cells[k] = value;}
+  }
+
+  void clear() {
+    if (release) {release(base, length);}
+    nrows = ncols = 0;
+    cells = NULL;
+    base = NULL;
+    length = 0;
+    release = NULL;
+  }
+
+  void swap(Raster& o) {
+    std::swap(nrows, o.nrows);
+    std::swap(ncols, o.ncols);
+    std::swap(cells, o.cells);
+    std::swap(base, o.base);
+    std::swap(length, o.length);
+    std::swap(release, o.release);
+  }
+
+  T& operator()(int i, int j) {return cells[(size_t)i*ncols + j];}
+  const T& operator()(int i, int j) const {return cells[(size_t)i*ncols + j];}
+  T& operator[](size_t k) {return cells[k];}
+  const T& operator[](size_t k) const {return cells[k];}
+  T* row(int i) {return cells + (size_t)i*ncols;}
+  const T* row(int i) const {return cells + (size_t)i*ncols;}
+  T* data() {return cells;}
+  const T* data() const {return cells;}
+
+  int rows() const {return nrows;}
+  int cols() const {return ncols;}
+  size_t size() const {return (size_t)nrows*ncols;}
+  bool empty() const {return cells == NULL;}
+
+private:
+  int nrows, ncols;
+  T* cells;
+  void* base;
+  size_t length;
+  void (*release)(void* mem, size_t length);
+};
+
+//Puts the indices of the points next to point c of a rows by cols grid in
+//out and returns how many there are. N is 4 for right, left, below and
+//above, in that order, or 8 for those followed by the four diagonals. It
+//is a template so the flooding loops are compiled for each neighbourhood
+//and pay nothing for the choice.
+template <int N>
+inline int neighbours(int c, int rows, int cols, int* out) {
+  static_assert(N == 4 || N == 8, "neighbourhoods are 4 or 8 points");
+  int i = c / cols;
+  int j = c % cols;
+  bool right = j < cols-1, left = j > 0, below = i < rows-1, above = i > 0;
+  int count = 0;
+  if (right) {out[count++] = c+1;}
+  if (left) {out[count++] = c-1;}
+  if (below) {out[count++] = c+cols;}
+  if (above) {out[count++] = c-cols;}
+  if (N == 8) {
+    if (below && right) {out[count++] = c+cols+1;}
+    if (below && left) {out[count++] = c+cols-1;}
+    if (above && right) {out[count++] = c-cols+1;}
+    if (above && left) {out[count++] = c-cols-1;}
+  }
+  return count;
+}
+
+class BitMask {
+public:
+  BitMask() : nrows(0), ncols(0), words(NULL), nwords(0) {}
+  ~BitMask() {free(words);}
+  BitMask(const BitMask&) = delete;
+  BitMask& operator=(const BitMask&) = delete;
+
+  //Makes a rows by cols mask with every flag cleared
+  void assign(int rows, int cols) {
+    free(words);
+    nrows = rows;
+    ncols = cols;
+    nwords = ((size_t)rows*cols + 63) / 64;
+    words = (uint64_t*)allocateAligned(nwords*sizeof(uint64_t));
+    reset();
+  }
+
+  //Clears every flag
+  void reset() {memset(words, 0, nwords*sizeof(uint64_t));}
+
+  bool operator[](size_t k) const {return (words[k >> 6] >> (k & 63)) & 1;}
+  bool operator()(int i, int j) const {return (*this)[(size_t)i*ncols + j];}
+  void set(size_t k) {words[k >> 6] |= (uint64_t)1 << (k & 63);}
+  void set(int i, int j) {set((size_t)i*ncols + j);}
+  void unset(size_t k) {words[k >> 6] &= ~((uint64_t)1 << (k & 63));}
+
+  //Sets flag k and returns whether it was already set
+  bool testAndSet(size_t k) {
+    uint64_t bit = (uint64_t)1 << (k & 63);
+    bool was = words[k >> 6] & bit;
+    words[k >> 6] |= bit;
+    return was;
+  }
+
+  //testAndSet() that is safe when several threads set flags at once
+  bool testAndSetAtomic(size_t k) {
+    uint64_t bit = (uint64_t)1 << (k & 63);
+    return __atomic_fetch_or(&words[k >> 6], bit, __ATOMIC_RELAXED) & bit;
+  }
+
+  uint64_t* data() {return words;}
+  size_t wordCount() const {return nwords;}
+  int rows() const {return nrows;}
+  int cols() const {return ncols;}
+
+private:
+  int nrows, ncols;
+  uint64_t* words;
+  size_t nwords;
+};
+
+#endif
@@ -0,0 +1,403 @@
+/* server.cpp
+
+  The socket server, see server.h. The main thread accepts connections and
+  waits on all of them with poll(). A connection with something to read
+  goes in a queue; a thread of the pool takes it, answers the requests
+  that have come in and hands it back to the main thread through a pipe,
+  so an idle client holds no thread. Only the queue has a lock. Every
+  thread has its own tile cache for each compact grid, kept from one
+  connection to the next.
+
+*/
+
+#include "server.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+//Longest request line, and the most points a mask answer can have
+static const size_t MAXLINE = 4096;
+static const long MAXMASK = 1L << 26;
+//Milliseconds to wait before accepting again after accept() failed
+static const int RESTMS = 100;
+
+struct Connection {
+  int fd;
+  //The start of a request line that has not all come in yet
+  string pending;
+};
+
+struct Pool {
+  const vector<ServedGrid>* grids;
+  mutex lock;
+  condition_variable ready;
+  //Connections with something to read, and those handed back to the main
+  //thread, which a byte on the wake pipe tells about
+  deque<Connection*> waiting;
+  vector<Connection*> answered;
+  int wake[2];
+};
+
+//Sends all of s, returning false if the client has gone
+static bool sendAll(int fd, const string& s) {
+  size_t sent = 0;
+  while (sent < s.size()) {
+    ssize_t n = send(fd, s.data() + sent, s.size() - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {continue;}
+    if (n <= 0) {return false;}
+    sent += n;
+  }
+  return true;
+}
+
+static string errorAnswer(const char* message) {
+  return string("{\"error\": \"") + message + "\"}\n";
+}
+
+//s as a JSON string
+static string quoted(const string& s) {
+  string q = "\"";
+  for (size_t k = 0; k < s.size(); k++) {
+    if (s[k] == '"' || s[k] == '\\') {q += '\\';}
+    if ((unsigned char)s[k] >= 32) {q += s[k];}
+  }
+  return q + "\"";
+}
+
+//The grid named by word: its number or its file name, NULL if none is
+static const ServedGrid* findGrid(const vector<ServedGrid>& grids,
+                                  const char* word) {
+  char* end;
+  long k = strtol(word, &end, 10);
+  if (*end == 0 && k >= 0 && k < (long)grids.size()) {return &grids[k];}
+  for (size_t g = 0; g < grids.size(); g++) {
+    if (grids[g].name == word) {return &grids[g];}
+  }
+  return NULL;
+}
+
+//Land points flooded at level, like floodedCells() in engine.cpp. A
+//compact grid has them at the last level at or below level.
+static long flooded(const ServedGrid& g, float level) {
+  if (g.compact) {
+    const vector<float>& v = g.levels.values;
+    size_t k = upper_bound(v.begin() + 2, v.end() - 1, level) - v.begin() - 2;
+    return k > 0 ? g.levels.flooded[k-1] : 0;
+  }
+  return upper_bound(g.floodHeights.begin(), g.floodHeights.end(), level) -
+    g.floodHeights.begin();
+}
+
+//Formats a value, with the points that never flood as null
+static string number(double v) {
+  if (isinf(v) || isnan(v)) {return "null";}
+  char s[32];
+  snprintf(s, sizeof(s), "%.9g", v);
+  return s;
+}
+
+static string pointAnswer(const ServedGrid& g, LevelCache& cache, long row,
+                          long col) {
+  if (row < 0 || row >= g.h.nrows || col < 0 || col >= g.h.ncols) {
+    return errorAnswer("outside the grid");
+  }
+  float z = g.terrain.size() ? g.terrain(row, col) : g.h.ndval;
+  float h = g.compact ? cache.level(row, col) : g.heights(row, col);
+  return "{\"row\": " + to_string(row) + ", \"col\": " + to_string(col) +
+    ", \"height\": " + (z == g.h.ndval ? string("null") : number(z)) +
+    ", \"floods_at\": " + number(h) + "}\n";
+}
+
+//caches has the tile cache of every grid for this thread
+static string answer(const vector<ServedGrid>& grids,
+                     vector<LevelCache>& caches, char* line) {
+  char* word[8];
+  char* rest;
+  int count = 0;
+  for (char* w = strtok_r(line, " \t\r", &rest); w && count < 8;
+       w = strtok_r(NULL, " \t\r", &rest)) {
+    word[count++] = w;
+  }
+  if (count == 0) {return errorAnswer("empty request");}
+  if (strcmp(word[0], "grids") == 0) {
+    string s = "{\"grids\": [";
+    for (size_t g = 0; g < grids.size(); g++) {
+      s += string(g ? ", " : "") + "{\"name\": " + quoted(grids[g].name) +
+        ", \"rows\": " + to_string(grids[g].h.nrows) + ", \"cols\": " +
+        to_string(grids[g].h.ncols) + ", \"cellsize\": " +
+        number(grids[g].h.cellsize) + ", \"land_cells\": " +
+        to_string(grids[g].land) + "}";
+    }
+    return s + "]}\n";
+  }
+  const char* known[] = {"stats", "point", "coord", "mask"};
+  bool request = false;
+  for (int k = 0; k < 4; k++) {request = request || !strcmp(word[0], known[k]);}
+  if (!request) {return errorAnswer("unknown request");}
+  const ServedGrid* g = count > 1 ? findGrid(grids, word[1]) : NULL;
+  if (g == NULL) {return errorAnswer("no such grid");}
+  LevelCache& cache = caches[g - &grids[0]];
+  if (strcmp(word[0], "stats") == 0 && count == 3) {
+    float level = atof(word[2]);
+    long cells = flooded(*g, level);
+    double area = cells * g->h.cellsize * g->h.cellsize;
+    return "{\"level\": " + number(level) + ", \"flooded_cells\": " +
+      to_string(cells) + ", \"flooded_area\": " + number(area) +
+      ", \"flooded_fraction\": " +
+      number(g->land > 0 ? (double)cells / g->land : 0) + "}\n";
+  }
+  if (strcmp(word[0], "point") == 0 && count == 4) {
+    return pointAnswer(*g, cache, atol(word[2]), atol(word[3]));
+  }
+  if (strcmp(word[0], "coord") == 0 && count == 4) {
+    //Rows count down from the top of the grid, like in the .asc file
+    double x = atof(word[2]), y = atof(word[3]);
+    long col = (long)floor((x - g->h.xllcorner) / g->h.cellsize);
+    long row = g->h.nrows - 1 -
+      (long)floor((y - g->h.yllcorner) / g->h.cellsize);
+    return pointAnswer(*g, cache, row, col);
+  }
+  if (strcmp(word[0], "mask") == 0 && count == 7) {
+    TRACE_SCOPE("mask request");
+    float level = atof(word[2]);
+    long r0 = max(0L, atol(word[3])), c0 = max(0L, atol(word[4]));
+    long r1 = min((long)g->h.nrows, atol(word[3]) + atol(word[5]));
+    long c1 = min((long)g->h.ncols, atol(word[4]) + atol(word[6]));
+    if (r1 <= r0 || c1 <= c0) {return errorAnswer("empty window");}
+    if ((r1-r0)*(c1-c0) > MAXMASK) {return errorAnswer("window too big");}
+    string s = "{\"row\": " + to_string(r0) + ", \"col\": " + to_string(c0) +
+      ", \"rows\": " + to_string(r1-r0) + ", \"cols\": " + to_string(c1-c0) +
+      ", \"level\": " + number(level) + ", \"mask\": [";
+    s.reserve(s.size() + (r1-r0)*(c1-c0+4) + 4);
+    long wet = 0;
+    for (long i = r0; i < r1; i++) {
+      s += i > r0 ? ", \"" : "\"";
+      const float* h = g->compact ? NULL : &g->heights(i, 0);
+      for (long j = c0; j < c1; j++) {
+        bool f = (h ? h[j] : cache.level(i, j)) <= level;
+        wet += f;
+        s += f ? '1' : '0';
+      }
+      s += '"';
+    }
+    return s + "], \"flooded_cells\": " + to_string(wet) + "}\n";
+  }
+  return errorAnswer("wrong number of words");
+}
+
+//Answers the requests that have come in on c. Returns false once the
+//client has closed it.
+static bool serveRequests(const vector<ServedGrid>& grids,
+                          vector<LevelCache>& caches, Connection& c) {
+  char buffer[65536];
+  ssize_t n;
+  do {
+    n = recv(c.fd, buffer, sizeof(buffer), 0);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0) {return false;}
+  c.pending.append(buffer, n);
+  size_t start = 0, end;
+  while ((end = c.pending.find('\n', start)) != string::npos) {
+    string line = c.pending.substr(start, end - start);
+    start = end + 1;
+    TRACE_SCOPE("request");
+    if (!sendAll(c.fd, answer(grids, caches, &line[0]))) {return false;}
+  }
+  c.pending.erase(0, start);
+  if (c.pending.size() > MAXLINE) {
+    sendAll(c.fd, errorAnswer("request too long"));
+    return false;
+  }
+  return true;
+}
+
+static void worker(Pool* p) {
+  vector<LevelCache> caches;
+  for (size_t g = 0; g < p->grids->size(); g++) {
+    const ServedGrid& grid = (*p->grids)[g];
+    caches.push_back(LevelCache(&grid.levels, grid.compact ? 16 : 0));
+  }
+  while (true) {
+    Connection* c;
+    {
+      unique_lock<mutex> l(p->lock);
+      p->ready.wait(l, [&] {return !p->waiting.empty();});
+      c = p->waiting.front();
+      p->waiting.pop_front();
+    }
+    if (!serveRequests(*p->grids, caches, *c)) {
+      close(c->fd);
+      delete c;
+      continue;
+    }
+    {
+      lock_guard<mutex> l(p->lock);
+      p->answered.push_back(c);
+    }
+    //A full pipe already wakes the main thread
+    char b = 0;
+    if (write(p->wake[1], &b, 1) < 0) {}
+  }
+}
+
+//Opens the listening socket for address, or returns -1
+static int listenOn(const char* address) {
+  int fd;
+  if (strchr(address, '/')) {
+    struct sockaddr_un a;
+    memset(&a, 0, sizeof(a));
+    a.sun_family = AF_UNIX;
+    if (strlen(address) >= sizeof(a.sun_path)) {return -1;}
+    strcpy(a.sun_path, address);
+    //Only a socket left by an earlier server is removed; any other file
+    //there is never touched
+    struct stat st;
+    if (lstat(address, &st) == 0) {
+      if (!S_ISSOCK(st.st_mode)) {
+        errno = EADDRINUSE;
+        return -1;
+      }
+      unlink(address);
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&a, sizeof(a)) != 0) {
+      if (fd >= 0) {close(fd);}
+      return -1;
+    }
+  }
+  else {
+    struct sockaddr_in a;
+    memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET;
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    const char* port = strrchr(address, ':');
+    if (port) {
+      string host(address, port - address);
+      if (inet_pton(AF_INET, host.c_str(), &a.sin_addr) != 1) {return -1;}
+      port++;
+    }
+    else {port = address;}
+    a.sin_port = htons(atoi(port));
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    if (fd >= 0) {setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));}
+    if (fd < 0 || bind(fd, (struct sockaddr*)&a, sizeof(a)) != 0) {
+      if (fd >= 0) {close(fd);}
+      return -1;
+    }
+  }
+  if (listen(fd, 64) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool serveGrids(const char* address, const vector<ServedGrid>& grids,
+                int nthreads) {
+  int fd = listenOn(address);
+  if (fd < 0) {
+    printf("cannot listen on %s: %s\n", address, strerror(errno));
+    return false;
+  }
+  //The pool lives as long as the process, like its threads
+  Pool& p = *new Pool;
+  p.grids = &grids;
+  if (pipe(p.wake) != 0) {
+    printf("cannot serve on %s: %s\n", address, strerror(errno));
+    close(fd);
+    return false;
+  }
+  fcntl(p.wake[0], F_SETFL, O_NONBLOCK);
+  fcntl(p.wake[1], F_SETFL, O_NONBLOCK);
+  if (nthreads < 1) {nthreads = 1;}
+  for (int t = 0; t < nthreads; t++) {thread(worker, &p).detach();}
+  printf("Serving %lu grids on %s with %d threads\n",
+    (unsigned long)grids.size(), address, nthreads);
+  fflush(stdout);
+  //The connections waiting for a request, watched after the listening
+  //socket and the wake pipe
+  vector<Connection*> idle;
+  vector<struct pollfd> watched;
+  //Set when accept() failed, as it does when descriptors run out: the
+  //listening socket is left out of the next wait, which times out, so
+  //the loop does not spin on a connection it cannot take
+  bool resting = false;
+  while (true) {
+    watched.resize(2 + idle.size());
+    watched[0].fd = resting ? -1 : fd;
+    watched[1].fd = p.wake[0];
+    for (size_t k = 0; k < idle.size(); k++) {watched[2+k].fd = idle[k]->fd;}
+    for (size_t k = 0; k < watched.size(); k++) {
+      watched[k].events = POLLIN;
+      watched[k].revents = 0;
+    }
+    int timeout = resting ? RESTMS : -1;
+    resting = false;
+    if (poll(&watched[0], watched.size(), timeout) < 0) {
+      if (errno == EINTR) {continue;}
+      printf("cannot wait for requests on %s\n", address);
+      close(fd);
+      return false;
+    }
+    //Connections with a request (or closed by the client) go to the pool
+    size_t kept = 0, sent = 0;
+    {
+      lock_guard<mutex> l(p.lock);
+      for (size_t k = 0; k < idle.size(); k++) {
+        if (watched[2+k].revents) {
+          p.waiting.push_back(idle[k]);
+          sent++;
+        }
+        else {idle[kept++] = idle[k];}
+      }
+    }
+    idle.resize(kept);
+    if (sent == 1) {p.ready.notify_one();}
+    else if (sent > 1) {p.ready.notify_all();}
+    if (watched[1].revents) {
+      char b[256];
+      while (read(p.wake[0], b, sizeof(b)) > 0) {}
+      lock_guard<mutex> l(p.lock);
+      idle.insert(idle.end(), p.answered.begin(), p.answered.end());
+      p.answered.clear();
+    }
+    if (watched[0].revents) {
+      int c = accept(fd, NULL, NULL);
+      if (c < 0) {
+        //The server keeps going whatever the error; the connection that
+        //could not be taken waits in the backlog for the next round
+        if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN ||
+            errno == EWOULDBLOCK) {continue;}
+        printf("cannot accept a connection on %s: %s\n", address,
+          strerror(errno));
+        fflush(stdout);
+        resting = true;
+        continue;
+      }
+      TRACE_COUNT("connections", 1);
+      Connection* connection = new Connection;
+      connection->fd = c;
+      idle.push_back(connection);
+    }
+  }
+}
@@ -0,0 +1,69 @@
+/* server.h
+
+  Serving flooded grids. The grids are flooded once when slr starts and
+  kept in memory, and requests come in over a socket on this machine, so a
+  web front end or a script gets answers without reading and flooding the
+  grid again each time. Requests are handed to a pool of threads as they
+  come in, so clients that keep a connection open without asking anything
+  hold no thread; the grids never change once served, so the threads read
+  them without locks.
+
+  Requests are lines of words and every answer is one line of JSON:
+
+    grids                                   the grids, their sizes and land
+    stats <grid> <level>                    the flooded land at a sea level
+    point <grid> <row> <col>                the height of a point and the
+                                            sea level at which it floods
+    coord <grid> <x> <y>                    the same at map coordinates
+    mask <grid> <level> <row> <col> <rows> <cols>
+                                            which points of a window are
+                                            flooded, a string of 0s and 1s
+                                            per row
+
+  <grid> is the number of a grid, from 0, or its file name. Errors are
+  answered with {"error": "..."}.
+
+  A compact grid keeps its flooding heights as level codes (levelgrid.h)
+  and is read through a cache of tiles per thread. Its points flood at
+  the first level of the run at or above their flooding height, so stats
+  and masks between two levels are those of the lower one, and nothing
+  floods above the last level. A grid read from a .slrl file has no
+  terrain, and its points have no height.
+
+*/
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <string>
+#include <vector>
+#include "gridio.h"
+#include "levelgrid.h"
+#include "raster.h"
+
+//A flooded grid as served
+struct ServedGrid {
+  std::string name;
+  GridHeader h;
+  Raster<float> terrain;
+  //The lowest sea level at which each point floods: -1 for ocean and
+  //INFINITY for points that never flood
+  Raster<float> heights;
+  //The flooding heights of the land points that flood, sorted
+  std::vector<float> floodHeights;
+  long land;
+  //Set for a compact grid, which has its flooding heights in levels
+  //instead of heights and floodHeights
+  bool compact;
+  LevelGrid levels;
+};
+
+//Answers requests on address until the process is stopped. An address
+//with a '/' is the path of a Unix socket, which may replace a socket left
+//there but no other file; anything else is a TCP port, or host:port, on
+//localhost by default. Requests are answered by nthreads threads. Prints
+//a message and returns false if the socket cannot be opened.
+bool serveGrids(const char* address, const std::vector<ServedGrid>& grids,
+                int nthreads);
+
+#endif
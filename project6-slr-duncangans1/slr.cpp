@@ -29,30 +29,112 @@
 #else
 #include <GL/glut.h>
 #endif
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/resource.h>
 #include <vector>
 #include <queue>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <chrono>
+#include "gridio.h"
+#include "ascparse.h"
+#include "raster.h"
+#include "gridwrite.h"
+#include "ocean.h"
+#include "tiled.h"
+#include "mesh.h"
+#include "trace.h"
+#include "kernels.h"
+#include "basins.h"
+#include "server.h"
+#include "frames.h"
+#include "levelgrid.h"
+#include "engine.h"
+#include "batch.h"
 
 using namespace std; 
 
-//This queue represents the points that are between 0 and fIncerement feet 
-//in elevation
-queue<int>nextqueue;
-//This vector is filled with the terrain grid.
-vector<vector<float> > grid;
-//Check Grid is a grid of ints that categorizes the points on the grid. 
-//They are initially classified as ocean or land, but afterwards the land
-//points are labeled as the necessary height for them to flood (in the 
-//increment specified.)
-vector<vector<float> > checkGrid;
-//Grid that represents the completion of the grids.
-vector<vector<int> > completionGrid;
+//What the command line chooses for the flooding, and the flooded grid the
+//window shows, see engine.h
+FloodSettings settings = {0, 0, 0, false, true, 4, 1, -1, true};
+FloodRun run;
 
 //Necessary values. fIncrement is how specific the sea level rise by
 //feet should be. Seavis indicates how much you should be able to 
 //see below the surface (in feet).
-int rows, cols, increment, seavis;
-float maxz, feet, fIncrement, floorVal, ceiling, waterPoints, ndval;
-float initLand = 0;
+int increment, seavis;
+float feet, fIncrement, floorVal, ceiling;
+//Sea levels given with -levels. When there are any, one result grid is
+//written per level instead of one for the rise.
+vector<float> exportLevels;
+//Set with -minheight: where to write the minimum flooding height grid
+char* minHeightFile = NULL;
+//Set with -headless: no window, exit after the export with statistics
+bool headless = false;
+//Set with -stats: where to write the statistics as JSON, "-" for stdout
+char* statsFile = NULL;
+//Set with -bench: draw one frame, write the statistics with its time, and
+//exit. The statistics wait for the frame in statsOut, and the time of the
+//frame goes in renderTime.
+bool benchFrame = false;
+double renderTime = -1;
+FILE* statsOut = NULL;
+const char* statsInput = NULL;
+//Set with -batch: flood the tiles of this manifest instead, keeping them
+//under memoryLimit bytes (half the memory of the machine unless -memory
+//says otherwise)
+char* batchFile = NULL;
+long memoryLimit = 0;
+//Set with -tiled: flood out of core in tiles of this many points a side
+int tileSize = 0;
+//Set with -seeds: a grid whose points that are not 0 or NODATA are sources
+//of ocean, such as estuaries and inlets that do not reach the border. The
+//points go in the seeds of the run as ocean once the terrain is read.
+char* seedFile = NULL;
+//Set with -basins: where to write the basin tree for basinq, and the
+//seconds and number of basins it took
+char* basinFile = NULL;
+double basinTime = -1;
+long basinCount = 0;
+//Set with -serve: keep the flooded grids and answer requests on this
+//socket instead of opening a window. More grids are given with -add.
+char* serveAddress = NULL;
+vector<char*> extraGrids;
+vector<ServedGrid> served;
+//Set with -compact: served grids keep their flooding heights as level
+//codes, see levelgrid.h
+bool compactServe = false;
+//Set with -levelgrid: where to write the flooding heights as level codes,
+//and the seconds and bytes it took
+char* levelGridFile = NULL;
+double levelGridTime = -1;
+size_t levelGridSize = 0;
+//Set with -metrics: where to write the water and the islands at every
+//level, see writeMetrics()
+char* metricsFile = NULL;
+//Set with -frames: write a picture of the flooding at every increment from
+//the floor to the ceiling, named from this, and the seconds and number of
+//frames it took
+char* framePrefix = NULL;
+double frameTime = -1;
+long frameCount = 0;
+//Frames per second when playing the rise in the window with 'a', set with
+//-fps, and whether it is playing
+int fps = 10;
+bool playing = false;
+//When the next step of the playback is due, and which playback the timer
+//belongs to, so stopping and starting again does not leave two running
+double nextStep;
+int playback = 0;
+//The terrain and the flooding heights of a tiled run, read from disk
+GridFile demFile, heightFile;
+//The terrain on the graphics card. Set with -immediate, or when OpenGL 2.0
+//is missing, to draw with visGrid() on every frame instead.
+TerrainMesh mesh;
+bool useImmediate = false;
 
 const int WINDOWSIZE = 500; 
 
@@ -60,273 +142,53 @@ const int WINDOWSIZE = 500;
 //global translation and rotation
 GLfloat pos[3] = {0,0,0};
 GLfloat theta[3] = {0,0,0};
+//A sea level being typed in after 't', empty when not typing
+string typed;
+bool typing = false;
+//Where a mouse drag of the sea level started, and the sea level then
+int dragY;
+float dragFeet;
+bool dragging = false;
 
 /* forward declarations of functions */
 void display(void);
 void keypress(unsigned char key, int x, int y);
+void mousepress(int button, int state, int x, int y);
+void mousemove(int x, int y);
 void printDetails();
+void animate(int run);
 
 GLfloat xtoscreen(GLfloat x);
 GLfloat ztoscreen(GLfloat z);
 GLfloat ytoscreen(GLfloat y);
 
-void readGridfromFile (char * filename)
-{
-  //Creates grid from a given file. It also initializes some variables
-  FILE* f; 
-  char s[100]; 
-
-  f=fopen(filename, "r");
-  if (f== NULL) {
-     printf("cannot open files...");
-     exit(1);
-  }
-  
-  //Collecting the number of columns and rows for the grid details 
-  fscanf(f, "%s", s);
-  fscanf(f, "%d", &cols);
-  fscanf(f, "%s", s);
-  fscanf(f, "%d", &rows);
-
-  //Creates empty checkGrid and normal grid
-  for (int i = 0; i < rows; i++) {
-    vector<float> row;
-    for (int j = 0; j < cols; j++) {
-      row.push_back(0);
-    }
-    checkGrid.push_back(row);
-    grid.push_back(row);
-    row.clear();
-  }
-
-  //Scans past unecessary information
-  for (int i = 0; i < 4; i++)
-  {
-    fscanf(f, "%s", s); 
-    //Here I am just using ndval to indicate the second int, the last round
-    //it will actually set the value to the correct int
-    fscanf(f, "%f", &ndval);
-    //Continuing to move stuff into new file
-  }
-  printf("ndval = %f\n", ndval);
-  printf("ROWS: %d, COLS: %d\n", rows, cols);
-
-  //Puts all the values in the grid. And has checkgrid indicate 
-  //possible ocean or land
-  float newNum;
-  for (int i = 0; i < rows * cols; i++)
-  {
-    fscanf(f, "%f", &newNum);
-    grid[i/cols][i%cols] = newNum;
-    if (newNum == ndval || newNum <= 0) {
-      checkGrid[i/cols][i%cols] = -1;
-    }
-    else {
-      initLand += 1;
-      checkGrid[i/cols][i%cols] = 0;
-    }
-    if (newNum > maxz) {maxz = newNum;}
-  }
-}
-
-void clearCompletion() {
-  //Clears the completion grid for another flooding at a lower level
-  completionGrid.clear();
-  for (int i = 0; i < rows; i++) {
-    vector<int> introw;
-    for (int j = 0; j < cols; j++) {
-     introw.push_back(0);
-    }
-    completionGrid.push_back(introw);
-
-    introw.clear();
-  }
-}
-
-void floodUp(queue<int> cqueue) {
-  //This takes a queue of points that are on the coastline. It checks to see
-  //if they are below the current flood height, and continue a breadth first
-  //search to determine the rest of the points below the flood as well as
-  //the coastline for the next iteration at the higher height.
-  clock_t t3, t4;
-  t3 = clock();
-  queue<int> newqueue;
-  if (feet >= ceiling) {return;}
-  else {
-	  while (!cqueue.empty()) {
-	    int i = cqueue.front()/cols;
-	    int j = cqueue.front()%cols;
-	    cqueue.pop();
-	    if (grid[i][j] <= feet) {
-	      //If it's not ocean, but is floodable, set it to the current
-	      //height, and add the points around it to the queue.
-	      checkGrid[i][j] = feet;
-	      if (j<cols-1) {if (completionGrid[i][j+1]==0){
-	        completionGrid[i][j+1]=1;
-	        cqueue.push(i*cols+(j+1));
-	      }}
-	      if (j>0) {if (completionGrid[i][j-1]==0){
-	        completionGrid[i][j-1]=1;
-	        cqueue.push(i*cols+(j-1));
-	      }}
-	      if (i<rows-1) {if (completionGrid[i+1][j]==0){
-	        completionGrid[i+1][j]=1;
-	        cqueue.push((i+1)*cols+j);
-	      }}
-	      if (i>0) {if (completionGrid[i-1][j]==0){
-	        completionGrid[i-1][j]=1;
-	        cqueue.push((i-1)*cols+j);
-	      }}
-	    }
-      //If it's on the coastline, add it to the next coast
-	    else {newqueue.push(i*cols+j);}
-	}
-  t4 = clock();
-  printf("Flooding of %f feet takes %f seconds\n", 
-    feet, (double)(t4-t3)/CLOCKS_PER_SEC);
-  fflush(stdout);
-	feet = feet+=fIncrement;
-	floodUp(newqueue);
-  }
-}
-
-void flood(int i, int j) {
-  //This function floods the terrain grid from a given edge point
-  //It creates a queue of ints that represent the coastline of the initial
-  //ocean. This is used in subsequent foodUp()s to incrementally rise the 
-  //sea level
-  completionGrid[i][j] = 1;
-  queue<int> myqueue;
-  myqueue.push(i*cols+j);
-  while (!myqueue.empty()) {
-    //Initializes I and J from the queue's front point
-    i = myqueue.front()/cols;
-    j = myqueue.front()%cols;
-    myqueue.pop();
-    if (checkGrid[i][j] == -1 || grid[i][j] <= 0) {
-      //If it's ocean, add untouched points around it to the grid
-      if (j<cols-1) {if (completionGrid[i][j+1]==0){
-        completionGrid[i][j+1]=1;
-        myqueue.push(i*cols+(j+1));
-      }}
-      if (j>0) {if (completionGrid[i][j-1]==0){
-      completionGrid[i][j-1]=1;
-      myqueue.push(i*cols+(j-1));
-      }}
-      if (i<rows-1) {if (completionGrid[i+1][j]==0){
-        completionGrid[i+1][j]=1;
-        myqueue.push((i+1)*cols+j);
-      }}
-      if (i>0) {if (completionGrid[i-1][j]==0){
-        completionGrid[i-1][j]=1;
-        myqueue.push((i-1)*cols+j);
-      }}
-    }
-    else if (grid[i][j] <= 0 && checkGrid[i][j] != -1) {
-      //If it's not ocean, but is floodable, set it to the current
-      //height, and add the points around it to the queue.
-      checkGrid[i][j] = 0;
-      if (j<cols-1) {if (completionGrid[i][j+1]==0){
-        completionGrid[i][j+1]=1;
-        myqueue.push(i*cols+(j+1));
-      }}
-      if (j>0) {if (completionGrid[i][j-1]==0){
-        completionGrid[i][j-1]=1;
-        myqueue.push(i*cols+(j-1));
-      }}
-      if (i<rows-1) {if (completionGrid[i+1][j]==0){
-        completionGrid[i+1][j]=1;
-        myqueue.push((i+1)*cols+j);
-      }}
-      if (i>0) {if (completionGrid[i-1][j]==0){
-        completionGrid[i-1][j]=1;
-        myqueue.push((i-1)*cols+j);
-      }}
-    }
-    else {nextqueue.push(i*cols+j);}
-  }
-}
-
-
-
-void slr() {
-  //Go around border and if there's a point that is ocean, flood from
-  //that point if it hasn't been touched yet.
-  clock_t t3, t4;
-  t3 = clock();
-  for (int j = 0; j < cols; j++) {
-    if (checkGrid[0][j] == -1 && !completionGrid[0][j]) {
-      flood(0, j);
-    }
-    if (checkGrid[rows-1][j] == -1 && !completionGrid[rows-1][j]) {
-      flood(rows-1, j);
-    }
-  }
-  for (int i = 0; i < rows; i++) {
-    if (checkGrid[i][0] == -1 && !completionGrid[i][0]) {
-      flood(i, 0);
-    }
-    if (checkGrid[i][cols-1] == -1 && !completionGrid[i][cols-1]) {
-      flood(i, cols-1);
-    }
-  }
-  feet = feet += fIncrement;
-  t4 = clock();
-  printf("Finding ocean takes %f seconds\n", (double)(t4-t3)/CLOCKS_PER_SEC);
-  //Now that all the coast points are added to nextqueue, run the incremental
-  //flood algorithms on the coasline
-  floodUp(nextqueue);
-}
-
-void getColor(float height, int type) {
-  //This determines the color at an individual point.
-  float margin = height - feet;
-  if (type == 0 || type >= feet) {
-    //If it's above ground, change the color depending on the 
-    //elevation. This will create a topographical look.
-    if (margin < -maxz/30) {glColor3f(.9, .0, .0);}
-    else if (margin < 0) {glColor3f(.0, .2, .0);} 
-    else if (margin < maxz/70) {glColor3f(.1, .3, .2);}
-    else if (margin < maxz/45) {glColor3f(.1, .4, .3);}
-    else if (margin < maxz/25) {glColor3f(.1, .4, .3);}
-    else if (margin < maxz/10) {glColor3f(.2, .5, .4);}
-    else if (margin < 2*maxz/10) {glColor3f(.4, .6, .3);}
-    else if (margin < 3*maxz/10) {glColor3f(.6, .8, .3);}
-    else if (margin < 4*maxz/10) {glColor3f(.8, .9, .2);}
-    else if (margin < 5*maxz/10) {glColor3f(1, 1, .2);}
-    else if (margin < 6*maxz/10) {glColor3f(.9, .6, .2);}
-    else if (margin < 7*maxz/10) {glColor3f(.7, .4, .2);}
-    else if (margin < 8*maxz/10) {glColor3f(.6, .3, .1);}
-    else if (margin < 9*maxz/10) {glColor3f(.4, .1, .1);}
-    else {glColor3f(.3, .2, .1);}
-  }
-  //Otherwise, set the initial water to a deepish blue, and the
-  //flooded water zones to a scaled blue color to represent the
-  //Depth. This uses seavis as an option to determine how much
-  //below sea level should be visible. This can be changed at the
-  //command line.
-  else if (type == -1) {glColor3f(.1, .1, .9);}
-  else {
-    glColor3f(.1, (height+seavis - feet)/seavis - .1, .8);
-    waterPoints+=(increment * increment);
-  }
+void getColor(float height, float type) {
+  //This determines the color at an individual point. Land gets a
+  //topographical look from its elevation above the sea (the ramp is in
+  //mesh.cpp, so the terrain mesh uses the same colors), the initial water
+  //a deepish blue, and the flooded water zones a scaled blue color to
+  //represent the depth. seavis is how much below sea level should be
+  //visible, and can be changed at the command line. The colors are worked
+  //out in frames.cpp, so software frames match the window.
+  float c[3];
+  pointColour(height, type, feet, run.maxz, seavis, c);
+  glColor3f(c[0], c[1], c[2]);
 } 
-
 void createTriangles(int i, int j) {
   //Creates two triangles at a given I and J. Gets the color using get
   //color and sets the height either to the height of the ocean, or the
   //height of the land. Pretty straightforward.
-  getColor(grid[i][j], checkGrid[i][j]);
-  if (checkGrid[i][j] == 0 || checkGrid[i][j] > feet) {
+  getColor(run.grid(i, j), run.checkGrid(i, j));
+  if (run.checkGrid(i, j) == 0 || run.checkGrid(i, j) > feet) {
     glBegin(GL_POLYGON);
-    glVertex3f(ytoscreen(i), xtoscreen(j), ztoscreen(grid[i][j]));
-    glVertex3f(ytoscreen(i), xtoscreen(j+increment), ztoscreen(grid[i][j+increment]));
-    glVertex3f(ytoscreen(i+increment), xtoscreen(j), ztoscreen(grid[i+increment][j]));
+    glVertex3f(ytoscreen(i), xtoscreen(j), ztoscreen(run.grid(i, j)));
+    glVertex3f(ytoscreen(i), xtoscreen(j+increment), ztoscreen(run.grid(i, j+increment)));
+    glVertex3f(ytoscreen(i+increment), xtoscreen(j), ztoscreen(run.grid(i+increment, j)));
     glEnd();
     glBegin(GL_POLYGON);
-    glVertex3f(ytoscreen(i), xtoscreen(j), ztoscreen(grid[i][j]));
-    glVertex3f(ytoscreen(i-increment), xtoscreen(j), ztoscreen(grid[i-increment][j]));
-    glVertex3f(ytoscreen(i), xtoscreen(j-increment), ztoscreen(grid[i][j-increment]));
+    glVertex3f(ytoscreen(i), xtoscreen(j), ztoscreen(run.grid(i, j)));
+    glVertex3f(ytoscreen(i-increment), xtoscreen(j), ztoscreen(run.grid(i-increment, j)));
+    glVertex3f(ytoscreen(i), xtoscreen(j-increment), ztoscreen(run.grid(i, j-increment)));
     glEnd();
   }
   else {
@@ -344,14 +206,13 @@ void createTriangles(int i, int j) {
 }
 
 void visGrid(){
-  waterPoints = 0;
   //This function visualizes all of the grid. It does it by doing two
   //triangles at every point. One that goes from a point to [i+1][j] 
   //and [i][j+1], and another that goes from a point to [i-1][j] to
   //[i][j-1]
-  for (int i = increment; i < rows - increment - 1; i+=increment)
+  for (int i = increment; i < run.rows - increment - 1; i+=increment)
   {
-    for (int j = increment; j < cols - increment - 1; j+=increment)
+    for (int j = increment; j < run.cols - increment - 1; j+=increment)
     {
       createTriangles(i, j);
     }
@@ -361,33 +222,324 @@ void visGrid(){
 }
 
 
-void moveToFile(char * newfile, float initHeight) {
-  //Moves the grid into a renderable file. 
-  FILE*n;
-  n = fopen(newfile, "w");
-  //Fills in default info at start. For stuff that the value doesn't
-  //mattter, it is just set to ndval.
-  fprintf(n, "%s", "ncols");
-  fprintf(n, "%d\n", cols);
-  fprintf(n, "%s", "nrows");
-  fprintf(n, "%d\n", rows);
-  fprintf(n, "%s", "xllcorner");
-  fprintf(n, "%f\n", ndval);
-  fprintf(n, "%s", "yllcorner");
-  fprintf(n, "%f\n", ndval);
-  fprintf(n, "%s", "cellsize");
-  fprintf(n, "%f\n", ndval);
-  fprintf(n, "%s", "NODATA_value");
-  fprintf(n, "%f\n", ndval);
-  //Moves data from grid into the file.
-  for (int row = 0; row < rows; row++) {
-    for (int col = 0; col < cols; col++) {
-      if (checkGrid[row][col] >= initHeight || checkGrid[row][col] == 0) {
-        fprintf(n, "%f ", grid[row][col] - initHeight);
-      }
-      else {fprintf(n, "%d ", 0);}
+void writeBasinTree(const char* filename) {
+  //Builds the tree of basins and spill points of the terrain and writes it
+  //with the basin of every point, so basinq can answer questions about
+  //flooding without the grid. See basins.h.
+  TRACE_SCOPE("basin tree");
+  double w = wallTime();
+  BasinTree tree;
+  buildBasins(run.grid, run.header, run.seeds, settings.connectivity,
+    settings.nthreads, tree);
+  basinCount = tree.basins.size();
+  printf("Building %ld basins takes %f seconds\n", basinCount,
+    wallTime() - w);
+  printf("Writing %s\n", filename);
+  if (!writeBasins(filename, tree)) {exit(1);}
+  basinTime = wallTime() - w;
+}
+
+void writeLevels(const char* filename) {
+  //Packs the flooding heights into level codes and writes them, so a
+  //server can serve them again without the terrain
+  double w = wallTime();
+  LevelGrid g;
+  buildLevelGrid(run, g);
+  levelGridSize = levelGridBytes(g);
+  printf("Packing the flooding heights into %.1f MB (%.2f bits a point) "
+    "takes %f seconds\n", levelGridSize / 1048576.0,
+    8.0 * levelGridSize / ((double)run.rows * run.cols), wallTime() - w);
+  printf("Writing %s\n", filename);
+  if (!writeLevelGrid(filename, g)) {exit(1);}
+  levelGridTime = wallTime() - w;
+}
+
+vector<float> frameLevels() {
+  //The sea levels of an animation: the floor, every increment, and the
+  //ceiling, with the same float accumulation as buildLevels()
+  vector<float> at(1, floorVal);
+  at.insert(at.end(), run.levels.begin(), run.levels.end());
+  if (ceiling > at.back()) {at.push_back(ceiling);}
+  return at;
+}
+
+void writeAnimation(const char* prefix) {
+  //Writes a frame per level, one point per increment points like the
+  //window draws
+  double w = wallTime();
+  vector<float> at = frameLevels();
+  {
+    TRACE_SCOPE("frames");
+    frameCount = writeFrames(prefix, run.grid, run.checkGrid, increment, at,
+      run.maxz, seavis, settings.nthreads);
+  }
+  if (frameCount < 0) {exit(1);}
+  frameTime = wallTime() - w;
+  printf("Writing %ld frames from %s to %s takes %f seconds\n", frameCount,
+    frameName(prefix, 0).c_str(), frameName(prefix, frameCount - 1).c_str(),
+    frameTime);
+}
+
+void readTiledRows(int row, float* z, float* h) {
+  //Reads one row of the terrain and of the flooding heights of a tiled run
+  if (!readGridRow(demFile, row, 0, run.cols, z) ||
+      !readGridRow(heightFile, row, 0, run.cols, h)) {
+    printf("cannot read row %d of the tiled flooding\n", row);
+    exit(1);
+  }
+}
+
+void tiledResultRow(int row, float* out, void* arg) {
+  //resultRow() for a tiled run. The heights are classified the way
+  //priorityFlood() leaves them in checkGrid, so the grids come out the same.
+  float initHeight = *(float*)arg;
+  vector<float> h(run.cols);
+  readTiledRows(row, out, h.data());
+  for (int col = 0; col < run.cols; col++) {
+    float z = out[col];
+    if (h[col] < 0) {h[col] = -1;}
+    else if (isinf(h[col])) {h[col] = (z == run.ndval || z <= 0) ? -1 : 0;}
+  }
+  thresholdFlood(out, h.data(), run.cols, initHeight, run.ndval,
+    resultCutoff(run), out);
+}
+
+void tiledMinHeightRow(int row, float* out, void* arg) {
+  //minHeightRow() for a tiled run
+  vector<float> z(run.cols);
+  readTiledRows(row, z.data(), out);
+  for (int col = 0; col < run.cols; col++) {
+    if (isinf(out[col])) {out[col] = run.ndval;}
+  }
+}
+
+void writeJsonString(FILE* f, const char* s) {
+  fputc('"', f);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') {fputc('\\', f);}
+    if ((unsigned char)*s < 32) {fprintf(f, "\\u%04x", *s); continue;}
+    fputc(*s, f);
+  }
+  fputc('"', f);
+}
+
+void writeStats(FILE* f, const char* input) {
+  //Writes the run as JSON: the grid, the timings, and the flooded land at
+  //each exported level (or at each increment if there are none), with the
+  //part of it that floods in the last increment below that level
+  vector<float> at = exportLevels.empty() ? run.levels : exportLevels;
+  double cellArea = run.header.cellsize * run.header.cellsize;
+  fprintf(f, "{\n  \"input\": ");
+  writeJsonString(f, input);
+  fprintf(f, ",\n  \"rows\": %d,\n  \"cols\": %d,\n", run.rows, run.cols);
+  if (run.rows != run.gridRows || run.cols != run.gridCols) {
+    fprintf(f, "  \"window\": {\"row\": %d, \"col\": %d, \"grid_rows\": %d, "
+      "\"grid_cols\": %d},\n", run.firstRow, run.firstCol, run.gridRows,
+      run.gridCols);
+  }
+  fprintf(f, "  \"cellsize\": %.10g,\n", run.header.cellsize);
+  fprintf(f, "  \"engine\": \"%s\",\n",
+    settings.incremental ? "incremental" : "priority-flood");
+  fprintf(f, "  \"threads\": %d,\n", settings.nthreads);
+  fprintf(f, "  \"connectivity\": %d,\n", settings.connectivity);
+  fprintf(f, "  \"seed_cells\": %lu,\n", (unsigned long)run.seeds.size());
+  if (basinFile) {fprintf(f, "  \"basins\": %ld,\n", basinCount);}
+  if (framePrefix) {fprintf(f, "  \"frames\": %ld,\n", frameCount);}
+  if (levelGridFile) {
+    fprintf(f, "  \"level_grid_bytes\": %lu,\n", (unsigned long)levelGridSize);
+  }
+  fprintf(f, "  \"kernels\": \"%s\",\n", kernelName());
+  fprintf(f, "  \"land_cells\": %.0f,\n", run.initLand);
+  fprintf(f, "  \"timings\": {\"read\": %.6f, \"ocean\": %.6f, "
+    "\"flood\": %.6f, \"export\": %.6f, \"total\": %.6f", run.readTime,
+    run.oceanTime, run.floodTime, run.exportTime,
+    run.readTime + run.floodTime + run.exportTime);
+  if (renderTime >= 0) {fprintf(f, ", \"render\": %.6f", renderTime);}
+  if (basinTime >= 0) {fprintf(f, ", \"basins\": %.6f", basinTime);}
+  if (frameTime >= 0) {fprintf(f, ", \"frames\": %.6f", frameTime);}
+  if (levelGridTime >= 0) {
+    fprintf(f, ", \"level_grid\": %.6f", levelGridTime);
+  }
+  fprintf(f, "},\n");
+  //Points per second for every stage, each over the whole grid
+  double cells = (double)run.rows * run.cols;
+  fprintf(f, "  \"cells_per_second\": {\"read\": %.0f, \"ocean\": %.0f, "
+    "\"flood\": %.0f, \"export\": %.0f},\n",
+    run.readTime > 0 ? cells / run.readTime : 0,
+    run.oceanTime > 0 ? cells / run.oceanTime : 0,
+    run.floodTime > 0 ? cells / run.floodTime : 0,
+    run.exportTime > 0 ? cells / run.exportTime : 0);
+  //The most memory the process has had, in kilobytes
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  long peak = usage.ru_maxrss / 1024;
+#else
+  long peak = usage.ru_maxrss;
+#endif
+  fprintf(f, "  \"peak_rss_kb\": %ld,\n", peak);
+  fprintf(f, "  \"levels\": [");
+  for (size_t l = 0; l < at.size(); l++) {
+    long flooded = floodedCells(run, at[l]);
+    long newly = flooded - floodedCells(run, at[l] - fIncrement);
+    fprintf(f, "%s\n    {\"level\": %.9g, \"flooded_cells\": %ld, "
+      "\"flooded_area\": %.10g, \"flooded_fraction\": %.9g, "
+      "\"newly_flooded_cells\": %ld, \"newly_flooded_area\": %.10g}",
+      l ? "," : "", at[l], flooded, flooded * cellArea,
+      run.initLand > 0 ? flooded / run.initLand : 0, newly, newly * cellArea);
+  }
+  fprintf(f, "\n  ],\n  \"steps\": [");
+  //The levels floodUp() went through, only there with -incremental
+  for (size_t l = 0; l < run.steps.size(); l++) {
+    fprintf(f, "%s\n    {\"level\": %.9g, \"seconds\": %.6f, "
+      "\"flooded_cells\": %ld, \"coast_cells\": %ld}", l ? "," : "",
+      run.steps[l].level, run.steps[l].seconds, run.steps[l].flooded,
+      run.steps[l].coast);
+  }
+  fprintf(f, "%s]\n}\n", run.steps.empty() ? "" : "\n  ");
+}
+
+//Binary grids converted for a tiled run with -nocache, removed on exit
+vector<string> scratchGrids;
+
+void removeScratchGrids() {
+  for (size_t k = 0; k < scratchGrids.size(); k++) {
+    remove(scratchGrids[k].c_str());
+  }
+}
+
+string binaryGrid(const char* input) {
+  //The binary form of a grid, converted from the .asc file first if needed.
+  //With -nocache the conversion is a scratch file that does not outlive
+  //the run, and no cache is read or written.
+  if (isGridCache(input)) {return input;}
+  string binary = gridCachePath(input);
+  if (settings.useCache && gridCacheIsFresh(input, binary.c_str())) {
+    return binary;
+  }
+  if (!settings.useCache) {
+    string name = string(input) + ".XXXXXX";
+    int fd = mkstemp(&name[0]);
+    if (fd < 0) {
+      printf("cannot write a scratch grid next to %s\n", input);
+      exit(1);
     }
+    close(fd);
+    if (scratchGrids.empty()) {atexit(removeScratchGrids);}
+    scratchGrids.push_back(name);
+    binary = name;
   }
+  printf("Converting %s to %s\n", input, binary.c_str());
+  if (!convertAscToCache(input, binary.c_str())) {exit(1);}
+  return binary;
+}
+
+void tiledRun(char* input, char* output) {
+  //Floods a grid too big for memory, see tiled.h. The terrain and the
+  //seeds are used in their binary form, and the flooding heights go to a
+  //binary grid on disk that the exports read row by row.
+  double w = wallTime();
+  string dem = binaryGrid(input);
+  string seedGrid = seedFile ? binaryGrid(seedFile) : string();
+  if (!openGridFile(dem.c_str(), demFile, false)) {
+    printf("cannot read grid cache %s\n", dem.c_str());
+    exit(1);
+  }
+  run.header = demFile.h;
+  run.cols = run.header.ncols;
+  run.rows = run.header.nrows;
+  run.ndval = run.header.ndval;
+  printf("ROWS: %d, COLS: %d\n", run.rows, run.cols);
+  run.readTime = wallTime() - w;
+
+  //A binary -minheight grid is written by the flooding itself, anything
+  //else is converted from a scratch file next to the terrain
+  size_t n = minHeightFile ? strlen(minHeightFile) : 0;
+  bool direct = n >= 5 && strcmp(minHeightFile + n - 5, ".slrg") == 0;
+  string heights = direct ? string(minHeightFile) : dem + ".heights";
+  w = wallTime();
+  if (!tiledFlood(dem.c_str(), seedFile ? seedGrid.c_str() : NULL,
+      heights.c_str(), tileSize, settings.connectivity, settings.nthreads)) {
+    exit(1);
+  }
+  run.floodTime = wallTime() - w;
+  printf("Tiled flooding takes %f seconds\n", run.floodTime);
+
+  w = wallTime();
+  if (!openGridFile(heights.c_str(), heightFile, false)) {
+    printf("cannot read %s\n", heights.c_str());
+    exit(1);
+  }
+  vector<float> at = exportLevels;
+  if (at.empty()) {at.push_back(ceiling);}
+  if (!output) {at.clear();}
+  for (size_t l = 0; l < at.size(); l++) {
+    string name = exportLevels.empty() ? string(output)
+      : levelFileName(output, at[l]);
+    printf("Writing %s\n", name.c_str());
+    if (!writeGrid(name.c_str(), run.header, tiledResultRow, &at[l],
+        settings.precision, settings.nthreads)) {
+      exit(1);
+    }
+  }
+  if (minHeightFile && !direct && !writeGrid(minHeightFile, run.header,
+      tiledMinHeightRow, NULL, settings.precision, settings.nthreads)) {
+    exit(1);
+  }
+  closeGridFile(heightFile);
+  closeGridFile(demFile);
+  if (!direct) {remove(heights.c_str());}
+  run.exportTime = wallTime() - w;
+  printf("Exporting takes %f seconds\n", run.exportTime);
+}
+
+void keepServedGrid(const char* input) {
+  //Moves the flooded grid into served, with checkGrid turned into the
+  //lowest sea level at which each point floods, or packed into level codes
+  //with -compact
+  ServedGrid g;
+  const char* slash = strrchr(input, '/');
+  g.name = slash ? slash + 1 : input;
+  g.h = run.header;
+  g.land = run.initLand;
+  g.compact = compactServe;
+  if (compactServe) {
+    buildLevelGrid(run, g.levels);
+    printf("Serving %s with its flooding heights in %.1f MB\n",
+      g.name.c_str(), levelGridBytes(g.levels) / 1048576.0);
+    g.terrain = move(run.grid);
+    run.checkGrid.clear();
+    vector<float>().swap(run.floodHeights);
+    served.push_back(move(g));
+    return;
+  }
+  size_t n = run.checkGrid.size();
+  for (size_t k = 0; k < n; k++) {
+    float h = run.checkGrid[k];
+    if (h == 0 || (h == -1 && !run.completionGrid[k])) {
+      run.checkGrid[k] = INFINITY;
+    }
+  }
+  g.terrain = move(run.grid);
+  g.heights = move(run.checkGrid);
+  g.floodHeights.swap(run.floodHeights);
+  served.push_back(move(g));
+}
+
+bool keepLevelGrid(const char* input) {
+  //Serves a .slrl file written with -levelgrid as it is, without the
+  //terrain. Returns false for any other grid, which is flooded instead.
+  size_t length = strlen(input);
+  if (length < 5 || strcmp(input + length - 5, ".slrl") != 0) {return false;}
+  ServedGrid g;
+  if (!readLevelGrid(input, g.levels)) {exit(1);}
+  const char* slash = strrchr(input, '/');
+  g.name = slash ? slash + 1 : input;
+  g.h = g.levels.h;
+  g.land = g.levels.land;
+  g.compact = true;
+  served.push_back(move(g));
+  return true;
 }
 
 int main(int argc, char** argv) {
@@ -399,50 +551,294 @@ int main(int argc, char** argv) {
   // get put in a stack for the next iteration with the feet a little higher. 
   //To do this, it is constantly keeping track of the coastline.
 
+  //Options start with a '-' followed by a letter and can go anywhere on
+  //the command line. Everything else is a positional argument.
+  vector<char*> args;
+  char* named[5] = {NULL, NULL, NULL, NULL, NULL};
+  settings.nthreads = thread::hardware_concurrency();
+  if (settings.nthreads < 1) {settings.nthreads = 1;}
+  for (int a = 0; a < argc; a++) {
+    if (a > 0 && argv[a][0] == '-' && isalpha(argv[a][1])) {
+      if (strcmp(argv[a], "-incremental") == 0) {settings.incremental = true;}
+      else if (strcmp(argv[a], "-nocache") == 0) {settings.useCache = false;}
+      else if (strcmp(argv[a], "-levels") == 0 && a+1 < argc) {
+        parseLevels(argv[++a], exportLevels);
+      }
+      else if (strcmp(argv[a], "-minheight") == 0 && a+1 < argc) {
+        minHeightFile = argv[++a];
+      }
+      else if (strcmp(argv[a], "-precision") == 0 && a+1 < argc) {
+        settings.precision = atoi(argv[++a]);
+      }
+      else if (strcmp(argv[a], "-headless") == 0) {headless = true;}
+      else if (strcmp(argv[a], "-immediate") == 0) {useImmediate = true;}
+      else if (strcmp(argv[a], "-bench") == 0) {benchFrame = true;}
+      else if (strcmp(argv[a], "-simd") == 0 && a+1 < argc) {
+        if (!useKernels(argv[++a])) {
+          printf("cannot use %s kernels, using %s\n", argv[a], kernelName());
+        }
+      }
+      else if (strcmp(argv[a], "-trace") == 0 && a+1 < argc) {
+        if (!traceOpen(argv[++a])) {exit(1);}
+      }
+      else if (strcmp(argv[a], "-stats") == 0 && a+1 < argc) {
+        statsFile = argv[++a];
+      }
+      else if (strcmp(argv[a], "-connect") == 0 && a+1 < argc) {
+        settings.connectivity = atoi(argv[++a]);
+        if (settings.connectivity != 4 && settings.connectivity != 8) {
+          printf("-connect must be 4 or 8\n");
+          exit(1);
+        }
+      }
+      else if (strcmp(argv[a], "-seeds") == 0 && a+1 < argc) {
+        seedFile = argv[++a];
+      }
+      else if (strcmp(argv[a], "-basins") == 0 && a+1 < argc) {
+        basinFile = argv[++a];
+      }
+      else if (strcmp(argv[a], "-serve") == 0 && a+1 < argc) {
+        serveAddress = argv[++a];
+        headless = true;
+      }
+      else if (strcmp(argv[a], "-frames") == 0 && a+1 < argc) {
+        framePrefix = argv[++a];
+        headless = true;
+      }
+      else if (strcmp(argv[a], "-fps") == 0 && a+1 < argc) {
+        fps = max(1, atoi(argv[++a]));
+      }
+      else if (strcmp(argv[a], "-add") == 0 && a+1 < argc) {
+        extraGrids.push_back(argv[++a]);
+      }
+      else if (strcmp(argv[a], "-compact") == 0) {compactServe = true;}
+      else if (strcmp(argv[a], "-levelgrid") == 0 && a+1 < argc) {
+        levelGridFile = argv[++a];
+      }
+      else if (strcmp(argv[a], "-metrics") == 0 && a+1 < argc) {
+        metricsFile = argv[++a];
+        settings.metrics = true;
+      }
+      else if (strcmp(argv[a], "-window") == 0 && a+4 < argc) {
+        settings.window.points = true;
+        settings.window.row = atoi(argv[++a]);
+        settings.window.col = atoi(argv[++a]);
+        settings.window.rows = atoi(argv[++a]);
+        settings.window.cols = atoi(argv[++a]);
+      }
+      else if (strcmp(argv[a], "-bbox") == 0 && a+4 < argc) {
+        settings.window.bbox = true;
+        settings.window.xmin = atof(argv[++a]);
+        settings.window.ymin = atof(argv[++a]);
+        settings.window.xmax = atof(argv[++a]);
+        settings.window.ymax = atof(argv[++a]);
+      }
+      else if (strcmp(argv[a], "-batch") == 0 && a+1 < argc) {
+        batchFile = argv[++a];
+        headless = true;
+      }
+      else if (strcmp(argv[a], "-memory") == 0 && a+1 < argc) {
+        memoryLimit = atol(argv[++a]) << 20;
+      }
+      else if (strcmp(argv[a], "-tiled") == 0 && a+1 < argc) {
+        tileSize = atoi(argv[++a]);
+        headless = true;
+      }
+      else if (strcmp(argv[a], "-in") == 0 && a+1 < argc) {named[0] = argv[++a];}
+      else if (strcmp(argv[a], "-out") == 0 && a+1 < argc) {named[1] = argv[++a];}
+      else if (strcmp(argv[a], "-rise") == 0 && a+1 < argc) {named[2] = argv[++a];}
+      else if (strcmp(argv[a], "-inc") == 0 && a+1 < argc) {named[3] = argv[++a];}
+      else if (strcmp(argv[a], "-threads") == 0 && a+1 < argc) {
+        settings.nthreads = atoi(argv[++a]);
+        if (settings.nthreads < 1) {settings.nthreads = 1;}
+      }
+      else {
+        printf("unknown option %s\n", argv[a]);
+        exit(1);
+      }
+    }
+    else {args.push_back(argv[a]);}
+  }
+
+  //-in, -out, -rise and -inc stand in for the positional arguments. In
+  //headless mode the result grid may be left out, or given as - like in a
+  //batch manifest.
+  args.resize(max(args.size(), (size_t)5), (char*)NULL);
+  for (int k = 0; k < 4; k++) {
+    if (named[k]) {args[k+1] = named[k];}
+  }
+  if (args[2] && strcmp(args[2], "-") == 0) {args[2] = NULL;}
+  //A batch takes the grids from its manifest
+  bool missing = !args[3] || !args[4] ||
+    (!batchFile && (!args[1] || (!args[2] && !headless)));
+  if ((!extraGrids.empty() || compactServe) && !serveAddress) {
+    printf("-add and -compact need -serve\n");
+    exit(1);
+  }
+  bool windowed = settings.window.points || settings.window.bbox;
+  if (settings.window.points && settings.window.bbox) {
+    printf("-window and -bbox cannot be used together\n");
+    exit(1);
+  }
+  //The basin tree has no open sides: the ocean reaches it only from the
+  //border of the grid
+  if (windowed && basinFile) {
+    printf("-basins cannot be used with -window or -bbox\n");
+    exit(1);
+  }
+
   //read number of points from user
-  if (argc<5 || argc>6) {
-    printf("usage: %s file.txt file.txt height range increment\n", argv[0]);
+  if (missing || args.size()>6) {
+    printf("usage: %s <terrain grid> <result grid> <rise> <increment> "
+      "[underwater visibility] [-incremental] [-nocache] [-threads n] "
+      "[-levels a,b,c:d:step] [-minheight grid] [-precision n] "
+      "[-headless] [-stats file] [-tiled size] [-immediate] [-bench] [-trace file] [-simd avx2|sse2|scalar] "
+      "[-connect 4|8] [-seeds grid] [-basins file] [-serve address] "
+      "[-add grid] [-compact] [-levelgrid file] [-frames prefix] [-fps n] "
+      "[-batch manifest] [-memory mb] [-window row col rows cols] "
+      "[-bbox xmin ymin xmax ymax] [-metrics file]\n", argv[0]);
     exit(1); 
   }
 
+  //With the statistics going to stdout, everything else is sent to
+  //stderr so the JSON can be piped straight into another program
+  FILE* stats = NULL;
+  if (statsFile && strcmp(statsFile, "-") == 0) {
+    fflush(stdout);
+    stats = fdopen(dup(1), "w");
+    dup2(2, 1);
+  }
+  else if (statsFile) {
+    stats = fopen(statsFile, "w");
+    if (stats == NULL) {
+      printf("cannot open %s\n", statsFile);
+      exit(1);
+    }
+  }
+
   //If entered, seavis is set to the value. Otherwise is 10 feet
-  if (argc<6) {seavis = 10;}
-  else {seavis = atoi(argv[5]);}
+  if (args.size()<6) {seavis = 10;}
+  else {seavis = atoi(args[5]);}
+
+  fIncrement = atof(args[4]);
+  ceiling = atof(args[3]);
+  if (fIncrement <= 0) {
+    printf("increment must be positive\n");
+    exit(1);
+  }
+  //The flooding has to reach the highest level that is exported
+  for (size_t l = 0; l < exportLevels.size(); l++) {
+    if (exportLevels[l] >= ceiling) {ceiling = exportLevels[l] + fIncrement;}
+  }
+
+  settings.floor = floorVal;
+  settings.ceiling = ceiling;
+  settings.increment = fIncrement;
+  startRun(run, settings);
+
+  //A batch floods every tile of the manifest with these settings and
+  //writes its own statistics
+  if (batchFile) {
+    if (tileSize > 0 || basinFile || serveAddress || framePrefix ||
+        seedFile || minHeightFile || benchFrame || levelGridFile ||
+        metricsFile || windowed) {
+      printf("-batch takes seeds, minimum heights and metrics per tile in "
+        "the manifest, and cannot be used with -tiled, -basins, -serve, "
+        "-frames, -levelgrid, -window, -bbox or -bench\n");
+      exit(1);
+    }
+    if (memoryLimit <= 0) {
+      memoryLimit = sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGE_SIZE) / 2;
+    }
+    bool ok = runBatch(batchFile, settings, exportLevels, memoryLimit,
+      settings.nthreads, stats);
+    if (stats) {fclose(stats);}
+    fflush(stdout);
+    return ok ? 0 : 1;
+  }
+
+  //A tiled run never has the grid in memory, so it has no window and
+  //no statistics
+  if (tileSize > 0) {
+    if (stats) {
+      printf("-stats cannot be used with -tiled\n");
+      exit(1);
+    }
+    if (settings.incremental) {
+      printf("-tiled always uses priority flooding\n");
+    }
+    if (basinFile || serveAddress || framePrefix || levelGridFile ||
+        metricsFile || windowed) {
+      printf("-basins, -serve, -frames, -levelgrid, -metrics, -window and "
+        "-bbox need the grid in memory and cannot be used with -tiled\n");
+      exit(1);
+    }
+    buildLevels(run);
+    tiledRun(args[1], args[2]);
+    fflush(stdout);
+    return 0;
+  }
 
   //Grid is red, and variables are read from command line.
-  printf("Has begun reading file\n");
-  clock_t t1, t2;
-  t1 = clock();
-  readGridfromFile(argv[1]); 
-  t2 = clock();
-  printf("Finished reading file\n");
-  printf("Reading file takes %f seconds\n", (double)(t2-t1)/CLOCKS_PER_SEC);
-  fIncrement = atof(argv[4]);
-  ceiling = atof(argv[3]);
+  if (!readTerrain(run, args[1], seedFile)) {exit(1);}
 
   //Although the precision of the grid is always 1. The visualization
   //resolution changes depending on the size of the grid. This makes it
   //so you can change the sea level, or rotate the grid without having
   //to wait.
-  if ((rows+cols)/2 < 1000) {increment = 1;}
-  else if ((rows+cols)/2 < 5000) {increment = 5;}
-  else if ((rows+cols)/2 < 15000) {increment = 20;}
-  else if ((rows+cols)/2 < 25000) {increment = 50;}
+  if ((run.rows+run.cols)/2 < 1000) {increment = 1;}
+  else if ((run.rows+run.cols)/2 < 5000) {increment = 5;}
+  else if ((run.rows+run.cols)/2 < 15000) {increment = 20;}
+  else if ((run.rows+run.cols)/2 < 25000) {increment = 50;}
   else {increment = 100;}
 
 
-  feet = floorVal;
-  clearCompletion();
-  t1 = clock();
-  slr();
-  t2 = clock();
-  printf("Running %f iterations of sea level rise takes %f seconds\n", 
-  	ceiling/fIncrement, (double)(t2-t1)/CLOCKS_PER_SEC);
-  printf("Or approximately %f seconds per iteration\n", 
-  	((double)(t2-t1)/CLOCKS_PER_SEC)/ceiling);
-  fflush(stdout);
-  //Floods it at 0, so users can see what it looks like with no flooding.
-  moveToFile(argv[2], ceiling);
+  floodTerrain(run);
+  feet = run.feet;
+  //Everything below comes from the one flooding above: a result grid for
+  //the rise or for each requested level, and the flooding heights.
+  double w = wallTime();
+  if (exportLevels.empty() && args[2] && !writeResult(run, args[2], ceiling)) {
+    exit(1);
+  }
+  for (size_t l = 0; args[2] && l < exportLevels.size(); l++) {
+    string name = levelFileName(args[2], exportLevels[l]);
+    printf("Writing %s\n", name.c_str());
+    if (!writeResult(run, name.c_str(), exportLevels[l])) {exit(1);}
+  }
+  if (minHeightFile && !writeMinHeight(run, minHeightFile)) {exit(1);}
+  if (metricsFile && !writeMetrics(run, metricsFile)) {exit(1);}
+  run.exportTime = wallTime() - w;
+  if (basinFile) {writeBasinTree(basinFile);}
+  if (levelGridFile) {writeLevels(levelGridFile);}
+  if (framePrefix) {writeAnimation(framePrefix);}
+  if (stats && (!benchFrame || headless)) {
+    writeStats(stats, args[1]);
+    fclose(stats);
+  }
+  statsOut = stats;
+  statsInput = args[1];
+  //A server keeps every grid flooded in memory and never returns
+  if (serveAddress) {
+    keepServedGrid(args[1]);
+    //The seeds and the metrics belong to the first grid
+    seedFile = NULL;
+    settings.metrics = false;
+    for (size_t g = 0; g < extraGrids.size(); g++) {
+      if (keepLevelGrid(extraGrids[g])) {continue;}
+      startRun(run, settings);
+      if (!readTerrain(run, extraGrids[g], seedFile)) {exit(1);}
+      floodTerrain(run);
+      keepServedGrid(extraGrids[g]);
+    }
+    fflush(stdout);
+    if (!serveGrids(serveAddress, served, settings.nthreads)) {exit(1);}
+  }
+  //Batch runs stop here, without ever opening a window
+  if (headless) {
+    fflush(stdout);
+    return 0;
+  }
   /* OPEN GL STUFF */
   /* open a window and initialize GLUT stuff */
   glutInit(&argc, argv);
@@ -455,6 +851,8 @@ int main(int argc, char** argv) {
   /* register callback functions */
   glutDisplayFunc(display); 
   glutKeyboardFunc(keypress);
+  glutMouseFunc(mousepress);
+  glutMotionFunc(mousemove);
   
   /* OpenGL init */
   /* set background color black*/
@@ -472,7 +870,15 @@ int main(int argc, char** argv) {
 
   //initialize rotation to look at it from above 
   theta[0] = -45; 
-  visGrid();
+
+  //The terrain mesh picks its own detail from the view
+  if (!useImmediate) {
+    if (!buildTerrainMesh(mesh, run.grid, run.checkGrid)) {
+      printf("Drawing in immediate mode instead\n");
+      useImmediate = true;
+    }
+  }
+  if (useImmediate) {visGrid();}
   /* start the event handler */
   glutMainLoop();
 
@@ -480,9 +886,18 @@ int main(int argc, char** argv) {
 }
 
 void printDetails() {
+  //The flooded land is a binary search in the sorted flooding heights, so
+  //it is exact at any sea level up to the last of the run, as the result
+  //grid has it, and costs nothing to look up
+  long flooded = floodedCells(run, feet);
+  long newly = flooded - floodedCells(run, feet - fIncrement);
+  double cellArea = run.header.cellsize * run.header.cellsize;
   printf("At %f feet:\n", feet);
-  printf("Aproximately %f percent of the original land is flooded\n",
-   (waterPoints/initLand)*100);
+  printf("%ld points (area %g) of the original land are flooded, %ld (area "
+    "%g) of them in the last %f feet\n", flooded, flooded * cellArea, newly,
+    newly * cellArea, fIncrement);
+  printf("%f percent of the original land is flooded\n",
+   run.initLand > 0 ? (flooded/run.initLand)*100 : 0);
 }
 
 /* this function is called whenever the window needs to be rendered */
@@ -510,16 +925,83 @@ void display(void) {
   glRotatef(theta[2], 0,0,1);
   
   //Visualizes the current grid
-  visGrid();
+  TRACE_SCOPE("frame");
+  double w = wallTime();
+  if (useImmediate) {visGrid();}
+  else {
+    drawTerrainMesh(mesh, feet, run.maxz, seavis);
+    TRACE_SAMPLE("chunks drawn", mesh.drawn);
+    printDetails();
+  }
   glFlush();
+  //A benchmark stops after the first frame has been drawn
+  if (benchFrame) {
+    glFinish();
+    renderTime = wallTime() - w;
+    if (statsOut) {
+      writeStats(statsOut, statsInput);
+      fclose(statsOut);
+    }
+    exit(0);
+  }
 }
 
 
 
 
 /* this function is called whenever  key is pressed */
+void setFeet(float f) {
+  //Moves the sea level to f, kept within the flooded range. Every point
+  //holds the height it floods at, so any level draws right away.
+  feet = max(floorVal, min(ceiling, f));
+  glutPostRedisplay();
+}
+
+void animate(int run) {
+  //Raises the sea level one increment per step while playing. Each step
+  //is timed from when the last one was due, so the frame rate stays
+  //steady whatever a frame takes to draw, and playback stops at the
+  //ceiling. The mesh draws any level without going over the grid.
+  if (!playing || run != playback) {return;}
+  if (feet + fIncrement > ceiling) {
+    playing = false;
+    return;
+  }
+  setFeet(feet + fIncrement);
+  nextStep += 1.0 / fps;
+  double wait = nextStep - wallTime();
+  //A playback that falls behind carries on from now rather than rushing
+  if (wait < 0) {
+    nextStep -= wait;
+    wait = 0;
+  }
+  glutTimerFunc((unsigned)(wait * 1000), animate, run);
+}
+
+void typeLevel(unsigned char key) {
+  //Collects a typed sea level. Enter sets it, escape gives up.
+  if (key == '\r' || key == '\n') {
+    typing = false;
+    if (!typed.empty()) {setFeet(atof(typed.c_str()));}
+    return;
+  }
+  if (key == 27) {
+    typing = false;
+    printf("\n");
+    return;
+  }
+  if ((key == 8 || key == 127) && !typed.empty()) {typed.erase(typed.size()-1);}
+  else if (isdigit(key) || key == '.' || key == '-') {typed += key;}
+  printf("\rSea level: %s ", typed.c_str());
+  fflush(stdout);
+}
+
 void keypress(unsigned char key, int x, int y) {
 
+  if (typing) {
+    typeLevel(key);
+    return;
+  }
   switch(key) {
   case '+':
     //Raises sea level rise by one foot increment (can be changed)
@@ -531,6 +1013,31 @@ void keypress(unsigned char key, int x, int y) {
     if (feet - fIncrement >= floorVal) {feet -= fIncrement;}
     glutPostRedisplay();
     break;
+  case 'a':
+    //Plays the rise from here to the ceiling, or from the floor when it is
+    //already there, at -fps frames per second. 'a' again stops it.
+    playing = !playing;
+    if (playing) {
+      if (feet + fIncrement > ceiling) {setFeet(floorVal);}
+      nextStep = wallTime();
+      glutTimerFunc(1000 / fps, animate, ++playback);
+    }
+    break;
+  case 'p': {
+    //Writes a picture of the flooding at this sea level from above
+    Frame f;
+    renderFrame(run.grid, run.checkGrid, increment, feet, run.maxz, seavis, f);
+    string name = levelFileName("slr.png", feet);
+    if (writeFrame(name.c_str(), f)) {printf("Wrote %s\n", name.c_str());}
+    break;
+  }
+  case 't':
+    //Type in a sea level, ended with enter
+    typing = true;
+    typed.clear();
+    printf("Sea level: ");
+    fflush(stdout);
+    break;
   case '0':
     //if (feet) {feet = 0;}
     //else {feet = checkHeight;}
@@ -628,21 +1135,38 @@ void keypress(unsigned char key, int x, int y) {
   } 
 }//keypress
 
+/* this function is called whenever a mouse button is pressed or released */
+void mousepress(int button, int state, int x, int y) {
+  //Dragging with the left button moves the sea level
+  if (button != GLUT_LEFT_BUTTON) {return;}
+  dragging = (state == GLUT_DOWN);
+  dragY = y;
+  dragFeet = feet;
+}
+
+/* this function is called whenever the mouse moves with a button down */
+void mousemove(int x, int y) {
+  //Dragging up the whole window raises the sea level from the floor to
+  //the ceiling
+  if (!dragging) {return;}
+  setFeet(dragFeet + (dragY - y) * (ceiling - floorVal) / WINDOWSIZE);
+}
+
 GLfloat xtoscreen(GLfloat x) {
   //return (-1 + 2*x/WINDOWSIZE); 
   //printf("X: %f", -1 + 2*(x)/(cols));
-  return -1 + 2*(x)/(double)cols;
+  return -1 + 2*(x)/(double)run.cols;
 }
 
 /* y is a value in [miny, maxy]; it is mapped to [-1,1] */
 GLfloat ytoscreen(GLfloat y) {
-  return -1 + 2*(y/(double)rows);
+  return -1 + 2*(y/(double)run.rows);
 }
 
 /* z is a value in [minz, maxz]; it is mapped so that [0, maxz] map to [0,1] */
 GLfloat ztoscreen(GLfloat z) {
 	if(z < -99) {return 0;}
-	return (z/maxz)/5;
+	return (z/run.maxz)/5;
 }
 
 
@@ -0,0 +1,437 @@
+/* tiled.cpp
+
+  Out-of-core priority flooding, see tiled.h. Perimeter points of a tile
+  are numbered in row-major order, which perimeterIndex() computes
+  directly, and every perimeter point of the grid is a node of the graph
+  at nodeBase[tile] plus that number.
+
+  Within a tile, the label of a point is the perimeter point it is flooded
+  from, and its level is the lowest highest point on a path from there.
+  Where labels a and b touch, a path from a to b exists whose highest
+  point is the larger of the two levels, and every path from a to b in the
+  tile crosses such a place at or below its own highest point. So keeping
+  the lowest join of each pair loses nothing, and the graph gives the same
+  levels on the perimeter as the whole grid would.
+
+  Seeds inside a tile all get one more label, the ocean, which is a single
+  node of the graph after all the perimeter points. With 8 neighbours,
+  points of two tiles that touch diagonally are linked as well.
+
+*/
+
+#include "tiled.h"
+#include "gridio.h"
+#include "raster.h"
+#include "trace.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+typedef pair<float, int> Cell;
+//A node of the graph of all perimeter points and its level. There can be
+//more nodes than an int holds on a big grid cut into small tiles.
+typedef pair<float, long> Node;
+
+//A join between nodes a and b of the graph at level w
+struct Join {
+  long a, b;
+  float w;
+};
+
+//What the first pass keeps of a tile: the heights of its perimeter, the
+//joins between its perimeter points (and the ocean, numbered after them),
+//and the perimeter points that are seeds
+struct TileGraph {
+  vector<float> perimeter;
+  vector<Join> joins;
+  vector<int> sources;
+};
+
+struct Tiling {
+  GridFile dem, seeds;
+  bool seeded;
+  int rows, cols, tile;
+  int tileRows, tileCols;
+  int connectivity;
+};
+
+static void tileBounds(const Tiling& g, int t, int& r0, int& c0, int& nr,
+                       int& nc) {
+  r0 = (t / g.tileCols) * g.tile;
+  c0 = (t % g.tileCols) * g.tile;
+  nr = min(g.tile, g.rows - r0);
+  nc = min(g.tile, g.cols - c0);
+}
+
+static int perimeterSize(int nr, int nc) {
+  if (nr <= 2 || nc <= 2) {return nr*nc;}
+  return 2*nc + 2*(nr-2);
+}
+
+static bool onPerimeter(int nr, int nc, int i, int j) {
+  return i == 0 || i == nr-1 || j == 0 || j == nc-1;
+}
+
+//Number of perimeter point (i, j) of an nr by nc tile
+static int perimeterIndex(int nr, int nc, int i, int j) {
+  if (i == 0) {return j;}
+  if (i == nr-1) {return perimeterSize(nr, nc) - nc + j;}
+  if (nc <= 2) {return i*nc + j;}
+  return nc + 2*(i-1) + (j == 0 ? 0 : 1);
+}
+
+//Reads the heights of a tile, with ocean and NODATA as -1 like in
+//priorityFlood(). The seeds are -1 too and set in source.
+static bool readTile(const Tiling& g, int t, vector<float>& e,
+                     vector<char>& source) {
+  int r0, c0, nr, nc;
+  tileBounds(g, t, r0, c0, nr, nc);
+  e.resize((size_t)nr*nc);
+  source.assign(e.size(), 0);
+  float ndval = g.dem.h.ndval;
+  for (int i = 0; i < nr; i++) {
+    if (!readGridRow(g.dem, r0+i, c0, nc, &e[(size_t)i*nc])) {return false;}
+  }
+  for (size_t k = 0; k < e.size(); k++) {
+    if (e[k] == ndval || e[k] <= 0) {e[k] = -1;}
+  }
+  if (!g.seeded) {return true;}
+  vector<float> row(nc);
+  for (int i = 0; i < nr; i++) {
+    if (!readGridRow(g.seeds, r0+i, c0, nc, row.data())) {return false;}
+    for (int j = 0; j < nc; j++) {
+      if (row[j] == g.seeds.h.ndval || row[j] == 0) {continue;}
+      e[(size_t)i*nc + j] = -1;
+      source[(size_t)i*nc + j] = 1;
+    }
+  }
+  return true;
+}
+
+//Floods a tile from its perimeter and seeds, whose levels must already be
+//in h, the same way priorityFlood() does, through N neighbours. With
+//label, the perimeter points and seeds must be labelled and the lowest
+//join of every pair of labels goes in joins.
+template <int N>
+static void floodTile(const vector<float>& e, const vector<char>& source,
+                      int nr, int nc, vector<float>& h, vector<int>* label,
+                      unordered_map<uint64_t, float>* joins) {
+  priority_queue<Cell, vector<Cell>, greater<Cell> > open;
+  queue<int> pit;
+  BitMask done;
+  done.assign(nr, nc);
+  for (int i = 0; i < nr; i++) {
+    for (int j = 0; j < nc; j++) {
+      int c = i*nc + j;
+      if (!onPerimeter(nr, nc, i, j) && !source[c]) {continue;}
+      done.set(c);
+      open.push(Cell(h[c], c));
+    }
+  }
+
+  while (!open.empty() || !pit.empty()) {
+    int c;
+    if (!pit.empty()) {c = pit.front(); pit.pop();}
+    else {c = open.top().second; open.pop();}
+    int next[N];
+    int count = neighbours<N>(c, nr, nc, next);
+    for (int k = 0; k < count; k++) {
+      int n = next[k];
+      if (done.testAndSet(n)) {
+        if (label && (*label)[n] != (*label)[c]) {
+          int a = min((*label)[c], (*label)[n]);
+          int b = max((*label)[c], (*label)[n]);
+          uint64_t key = (uint64_t)a << 32 | (uint32_t)b;
+          float w = max(h[c], h[n]);
+          unordered_map<uint64_t, float>::iterator found = joins->find(key);
+          if (found == joins->end()) {(*joins)[key] = w;}
+          else if (w < found->second) {found->second = w;}
+        }
+        continue;
+      }
+      if (label) {(*label)[n] = (*label)[c];}
+      if (e[n] <= h[c]) {
+        h[n] = h[c];
+        pit.push(n);
+      }
+      else {
+        h[n] = e[n];
+        open.push(Cell(e[n], n));
+      }
+    }
+  }
+}
+
+//First pass over tile t
+static bool joinTile(const Tiling& g, int t, TileGraph& tg) {
+  TRACE_SCOPE("join tile");
+  int r0, c0, nr, nc;
+  tileBounds(g, t, r0, c0, nr, nc);
+  vector<float> e;
+  vector<char> source;
+  if (!readTile(g, t, e, source)) {return false;}
+  vector<float> h(e.size());
+  vector<int> label(e.size(), -1);
+  int ocean = perimeterSize(nr, nc);
+  tg.perimeter.resize(ocean);
+  tg.sources.clear();
+  for (int i = 0; i < nr; i++) {
+    for (int j = 0; j < nc; j++) {
+      int c = i*nc + j;
+      if (!onPerimeter(nr, nc, i, j)) {
+        if (source[c]) {
+          label[c] = ocean;
+          h[c] = -1;
+        }
+        continue;
+      }
+      label[c] = perimeterIndex(nr, nc, i, j);
+      h[c] = e[c];
+      tg.perimeter[label[c]] = e[c];
+      if (source[c]) {tg.sources.push_back(label[c]);}
+    }
+  }
+  unordered_map<uint64_t, float> joins;
+  if (g.connectivity == 8) {floodTile<8>(e, source, nr, nc, h, &label, &joins);}
+  else {floodTile<4>(e, source, nr, nc, h, &label, &joins);}
+  tg.joins.clear();
+  tg.joins.reserve(joins.size());
+  for (unordered_map<uint64_t, float>::iterator it = joins.begin();
+       it != joins.end(); ++it) {
+    Join j = {(long)(it->first >> 32), (long)(uint32_t)it->first, it->second};
+    tg.joins.push_back(j);
+  }
+  return true;
+}
+
+//Second pass over tile t, given the final levels of its perimeter
+static bool fillTile(const Tiling& g, int t, const float* perimeter,
+                     const GridFile& out) {
+  TRACE_SCOPE("fill tile");
+  int r0, c0, nr, nc;
+  tileBounds(g, t, r0, c0, nr, nc);
+  vector<float> e;
+  vector<char> source;
+  if (!readTile(g, t, e, source)) {return false;}
+  vector<float> h(e.size());
+  for (int i = 0; i < nr; i++) {
+    for (int j = 0; j < nc; j++) {
+      if (onPerimeter(nr, nc, i, j)) {
+        h[i*nc + j] = perimeter[perimeterIndex(nr, nc, i, j)];
+      }
+      else if (source[i*nc + j]) {h[i*nc + j] = -1;}
+    }
+  }
+  if (g.connectivity == 8) {floodTile<8>(e, source, nr, nc, h, NULL, NULL);}
+  else {floodTile<4>(e, source, nr, nc, h, NULL, NULL);}
+  for (int i = 0; i < nr; i++) {
+    if (!writeGridRow(out, r0+i, c0, nc, &h[(size_t)i*nc])) {return false;}
+  }
+  return true;
+}
+
+//Runs work(t) for every tile, each thread taking the next tile as it
+//finishes one. Returns false if any call did.
+template <typename Work>
+static bool forEachTile(int count, int nthreads, Work work) {
+  atomic<int> next(0);
+  atomic<bool> ok(true);
+  auto run = [&] {
+    int t;
+    while (ok && (t = next++) < count) {
+      if (!work(t)) {ok = false;}
+    }
+  };
+  vector<thread> threads;
+  for (int k = 1; k < nthreads; k++) {threads.push_back(thread(run));}
+  run();
+  for (size_t k = 0; k < threads.size(); k++) {threads[k].join();}
+  return ok;
+}
+
+bool tiledFlood(const char* demfile, const char* seedfile,
+                const char* heightsfile, int tile, int connectivity,
+                int nthreads) {
+  Tiling g;
+  if (!openGridFile(demfile, g.dem, false)) {
+    printf("cannot read binary grid %s\n", demfile);
+    return false;
+  }
+  g.seeded = seedfile != NULL;
+  if (g.seeded && !openGridFile(seedfile, g.seeds, false)) {
+    printf("cannot read binary grid %s\n", seedfile);
+    closeGridFile(g.dem);
+    return false;
+  }
+  if (g.seeded && (g.seeds.h.nrows != g.dem.h.nrows ||
+      g.seeds.h.ncols != g.dem.h.ncols)) {
+    printf("seed grid %s is not the size of %s\n", seedfile, demfile);
+    closeGridFile(g.seeds);
+    closeGridFile(g.dem);
+    return false;
+  }
+  if (nthreads < 1) {nthreads = 1;}
+  g.connectivity = connectivity;
+  g.rows = g.dem.h.nrows;
+  g.cols = g.dem.h.ncols;
+  g.tile = max(tile, 3);
+  g.tileRows = (g.rows + g.tile - 1) / g.tile;
+  g.tileCols = (g.cols + g.tile - 1) / g.tile;
+  int ntiles = g.tileRows * g.tileCols;
+  printf("Flooding %d tiles of %d by %d points\n", ntiles, g.tile, g.tile);
+
+  //First pass: the joins inside each tile
+  vector<TileGraph> graphs(ntiles);
+  if (!forEachTile(ntiles, nthreads,
+      [&](int t) {return joinTile(g, t, graphs[t]);})) {
+    printf("cannot read %s\n", demfile);
+    if (g.seeded) {closeGridFile(g.seeds);}
+    closeGridFile(g.dem);
+    return false;
+  }
+
+  //The graph of all perimeter points, as adjacency lists in one array. The
+  //last node is the ocean the seeds inside the tiles belong to.
+  vector<long> nodeBase(ntiles + 1, 0);
+  for (int t = 0; t < ntiles; t++) {
+    nodeBase[t+1] = nodeBase[t] + graphs[t].perimeter.size();
+  }
+  long ocean = nodeBase[ntiles];
+  long nodes = ocean + 1;
+  vector<Join> joins;
+  for (int t = 0; t < ntiles; t++) {
+    vector<Join>& tj = graphs[t].joins;
+    int size = graphs[t].perimeter.size();
+    for (size_t k = 0; k < tj.size(); k++) {
+      Join j = {nodeBase[t] + tj[k].a,
+        tj[k].b == size ? ocean : nodeBase[t] + tj[k].b, tj[k].w};
+      joins.push_back(j);
+    }
+    vector<Join>().swap(tj);
+  }
+  //Neighbouring points of two tiles join at the higher of the two
+  auto link = [&](int t, int i, int j, int u, int ui, int uj) {
+    int r0, c0, nr, nc, ur0, uc0, unr, unc;
+    tileBounds(g, t, r0, c0, nr, nc);
+    tileBounds(g, u, ur0, uc0, unr, unc);
+    if (ui < 0 || ui >= unr || uj < 0 || uj >= unc) {return;}
+    int a = perimeterIndex(nr, nc, i, j);
+    int b = perimeterIndex(unr, unc, ui, uj);
+    Join l = {nodeBase[t] + a, nodeBase[u] + b,
+      max(graphs[t].perimeter[a], graphs[u].perimeter[b])};
+    joins.push_back(l);
+  };
+  for (int t = 0; t < ntiles; t++) {
+    int r0, c0, nr, nc;
+    tileBounds(g, t, r0, c0, nr, nc);
+    int tr = t / g.tileCols, tc = t % g.tileCols;
+    bool diagonal = g.connectivity == 8;
+    if (tc+1 < g.tileCols) {
+      for (int i = 0; i < nr; i++) {
+        link(t, i, nc-1, t+1, i, 0);
+        if (diagonal) {
+          link(t, i, nc-1, t+1, i-1, 0);
+          link(t, i, nc-1, t+1, i+1, 0);
+        }
+      }
+    }
+    if (tr+1 < g.tileRows) {
+      int u = t + g.tileCols;
+      for (int j = 0; j < nc; j++) {
+        link(t, nr-1, j, u, 0, j);
+        if (diagonal) {
+          link(t, nr-1, j, u, 0, j-1);
+          link(t, nr-1, j, u, 0, j+1);
+        }
+      }
+      //The corners of the tiles below to the right and left
+      if (diagonal && tc+1 < g.tileCols) {link(t, nr-1, nc-1, u+1, 0, 0);}
+      if (diagonal && tc > 0) {link(t, nr-1, 0, u-1, 0, g.tile-1);}
+    }
+  }
+  vector<long> first(nodes + 1, 0);
+  for (size_t k = 0; k < joins.size(); k++) {
+    first[joins[k].a + 1]++;
+    first[joins[k].b + 1]++;
+  }
+  for (long v = 0; v < nodes; v++) {first[v+1] += first[v];}
+  vector<pair<long, float> > adjacent(first[nodes]);
+  vector<long> fill(first.begin(), first.end() - 1);
+  for (size_t k = 0; k < joins.size(); k++) {
+    adjacent[fill[joins[k].a]++] = make_pair(joins[k].b, joins[k].w);
+    adjacent[fill[joins[k].b]++] = make_pair(joins[k].a, joins[k].w);
+  }
+  vector<Join>().swap(joins);
+  vector<long>().swap(fill);
+
+  //Second pass: the ocean on the border of the grid and the seeds flood at
+  //-1, and the rest of the perimeter points at the lowest level of any path
+  //to them
+  vector<float> level(nodes, INFINITY);
+  priority_queue<Node, vector<Node>, greater<Node> > open;
+  level[ocean] = -1;
+  open.push(Node(-1, ocean));
+  for (int t = 0; t < ntiles; t++) {
+    for (size_t k = 0; k < graphs[t].sources.size(); k++) {
+      long p = nodeBase[t] + graphs[t].sources[k];
+      level[p] = -1;
+      open.push(Node(-1, p));
+    }
+    int r0, c0, nr, nc;
+    tileBounds(g, t, r0, c0, nr, nc);
+    for (int i = 0; i < nr; i++) {
+      for (int j = 0; j < nc; j++) {
+        if (!onPerimeter(nr, nc, i, j)) {continue;}
+        int gi = r0+i, gj = c0+j;
+        if (gi != 0 && gi != g.rows-1 && gj != 0 && gj != g.cols-1) {continue;}
+        int p = perimeterIndex(nr, nc, i, j);
+        if (graphs[t].perimeter[p] == -1) {
+          level[nodeBase[t] + p] = -1;
+          open.push(Node(-1, nodeBase[t] + p));
+        }
+      }
+    }
+    vector<float>().swap(graphs[t].perimeter);
+    vector<int>().swap(graphs[t].sources);
+  }
+  while (!open.empty()) {
+    Node c = open.top();
+    open.pop();
+    if (c.first > level[c.second]) {continue;}
+    for (long k = first[c.second]; k < first[c.second + 1]; k++) {
+      float w = max(c.first, adjacent[k].second);
+      if (w < level[adjacent[k].first]) {
+        level[adjacent[k].first] = w;
+        open.push(Node(w, adjacent[k].first));
+      }
+    }
+  }
+  vector<pair<long, float> >().swap(adjacent);
+
+  GridFile out;
+  out.h = g.dem.h;
+  if (!openGridFile(heightsfile, out, true)) {
+    printf("cannot open %s\n", heightsfile);
+    if (g.seeded) {closeGridFile(g.seeds);}
+    closeGridFile(g.dem);
+    return false;
+  }
+  bool ok = forEachTile(ntiles, nthreads,
+    [&](int t) {return fillTile(g, t, &level[nodeBase[t]], out);});
+  if (!closeGridFile(out)) {ok = false;}
+  if (g.seeded) {closeGridFile(g.seeds);}
+  closeGridFile(g.dem);
+  if (!ok) {
+    printf("cannot write %s\n", heightsfile);
+    remove(heightsfile);
+  }
+  return ok;
+}
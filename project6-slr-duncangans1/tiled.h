@@ -0,0 +1,36 @@
+/* tiled.h
+
+  Out-of-core priority flooding, for terrain grids bigger than memory. The
+  grid is read from its binary form in square tiles, so only a few tiles
+  are in memory at once, and the result is exactly what priorityFlood()
+  gives for the whole grid.
+
+  A point floods at the lowest level over all paths to the ocean of the
+  highest point on the path, so inside a tile only the perimeter matters
+  to the rest of the grid. The work is done in two passes over the tiles:
+
+    1. Each tile is flooded from its perimeter, every perimeter point with
+       its own label. Where two labels meet, the level at which they join
+       is kept. These joins, plus the links between neighbouring tiles,
+       make a small graph of all perimeter points.
+    2. The graph is solved from the ocean on the border of the grid and
+       the seeds, which gives the final level of every perimeter point. Each tile is then
+       flooded again from its perimeter at those levels and written out.
+
+*/
+
+#ifndef TILED_H
+#define TILED_H
+
+//Floods the binary grid demfile in tiles of tile*tile points on nthreads
+//threads, and writes the lowest level at which each point connects to the
+//ocean to heightsfile, a binary grid with the same header. Ocean is -1
+//and points that never connect are INFINITY. seedfile, if not NULL, is a
+//binary grid of the same size whose points that are not 0 or NODATA are
+//ocean as well. Water flows through 4 or 8 neighbours, as connectivity
+//says. Prints a message and returns false on error.
+bool tiledFlood(const char* demfile, const char* seedfile,
+                const char* heightsfile, int tile, int connectivity,
+                int nthreads);
+
+#endif
@@ -0,0 +1,170 @@
+/* trace.cpp
+
+  Timers, counters and the Chrome trace, see trace.h. All state is behind
+  one lock. Times are on a monotonic clock, in microseconds since the first
+  use, which is what the trace format expects.
+
+*/
+
+#include "trace.h"
+
+#include <stdlib.h>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+#ifdef SLR_TRACE
+
+struct TraceTotal {
+  long calls;
+  double seconds;
+};
+
+struct TraceValue {
+  double last, highest;
+};
+
+//One complete scope ('X') or counter value ('C') of the trace
+struct TraceEvent {
+  const char* name;
+  char phase;
+  int thread;
+  double start, length;
+};
+
+static mutex traceLock;
+static map<string, TraceTotal> timers;
+static map<string, long> counters;
+static map<string, TraceValue> samples;
+static map<thread::id, int> threads;
+static vector<TraceEvent> events;
+static bool recording = false;
+static const char* traceFile = NULL;
+bool tracing = false;
+
+double traceNow() {
+  //Microseconds since the first call
+  static const chrono::steady_clock::time_point first =
+    chrono::steady_clock::now();
+  return chrono::duration<double, micro>(
+    chrono::steady_clock::now() - first).count();
+}
+
+static int threadNumber() {
+  //Small numbers for the threads, in the order they are seen. Called with
+  //the lock held.
+  thread::id id = this_thread::get_id();
+  map<thread::id, int>::iterator t = threads.find(id);
+  if (t != threads.end()) {return t->second;}
+  int n = threads.size() + 1;
+  threads[id] = n;
+  return n;
+}
+
+void traceEnd(const char* name, double start) {
+  double end = traceNow();
+  lock_guard<mutex> hold(traceLock);
+  TraceTotal& t = timers[name];
+  t.calls++;
+  t.seconds += (end - start) / 1e6;
+  if (recording) {
+    TraceEvent e = {name, 'X', threadNumber(), start, end - start};
+    events.push_back(e);
+  }
+}
+
+void traceCount(const char* name, long n) {
+  lock_guard<mutex> hold(traceLock);
+  counters[name] += n;
+}
+
+void traceSample(const char* name, double value) {
+  double at = traceNow();
+  lock_guard<mutex> hold(traceLock);
+  map<string, TraceValue>::iterator s = samples.find(name);
+  if (s == samples.end()) {
+    TraceValue v = {value, value};
+    samples[name] = v;
+  }
+  else {
+    s->second.last = value;
+    if (value > s->second.highest) {s->second.highest = value;}
+  }
+  if (recording) {
+    TraceEvent e = {name, 'C', threadNumber(), at, value};
+    events.push_back(e);
+  }
+}
+
+static void writeTrace() {
+  //Writes the events at exit, then the report
+  {
+    lock_guard<mutex> hold(traceLock);
+    recording = false;
+    FILE* f = fopen(traceFile, "w");
+    if (f == NULL) {printf("cannot write trace %s\n", traceFile);}
+    else {
+      fprintf(f, "{\"traceEvents\": [");
+      for (size_t k = 0; k < events.size(); k++) {
+        const TraceEvent& e = events[k];
+        fprintf(f, "%s\n{\"name\": \"%s\", \"ph\": \"%c\", \"pid\": 1, "
+          "\"tid\": %d, \"ts\": %.3f, ", k ? "," : "", e.name, e.phase,
+          e.thread, e.start);
+        if (e.phase == 'X') {fprintf(f, "\"dur\": %.3f}", e.length);}
+        else {fprintf(f, "\"args\": {\"value\": %.10g}}", e.length);}
+      }
+      fprintf(f, "\n]}\n");
+      fclose(f);
+      printf("Wrote trace %s with %lu events\n", traceFile,
+        (unsigned long)events.size());
+    }
+  }
+  traceReport(stdout);
+}
+
+bool traceOpen(const char* filename) {
+  lock_guard<mutex> hold(traceLock);
+  if (!recording) {atexit(writeTrace);}
+  traceFile = filename;
+  recording = true;
+  tracing = true;
+  traceNow();
+  return true;
+}
+
+void traceReport(FILE* f) {
+  lock_guard<mutex> hold(traceLock);
+  fprintf(f, "Timers, counters and samples:\n");
+  for (map<string, TraceTotal>::iterator t = timers.begin();
+       t != timers.end(); ++t) {
+    fprintf(f, "  %-24s %10.6f seconds in %ld calls\n", t->first.c_str(),
+      t->second.seconds, t->second.calls);
+  }
+  for (map<string, long>::iterator c = counters.begin();
+       c != counters.end(); ++c) {
+    fprintf(f, "  %-24s %ld\n", c->first.c_str(), c->second);
+  }
+  for (map<string, TraceValue>::iterator s = samples.begin();
+       s != samples.end(); ++s) {
+    fprintf(f, "  %-24s last %.10g, highest %.10g\n", s->first.c_str(),
+      s->second.last, s->second.highest);
+  }
+  fflush(f);
+}
+
+#else
+
+bool traceOpen(const char* filename) {
+  printf("built without tracing, cannot write %s (make TRACE=1)\n",
+    filename);
+  return false;
+}
+
+void traceReport(FILE* f) {}
+
+#endif
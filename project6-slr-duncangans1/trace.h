@@ -0,0 +1,67 @@
+/* trace.h
+
+  Timers and counters for seeing where the time goes on a particular grid.
+  TRACE_SCOPE(name) times the rest of the enclosing block, TRACE_COUNT(name,
+  n) adds n to a counter, and TRACE_SAMPLE(name, v) records the value of
+  something that changes, such as the size of a frontier. Totals are kept
+  per name and can be printed with traceReport(). After traceOpen(file) every
+  scope and sample is also kept as an event, and the events are written at
+  exit as a Chrome trace (JSON for chrome://tracing or Perfetto).
+
+  Everything is compiled in when SLR_TRACE is defined (make TRACE=1, the
+  default); otherwise the macros are empty and cost nothing. Until
+  traceOpen() is called they only test a flag. After it, scopes and
+  counters take a lock, so they belong around work of a few microseconds
+  or more: count in a local variable in inner loops and add it up once.
+
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+
+#ifdef SLR_TRACE
+
+//Set by traceOpen(), before any threads are started
+extern bool tracing;
+
+double traceNow();
+void traceEnd(const char* name, double start);
+void traceCount(const char* name, long n);
+void traceSample(const char* name, double value);
+
+//Times the block it is in when name is not NULL
+struct TraceScope {
+  const char* name;
+  double start;
+  TraceScope(const char* name) : name(name), start(name ? traceNow() : 0) {}
+  ~TraceScope() {if (name) {traceEnd(name, start);}}
+};
+
+#define TRACE_JOIN2(a, b) a##b
+#define TRACE_JOIN(a, b) TRACE_JOIN2(a, b)
+#define TRACE_SCOPE(name) \
+  TraceScope TRACE_JOIN(traceScope, __LINE__)(tracing ? name : NULL)
+#define TRACE_COUNT(name, n) do {if (tracing) {traceCount(name, n);}} while (0)
+#define TRACE_SAMPLE(name, value) \
+  do {if (tracing) {traceSample(name, value);}} while (0)
+
+#else
+
+#define TRACE_SCOPE(name) do {} while (0)
+#define TRACE_COUNT(name, n) do {(void)sizeof(n);} while (0)
+#define TRACE_SAMPLE(name, value) do {(void)sizeof(value);} while (0)
+
+#endif
+
+//Starts keeping events for a Chrome trace, written to filename at exit
+//along with a report on stdout. Prints a message and returns false if the
+//program was built without tracing.
+bool traceOpen(const char* filename);
+
+//Prints the total time and number of calls of every scope, every counter,
+//and the last and highest value of every sample
+void traceReport(FILE* f);
+
+#endif